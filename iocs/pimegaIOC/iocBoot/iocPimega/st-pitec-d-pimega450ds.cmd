@@ -18,7 +18,8 @@ epicsEnvSet("QSIZE",  "20")
 epicsEnvSet("XSIZE",  "15360")
 # The maximim image height; used for column profiles in the NDPluginStats plugin
 epicsEnvSet("YSIZE",  "512")
-# Number of Elements
+# Number of Elements, the raw frame size. Raise it to the corrected frame size
+# when the geometry correction is on, see pimega.template
 epicsEnvSet("NELEMENTS", "7864320")
 # The maximum number of time seried points in the NDPluginStats plugin
 epicsEnvSet("NCHANS", "2048")
@@ -71,10 +72,24 @@ epicsEnvSet("EPICS_CA_MAX_ARRAY_BYTES", "99999999")
 #              BackendPort         # select the backend port for commands and status
 #              BackendPortFrame    # select the backend port for frame receiving
 #              IntAcqResetRDMA     # Reset the RDMA buffer before the acquisition (true -> 1 or false - > 0)
+#              frameTransport      # How visualizer frames reach the NDArrays (0: copy, 1: zero-copy, 2: pre-allocated ring, 3: shared memory, 4: per module streams). Defaults to 0.
+#              frameBuffers        # Number of receive buffers for frameTransport 2, of shared memory slots for 3, or of frames assembled at once for 4. 0 selects the default (8).
+#              frameQueueSize      # Number of frames queued for the plugins before frames are dropped. 0 selects the default (16).
+#              frameThreads        # Number of worker threads for the frame kernels. 0 uses every CPU, up to 8.
+#              hugePages           # Huge pages for the received frame buffers. 0:off; 1:transparent; 2:hugetlbfs (vm.nr_hugepages), else transparent.
+
+# pimegaThreadPlacement(thread, cpus, priority, numaNode) pins the driver threads before they start.
+#              thread              # receive, dispatch, workers, acquire, capture, alarm, or buffers for the frame buffers.
+#              cpus                # CPU list such as "2-5,8". Empty runs the thread on the CPUs of numaNode, if any.
+#              priority            # SCHED_FIFO priority, 0 keeps the default scheduler. Needs CAP_SYS_NICE or an rtprio limit.
+#              numaNode            # Node the memory of the thread comes from. Empty, omitted or none for none. The buffers default to the receive node.
+#pimegaThreadPlacement("receive", "2-3", 80, 0)
+#pimegaThreadPlacement("dispatch", "4", 70, 0)
+#pimegaThreadPlacement("workers", "5-11", 0, 0)
 
 pimegaDetectorConfig("$(PORT)",$(PIMEGA_MODULE01_IP),$(PIMEGA_MODULE02_IP),$(PIMEGA_MODULE03_IP),$(PIMEGA_MODULE04_IP),$(PIMEGA_MODULE05_IP),$(PIMEGA_MODULE06_IP),$(PIMEGA_MODULE07_IP),$(PIMEGA_MODULE08_IP),$(PIMEGA_MODULE09_IP),$(PIMEGA_MODULE10_IP),$(PIMEGA_PORT), $(XSIZE), $(YSIZE), $(DMODEL), 0, 0, 0, 0, 0, 1, 1, 5412, 6464, 1)
 
-dbLoadRecords("$(ADPIMEGA)/db/pimega.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
+dbLoadRecords("$(ADPIMEGA)/db/pimega.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1,NELEMENTS=$(NELEMENTS)")
 dbLoadRecords("$(ADPIMEGA)/db/NDFile.template","P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
 
 # Load asynRecord record
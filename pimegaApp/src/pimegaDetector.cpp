@@ -5,6 +5,7 @@
 
 #include "pimegaDetector.h"
 #include <bits/stdint-uintn.h>
+#include <cmath>
 #include <cstddef>
 #include <cstdio>
 #include <cstring>
@@ -20,12 +21,30 @@ static void alarmTaskC(void *drvPvt) {
 }
 
 void pimegaDetector::alarmTask() {
+  pimegaApplyPlacement(PIMEGA_THREAD_ALARM);
   /* Loop forever */
   while (true) {
     if (pimega->temperature.alarm_enable) {
       pimegaDetector::getTemperatureHighest();
       pimegaDetector::getTemperatureStatus();
     }
+    /* Frame queue statistics */
+    lock();
+    setIntegerParam(PimegaFrameQueueDepth, (int)frameQueue->size());
+    setIntegerParam(PimegaFrameQueueDropped, (int)framesDropped);
+    if (moduleAssembler)
+      setIntegerParam(PimegaIncompleteFrames, (int)moduleAssembler->getNumIncomplete());
+    setIntegerParam(PimegaHugePageBuffers, framePool->getNumHugeBuffers());
+    publishFrameTiming();
+    publishPollRates();
+    publishModuleMetrics();
+    setIntegerParam(PimegaStatusMsgEmitted, (int)statusPublisher->getNumMessagesEmitted());
+    setIntegerParam(PimegaStatusMsgSuppressed,
+                    (int)statusPublisher->getNumMessagesSuppressed());
+    setIntegerParam(PimegaStatusParamEmitted, (int)statusPublisher->getNumParamsEmitted());
+    setIntegerParam(PimegaStatusParamSuppressed, (int)statusPublisher->getNumParamsSuppressed());
+    callParamCallbacks();
+    unlock();
     epicsThreadSleep(1.0);
   }
 }
@@ -37,21 +56,878 @@ static void acquisitionTaskC(void *drvPvt) {
 
 void pimegaDetector::updateEpicsFrame(vis_dtype* data) {
 
-  int sizex, sizey;
-  getIntegerParam(ADMaxSizeX, &sizex);
-  getIntegerParam(ADMaxSizeY, &sizey);
+  /* ADMaxSizeX is the size of the published frames, which differs from the
+   * received ones when the geometry is corrected */
+  int sizex = maxSizeX, sizey = maxSizeY;
 
   PIMEGA_PRINT(pimega, TRACE_MASK_FLOW, "updateEpicsFrame\n");
 
   size_t array_dims[2] = { sizex, sizey };
+  double arrival = pimegaArrivalTime();
+  uint64_t start = pimegaTimeNs(), allocated;
 
-  PimegaNDArray = this->pNDArrayPool->alloc(2, array_dims, vis_ndarray_dtype, 0, NULL);
+  PimegaNDArray = framePool->allocFrame(2, array_dims, vis_ndarray_dtype,
+                                        sizex * sizey * sizeof(vis_dtype));
+  if (!PimegaNDArray) {
+    PIMEGA_PRINT(pimega, TRACE_MASK_ERROR, "%s: unable to allocate the frame\n", __func__);
+    return;
+  }
+  allocated = pimegaTimeNs();
   memcpy(PimegaNDArray->pData, data, PimegaNDArray->dataSize);
-  updateTimeStamp(&PimegaNDArray->epicsTS);
-  this->getAttributes(PimegaNDArray->pAttributeList);
-  doCallbacksGenericPointer(PimegaNDArray, NDArrayData, 0);
-  PimegaNDArray->release();
+  frameTiming[PIMEGA_STAGE_ALLOC].add(allocated - start);
+  frameTiming[PIMEGA_STAGE_COPY].add(pimegaTimeNs() - allocated);
+  PimegaNDArray->timeStamp = arrival;
+  publishFrame(PimegaNDArray);
+}
+
+/** Hands a received frame to the dispatch thread. Runs on the receive thread,
+ * so the plugins never hold up ZMQ. When the queue is full the frame queue
+ * policy decides which frame is lost, or makes the receive thread wait. */
+void pimegaDetector::publishFrame(NDArray *pArray) {
+  NDArray *pOldest;
+
+  /* Preview: only the newest frame is kept, the previous one is overwritten */
+  if (previewActive) {
+    pOldest = previewFrame.exchange(pArray);
+    if (pOldest) pOldest->release();
+    epicsEventSignal(frameQueuedEventId_);
+    return;
+  }
+
+  while (!frameQueue->push(pArray)) {
+    if (frameQueuePolicy == PIMEGA_FRAME_QUEUE_DROP_NEWEST) {
+      pArray->release();
+      framesDropped++;
+      return;
+    } else if (frameQueuePolicy == PIMEGA_FRAME_QUEUE_BLOCK) {
+      /* Timeout so a policy change is noticed while waiting */
+      epicsEventWaitWithTimeout(frameDequeuedEventId_, 0.1);
+    } else {
+      pOldest = frameQueue->pop();
+      if (pOldest) {
+        pOldest->release();
+        framesDropped++;
+      }
+    }
+  }
+  epicsEventSignal(frameQueuedEventId_);
+}
+
+static void dispatchTaskC(void *drvPvt) {
+  pimegaDetector *pPvt = (pimegaDetector *)drvPvt;
+  pPvt->dispatchTask();
+}
+
+/** Returns the preview frame if one is waiting and the preview rate allows
+ * sending it now. Otherwise delay is set to the time left until it does. */
+NDArray *pimegaDetector::takePreviewFrame(double *delay) {
+  uint64_t now;
+  double elapsed;
+  NDArray *pArray;
+
+  *delay = 0;
+  if (!previewFrame.load()) return NULL;
+
+  now = pimegaTimeNs();
+  elapsed = (now - lastPreviewTime_) / 1e9;
+  if (elapsed < previewPeriod) {
+    *delay = previewPeriod - elapsed;
+    return NULL;
+  }
+  pArray = previewFrame.exchange(NULL);
+  if (pArray) lastPreviewTime_ = now;
+  return pArray;
+}
+
+/** Sends the queued frames, and then the preview frame, to the plugins and
+ * drops the driver reference to them. For zero-copy frames the receive buffer
+ * is freed when the last plugin releases the NDArray. */
+void pimegaDetector::dispatchTask() {
+  NDArray *pArray;
+  double delay, arrival;
+  uint64_t start, processed, attributes;
+  int size;
+
+  pimegaApplyPlacement(PIMEGA_THREAD_DISPATCH);
+  while (true) {
+    pArray = frameQueue->pop();
+    if (!pArray) pArray = takePreviewFrame(&delay);
+    if (!pArray) {
+      if (delay > 0)
+        epicsEventWaitWithTimeout(frameQueuedEventId_, delay);
+      else
+        epicsEventWait(frameQueuedEventId_);
+      continue;
+    }
+    epicsEventSignal(frameDequeuedEventId_);
+    arrival = pArray->timeStamp;
+    frameTiming[PIMEGA_STAGE_QUEUE].addSeconds(pimegaArrivalTime() - arrival);
+
+    lock();
+    start = pimegaTimeNs();
+    pArray = processFrame(pArray);
+    processed = pimegaTimeNs();
+    frameTiming[PIMEGA_STAGE_PROCESS].add(processed - start);
+    if (pArray) {
+      pArray->timeStamp = pimegaWallTime() - (pimegaArrivalTime() - arrival);
+      updateTimeStamp(&pArray->epicsTS);
+      this->getAttributes(pArray->pAttributeList);
+      attributes = pimegaTimeNs();
+      doCallbacksGenericPointer(pArray, NDArrayData, 0);
+      frameTiming[PIMEGA_STAGE_ATTRIBUTES].add(attributes - processed);
+      frameTiming[PIMEGA_STAGE_CALLBACKS].add(pimegaTimeNs() - attributes);
+      frameTiming[PIMEGA_STAGE_TOTAL].addSeconds(pimegaArrivalTime() - arrival);
+      getIntegerParam(NDArraySize, &size);
+      framesPublished_++;
+      bytesPublished_ += size;
+      callParamCallbacks();
+    }
+    unlock();
+    if (pArray) pArray->release();
+  }
+}
+
+/** Publishes the frame rate, data rate and latencies of the frame path since
+ * the previous call. Latencies are in ms. Called with the lock held. */
+void pimegaDetector::publishFrameTiming(void) {
+  double p50[PIMEGA_NUM_STAGES], p99[PIMEGA_NUM_STAGES], max[PIMEGA_NUM_STAGES];
+  double bins[PIMEGA_TIMING_BUCKETS];
+  int histogram[PIMEGA_TIMING_BUCKETS];
+  pimegaStageLatency latency;
+  uint64_t now = pimegaTimeNs();
+  double interval = (now - lastTimingNs_) / 1e9;
+
+  for (int stage = 0; stage < PIMEGA_NUM_STAGES; stage++) {
+    frameTiming[stage].collect(&latency, stage == PIMEGA_STAGE_TOTAL ? histogram : NULL);
+    p50[stage] = latency.p50 * 1e3;
+    p99[stage] = latency.p99 * 1e3;
+    max[stage] = latency.max * 1e3;
+  }
+  for (int i = 0; i < PIMEGA_TIMING_BUCKETS; i++) bins[i] = pimegaStageTiming::bucketValue(i) * 1e3;
+
+  if (interval > 0) {
+    setDoubleParam(PimegaFrameRate, (framesPublished_ - lastFramesPublished_) / interval);
+    setDoubleParam(PimegaDataRate, (bytesPublished_ - lastBytesPublished_) / interval / 1e6);
+  }
+  lastTimingNs_ = now;
+  lastFramesPublished_ = framesPublished_;
+  lastBytesPublished_ = bytesPublished_;
+
+  setDoubleParam(PimegaLatencyP50, p50[PIMEGA_STAGE_TOTAL]);
+  setDoubleParam(PimegaLatencyP99, p99[PIMEGA_STAGE_TOTAL]);
+  setDoubleParam(PimegaLatencyMax, max[PIMEGA_STAGE_TOTAL]);
+  doCallbacksFloat64Array(p50, PIMEGA_NUM_STAGES, PimegaStageLatencyP50, 0);
+  doCallbacksFloat64Array(p99, PIMEGA_NUM_STAGES, PimegaStageLatencyP99, 0);
+  doCallbacksFloat64Array(max, PIMEGA_NUM_STAGES, PimegaStageLatencyMax, 0);
+  doCallbacksInt32Array(histogram, PIMEGA_TIMING_BUCKETS, PimegaLatencyHistogram, 0);
+  doCallbacksFloat64Array(bins, PIMEGA_TIMING_BUCKETS, PimegaLatencyHistogramBins, 0);
+}
+
+/** Publishes how often acqTask and captureTask woke up and polled since the
+ * previous call. Called with the lock held. */
+void pimegaDetector::publishPollRates(void) {
+  double pollRate, wakeupRate;
+
+  acqPoll_.collect(&pollRate, &wakeupRate);
+  setDoubleParam(PimegaAcqPollRate, pollRate);
+  setDoubleParam(PimegaAcqWakeupRate, wakeupRate);
+  capturePoll_.collect(&pollRate, &wakeupRate);
+  setDoubleParam(PimegaCapturePollRate, pollRate);
+  setDoubleParam(PimegaCaptureWakeupRate, wakeupRate);
+}
+
+/** Samples the backend counters and publishes their rates over the metric
+ * windows. Called once a second by alarmTask with the lock held. */
+void pimegaDetector::publishModuleMetrics(void) {
+  const int rxRate[] = {PimegaM1RxRate, PimegaM2RxRate, PimegaM3RxRate, PimegaM4RxRate};
+  const int lostRate[] = {PimegaM1LostRate, PimegaM2LostRate, PimegaM3LostRate, PimegaM4LostRate};
+  const int bufferTrend[] = {PimegaM1BufferTrend, PimegaM2BufferTrend, PimegaM3BufferTrend,
+                             PimegaM4BufferTrend};
+  const int timeToFull[] = {PimegaM1TimeToFull, PimegaM2TimeToFull, PimegaM3TimeToFull,
+                            PimegaM4TimeToFull};
+  double processed[PIMEGA_NUM_WINDOWS], saved[PIMEGA_NUM_WINDOWS];
+  pimegaStatusSnapshot snapshot;
+  pimegaModuleRates rates;
+
+  statusCache.read(&snapshot);
+  moduleMetrics.sample(snapshot.status, pimegaTimeNs() / 1e9);
+
+  for (int module = 0; module < PIMEGA_METRIC_MODULES; module++) {
+    moduleMetrics.moduleRates(module, &rates);
+    doCallbacksFloat64Array(rates.received, PIMEGA_NUM_WINDOWS, rxRate[module], 0);
+    doCallbacksFloat64Array(rates.lost, PIMEGA_NUM_WINDOWS, lostRate[module], 0);
+    doCallbacksFloat64Array(rates.bufferTrend, PIMEGA_NUM_WINDOWS, bufferTrend[module], 0);
+    setDoubleParam(timeToFull[module], rates.timeToFull);
+  }
+  moduleMetrics.backendRates(processed, saved);
+  doCallbacksFloat64Array(processed, PIMEGA_NUM_WINDOWS, PimegaProcessedRate, 0);
+  doCallbacksFloat64Array(saved, PIMEGA_NUM_WINDOWS, PimegaSavedRate, 0);
+}
+
+/** Builds the remap table of a geometry mode and sets it to be used from the
+ * next frame on. ADMaxSizeX/Y follow the corrected frame size, and so does
+ * the ROI when it covered the whole frame. Called with the lock held. */
+asynStatus pimegaDetector::updateRemap(int mode, const char *file, int chipGap, int moduleGap) {
+  pimegaRemap remap;
+  pimegaEdgeCorrection edges;
+  pimegaGeometry geometry;
+  std::string message, edgeMessage;
+  int rc = 0, oldSizeX, oldSizeY, sizeX, sizeY, newSizeX = maxSizeX, newSizeY = maxSizeY;
+
+  if (mode == PIMEGA_GEOMETRY_MODEL) {
+    if (pimegaGetGeometry(detectorModel, &geometry) != 0 ||
+        geometry.modulesX * geometry.chipsX * PIMEGA_CHIP_SIZE != maxSizeX ||
+        geometry.modulesY * geometry.chipsY * PIMEGA_CHIP_SIZE != maxSizeY) {
+      strncpy(pimega->error, "No module layout for this detector", sizeof(pimega->error));
+      return asynError;
+    }
+    rc = remap.buildFromGeometry(geometry, chipGap, moduleGap, message);
+    /* Without room in the gaps there is just no border correction */
+    edges.build(geometry, chipGap, moduleGap, edgeMessage);
+  } else if (mode == PIMEGA_GEOMETRY_FILE) {
+    rc = file[0] ? remap.buildFromFile(file, maxSizeX, maxSizeY, message) : 0;
+  }
+  if (rc != 0) {
+    snprintf(pimega->error, sizeof(pimega->error), "%s", message.c_str());
+    return asynError;
+  }
+
+  if (remap.valid()) {
+    newSizeX = remap.getSizeX();
+    newSizeY = remap.getSizeY();
+  }
+  getIntegerParam(ADMaxSizeX, &oldSizeX);
+  getIntegerParam(ADMaxSizeY, &oldSizeY);
+  getIntegerParam(ADSizeX, &sizeX);
+  getIntegerParam(ADSizeY, &sizeY);
+  setIntegerParam(ADMaxSizeX, newSizeX);
+  setIntegerParam(ADMaxSizeY, newSizeY);
+  if (sizeX == oldSizeX) setIntegerParam(ADSizeX, newSizeX);
+  if (sizeY == oldSizeY) setIntegerParam(ADSizeY, newSizeY);
+
+  std::swap(nextRemap_, remap);
+  std::swap(nextEdges_, edges);
+  remapChanged_ = true;
+  return asynSuccess;
+}
+
+/** Places the chips of a raw frame in the corrected geometry. The bands of
+ * the remap table are split over the frame workers. */
+NDArray *pimegaDetector::remapFrame(NDArray *pIn) {
+  NDArray *pOut;
+  size_t dims[2] = {(size_t)remap_.getSizeX(), (size_t)remap_.getSizeY()};
+  int numBands = remap_.getNumBands();
+  int numTasks = std::min(numBands, 2 * frameWorkers->getConcurrency());
+
+  /* Frames of another size, e.g. simulated ones, are left as they are */
+  if ((int)pIn->dims[0].size != remap_.getSrcSizeX() ||
+      (int)pIn->dims[1].size != remap_.getSrcSizeY())
+    return pIn;
+
+  pOut = this->pNDArrayPool->alloc(2, dims, NDUInt32, 0, NULL);
+  if (!pOut) {
+    PIMEGA_PRINT(pimega, TRACE_MASK_ERROR, "%s: unable to allocate the remapped frame\n",
+                 __func__);
+    pIn->release();
+    return NULL;
+  }
+  unlock();
+  frameWorkers->run(numTasks, [&](int task) {
+    remap_.apply((const uint32_t *)pIn->pData, (uint32_t *)pOut->pData,
+                 numBands * task / numTasks, numBands * (task + 1) / numTasks);
+  });
+  lock();
+  pIn->release();
+  return pOut;
+}
+
+/** Splits the counts of the large chip border pixels over the gap pixels
+ * they cover, one task per row of chips. Only frames remapped with the model
+ * geometry have the gaps. */
+void pimegaDetector::correctEdges(NDArray *pIn) {
+  int enable;
+  uint32_t *pData = (uint32_t *)pIn->pData;
+
+  getIntegerParam(PimegaEdgeCorrection, &enable);
+  if (!enable || !edges_.valid() || (int)pIn->dims[0].size != remap_.getSizeX() ||
+      (int)pIn->dims[1].size != remap_.getSizeY())
+    return;
+
+  unlock();
+  frameWorkers->run(edges_.getNumChipRows(), [&](int chipRow) { edges_.apply(pData, chipRow); });
+  lock();
+}
+
+/** Number of bits of the counters for the current counter depth */
+int pimegaDetector::counterBits(void) {
+  /* Indexed by the COUNTER_DEPTH enum */
+  static const int bits[] = {1, 12, 6, 24};
+  int counterDepth;
+
+  getIntegerParam(PimegaCounterDepth, &counterDepth);
+  if (counterDepth < 0 || counterDepth > 3) return 32;
+  return bits[counterDepth];
+}
+
+/** Number of bits needed for a binX x binY sum of counters of the current
+ * counter depth, in a frame that is the sum of summedFrames_ frames. A loaded
+ * gain can scale the counts past the counter range, so it needs all 32 bits. */
+int pimegaDetector::frameBits(int binX, int binY) {
+  int bits = counterBits();
+  int64_t numSummed = (int64_t)binX * binY * summedFrames_;
+
+  if (!gainMap_.empty()) return 32;
+  for (int64_t pixels = 1; pixels < numSummed; pixels <<= 1) bits++;
+  return bits;
+}
+
+/** Adds a received frame to the accumulator. Every numAccumulate frames the
+ * sum, or the mean, is written over the last frame, which is then processed
+ * like any other. Returns false when the frame was consumed, and released,
+ * by the accumulator. The frame rows are split in strips over the frame
+ * workers. Called with the lock held; it is dropped while the kernels run. */
+bool pimegaDetector::accumulateFrame(NDArray *pIn, int numAccumulate) {
+  uint32_t *pData = (uint32_t *)pIn->pData;
+  size_t numPixels = pIn->dims[0].size * pIn->dims[1].size;
+  int numStrips = (int)std::min(pIn->dims[1].size, (size_t)(2 * frameWorkers->getConcurrency()));
+  size_t stride = pIn->dims[0].size;
+  int mode;
+  uint32_t divisor;
+
+  if (accumulateReset_ || accumulator_.size() != numPixels) {
+    accumulator_.assign(numPixels, 0);
+    numAccumulated_ = 0;
+    accumulateReset_ = false;
+  }
+
+  unlock();
+  frameWorkers->run(numStrips, [&](int strip) {
+    size_t first = pIn->dims[1].size * strip / numStrips * stride;
+    size_t last = pIn->dims[1].size * (strip + 1) / numStrips * stride;
+    pimegaAccumulateFrame(&accumulator_[first], pData + first, last - first);
+  });
+  lock();
+  numAccumulated_++;
+  setIntegerParam(PimegaAccumulateCount, numAccumulated_);
+  if (numAccumulated_ < numAccumulate) {
+    pIn->release();
+    return false;
+  }
+
+  getIntegerParam(PimegaAccumulateMode, &mode);
+  divisor = mode == PIMEGA_ACCUMULATE_MEAN ? numAccumulated_ : 1;
+  unlock();
+  frameWorkers->run(numStrips, [&](int strip) {
+    size_t first = pIn->dims[1].size * strip / numStrips * stride;
+    size_t last = pIn->dims[1].size * (strip + 1) / numStrips * stride;
+    pimegaFinishAccumulation(&accumulator_[first], last - first, divisor, pData + first);
+  });
+  lock();
+
+  pIn->pAttributeList->add("PimegaAccumulatedFrames", "Frames summed in this frame",
+                           NDAttrInt32, &numAccumulated_);
+  if (mode != PIMEGA_ACCUMULATE_MEAN) summedFrames_ = numAccumulated_;
+  numAccumulated_ = 0;
+  return true;
+}
+
+/** Reads a raw map of maxSizeX x maxSizeY pixels of pixelSize bytes each,
+ * stored row by row like the frame */
+asynStatus pimegaDetector::loadPixelMap(const char *file, void *pMap, size_t pixelSize) {
+  size_t numPixels = (size_t)maxSizeX * maxSizeY;
+  size_t numRead;
+  FILE *fp;
+
+  fp = fopen(file, "rb");
+  if (!fp) {
+    snprintf(pimega->error, sizeof(pimega->error), "Unable to open %s", file);
+    return asynError;
+  }
+  numRead = fread(pMap, pixelSize, numPixels, fp);
+  if (numRead == numPixels && fgetc(fp) != EOF) numRead++;
+  fclose(fp);
+  if (numRead != numPixels) {
+    snprintf(pimega->error, sizeof(pimega->error), "%s is not a %dx%d map", file, maxSizeX,
+             maxSizeY);
+    return asynError;
+  }
+  return asynSuccess;
+}
+
+/** Checks that a flat field only holds finite gains that are not negative */
+asynStatus pimegaDetector::checkFlatField(const float *pGain, size_t numPixels) {
+  for (size_t i = 0; i < numPixels; i++) {
+    if (!std::isfinite(pGain[i]) || pGain[i] < 0) {
+      snprintf(pimega->error, sizeof(pimega->error), "Flat field gain %g at pixel %d",
+               (double)pGain[i], (int)i);
+      return asynError;
+    }
+  }
+  return asynSuccess;
+}
+
+/** Rebuilds the maps used by the correction stage from the loaded mask and
+ * flat field and from the sensors disabled by checkSensors() */
+void pimegaDetector::updateCorrection(int maskEnable, int flatEnable) {
+  size_t numPixels = (size_t)maxSizeX * maxSizeY;
+  pimegaGeometry geometry;
+  int numMasked = 0, x0, y0;
+
+  badPixels_.clear();
+  gainMap_.clear();
+  if (maskEnable) {
+    if (pixelMask_.empty())
+      badPixels_.assign(numPixels, 0);
+    else
+      badPixels_ = pixelMask_;
+
+    /* The chips can only be placed when the layout of the model is the frame */
+    if (pimegaGetGeometry(detectorModel, &geometry) == 0 &&
+        geometry.modulesX * geometry.chipsX * PIMEGA_CHIP_SIZE == maxSizeX &&
+        geometry.modulesY * geometry.chipsY * PIMEGA_CHIP_SIZE == maxSizeY) {
+      for (int module = 0; module < geometry.modulesX * geometry.modulesY &&
+                           module < pimega->max_num_modules;
+           module++) {
+        for (int chip = 0; chip < geometry.chipsX * geometry.chipsY &&
+                           chip < pimega->num_all_chips;
+             chip++) {
+          if (!pimega->sensor_disabled[module][chip]) continue;
+          pimegaChipOrigin(&geometry, module, chip, &x0, &y0);
+          for (int y = y0; y < y0 + PIMEGA_CHIP_SIZE; y++)
+            memset(&badPixels_[(size_t)y * maxSizeX + x0], 1, PIMEGA_CHIP_SIZE);
+        }
+      }
+    }
+
+    numMasked = (int)std::count_if(badPixels_.begin(), badPixels_.end(),
+                                   [](uint8_t bad) { return bad != 0; });
+    if (numMasked == 0) badPixels_.clear();
+  }
+
+  if (flatEnable && !flatField_.empty()) {
+    gainMap_ = flatField_;
+    for (size_t i = 0; i < badPixels_.size(); i++)
+      if (badPixels_[i]) gainMap_[i] = 0;
+  }
+
+  setIntegerParam(PimegaNumMaskedPixels, numMasked);
+  correctionChanged_ = false;
+}
+
+/** Applies the mask and the flat field in place to the rows minY to
+ * minY + sizeY - 1 of a received frame, in one pass over the pixels. The rows
+ * are split in strips over the frame workers. Called with the lock held; it
+ * is dropped while the kernels run. */
+void pimegaDetector::correctFrame(NDArray *pIn, int minY, int sizeY) {
+  int maskEnable, flatEnable;
+  size_t stride = pIn->dims[0].size;
+  size_t offset = (size_t)minY * stride;
+  uint32_t *pRows = (uint32_t *)pIn->pData + offset;
+  int numStrips;
+
+  getIntegerParam(PimegaMaskEnable, &maskEnable);
+  getIntegerParam(PimegaFlatFieldEnable, &flatEnable);
+  if (!maskEnable && !flatEnable) return;
+  if (correctionChanged_) updateCorrection(maskEnable, flatEnable);
+  if (badPixels_.empty() && gainMap_.empty()) return;
+
+  /* The maps are of the whole detector */
+  if ((int)stride != maxSizeX || (int)pIn->dims[1].size != maxSizeY) return;
+
+  numStrips = std::min(sizeY, 2 * frameWorkers->getConcurrency());
+  unlock();
+  frameWorkers->run(numStrips, [&](int strip) {
+    size_t first = (size_t)(sizeY * strip / numStrips);
+    size_t last = (size_t)(sizeY * (strip + 1) / numStrips);
+    if (!gainMap_.empty())
+      pimegaGainFrame(pRows + first * stride, stride, &gainMap_[offset + first * stride], stride,
+                      last - first);
+    else
+      pimegaMaskFrame(pRows + first * stride, stride, &badPixels_[offset + first * stride],
+                      stride, last - first);
+  });
+  lock();
+}
+
+/** Computes the statistics of the ROI of a received frame in one pass. The
+ * rows are split in strips over the frame workers. Called with the lock held;
+ * it is dropped while the kernels run. */
+void pimegaDetector::computeFrameStats(NDArray *pIn, int minX, int minY, int sizeX, int sizeY,
+                                       pimegaFrameStats *stats) {
+  int bits = counterBits();
+  uint64_t saturation = bits < 32 ? ((1ull << bits) - 1) * summedFrames_ : UINT32_MAX;
+  size_t stride = pIn->dims[0].size;
+  const uint32_t *pRoi = (const uint32_t *)pIn->pData + (size_t)minY * stride + minX;
+  int numStrips = std::min(sizeY, 2 * frameWorkers->getConcurrency());
+  std::vector<pimegaFrameStats> stripStats(numStrips);
+
+  unlock();
+  frameWorkers->run(numStrips, [&](int strip) {
+    int first = sizeY * strip / numStrips;
+    int last = sizeY * (strip + 1) / numStrips;
+    pimegaFrameStatsInit(&stripStats[strip]);
+    pimegaFrameStatsAdd(pRoi + (size_t)first * stride, stride, sizeX, last - first,
+                        (uint32_t)std::min(saturation, (uint64_t)UINT32_MAX), &stripStats[strip]);
+  });
+  lock();
+
+  pimegaFrameStatsInit(stats);
+  for (int i = 0; i < numStrips; i++) pimegaFrameStatsMerge(stats, &stripStats[i]);
+}
+
+/** Publishes frame statistics as PVs and as attributes of the frame */
+void pimegaDetector::publishFrameStats(const pimegaFrameStats *stats, NDArray *pArray) {
+  double total = (double)stats->total;
+  double minValue = stats->min;
+  double maxValue = stats->max;
+  double mean = stats->numPixels ? total / stats->numPixels : 0;
+  int numSaturated = (int)stats->numSaturated;
+  int numZeros = (int)stats->numZeros;
+
+  setDoubleParam(PimegaStatsTotal, total);
+  setDoubleParam(PimegaStatsMin, minValue);
+  setDoubleParam(PimegaStatsMax, maxValue);
+  setDoubleParam(PimegaStatsMean, mean);
+  setIntegerParam(PimegaStatsSaturated, numSaturated);
+  setIntegerParam(PimegaStatsZeros, numZeros);
+
+  NDAttributeList *pList = pArray->pAttributeList;
+  pList->add("PimegaStatsTotal", "Total counts", NDAttrFloat64, &total);
+  pList->add("PimegaStatsMin", "Minimum counts", NDAttrFloat64, &minValue);
+  pList->add("PimegaStatsMax", "Maximum counts", NDAttrFloat64, &maxValue);
+  pList->add("PimegaStatsMean", "Mean counts", NDAttrFloat64, &mean);
+  pList->add("PimegaStatsSaturated", "Saturated pixels", NDAttrInt32, &numSaturated);
+  pList->add("PimegaStatsZeros", "Pixels with no counts", NDAttrInt32, &numZeros);
+}
+
+/** Data type of the published frames. In auto mode this is the smallest type
+ * that holds a binX x binY sum of counters of the current depth. */
+NDDataType_t pimegaDetector::outputDataType(int binX, int binY) {
+  int outputType, bits;
+
+  getIntegerParam(PimegaOutputDataType, &outputType);
+  switch (outputType) {
+    case PIMEGA_OUTPUT_UINT8:
+      return NDUInt8;
+    case PIMEGA_OUTPUT_UINT16:
+      return NDUInt16;
+    case PIMEGA_OUTPUT_UINT32:
+      return NDUInt32;
+  }
+
+  bits = frameBits(binX, binY);
+  if (bits <= 8) return NDUInt8;
+  if (bits <= 16) return NDUInt16;
+  return NDUInt32;
+}
+
+/** Copies the ROI offset and binning of one frame to another */
+static void copyFrameDims(NDArray *pDst, const NDArray *pSrc) {
+  for (int i = 0; i < 2; i++) {
+    pDst->dims[i].offset = pSrc->dims[i].offset;
+    pDst->dims[i].binning = pSrc->dims[i].binning;
+  }
+}
+
+/** Allocates the output of a processing stage with the dims of pIn. A
+ * dataSize of 0 allocates the size of the dims. On failure pIn is released. */
+NDArray *pimegaDetector::allocFrame(NDArray *pIn, NDDataType_t dataType, size_t dataSize) {
+  NDArray *pOut;
+  size_t dims[2] = {pIn->dims[0].size, pIn->dims[1].size};
+
+  pOut = this->pNDArrayPool->alloc(2, dims, dataType, dataSize, NULL);
+  if (!pOut) {
+    PIMEGA_PRINT(pimega, TRACE_MASK_ERROR, "%s: unable to allocate the processed frame\n",
+                 __func__);
+    pIn->release();
+    return NULL;
+  }
+  copyFrameDims(pOut, pIn);
+  return pOut;
+}
+
+/** Converts a UInt32 frame to a narrower data type */
+NDArray *pimegaDetector::narrowFrame(NDArray *pIn, NDDataType_t dataType) {
+  NDArray *pOut = allocFrame(pIn, dataType, 0);
+  size_t numPixels = pIn->dims[0].size * pIn->dims[1].size;
+
+  if (!pOut) return NULL;
+  unlock();
+  if (dataType == NDUInt16)
+    pimegaNarrowFrame16((const uint32_t *)pIn->pData, numPixels, (uint16_t *)pOut->pData);
+  else
+    pimegaNarrowFrame8((const uint32_t *)pIn->pData, numPixels, (uint8_t *)pOut->pData);
+  lock();
+  pIn->release();
+  return pOut;
+}
+
+/** Packs a UInt32 frame to 1 or 6 bits per pixel. The result keeps the dims
+ * of the frame with the UInt8 type it unpacks to, and like a compressed
+ * NDArray it is marked with a codec, so plugins that do not know it skip it.
+ * The PimegaPackedBits attribute gives the packing. */
+NDArray *pimegaDetector::packFrame(NDArray *pIn, int bits) {
+  NDArray *pOut = allocFrame(pIn, NDUInt8, 0);
+  size_t numPixels = pIn->dims[0].size * pIn->dims[1].size;
+
+  if (!pOut) return NULL;
+  unlock();
+  if (bits == 1)
+    pimegaPackFrame1((const uint32_t *)pIn->pData, numPixels, (uint8_t *)pOut->pData);
+  else
+    pimegaPackFrame6((const uint32_t *)pIn->pData, numPixels, (uint8_t *)pOut->pData);
+  lock();
+  pOut->codec.name = bits == 1 ? PIMEGA_PACKED_CODEC_1BIT : PIMEGA_PACKED_CODEC_6BIT;
+  pOut->compressedSize = pimegaPackedSize(bits, numPixels);
+  pOut->pAttributeList->add("PimegaPackedBits", "Bits per pixel of the packed frame",
+                            NDAttrInt32, &bits);
+  pIn->release();
+  return pOut;
+}
+
+/** Converts a UInt32 frame to a sparse frame when at most threshold of its
+ * pixels have counts, otherwise returns pIn. The sparse frame is a 1-D UInt32
+ * NDArray of (index, count) pairs, see pimegaFrameOps.h, whose attributes
+ * give the size, offset and binning of the frame it comes from. The pixels
+ * are counted and then listed in strips over the frame workers. On failure
+ * pIn is released and NULL returned. */
+NDArray *pimegaDetector::sparseFrame(NDArray *pIn, double threshold) {
+  NDArray *pOut;
+  const uint32_t *pData = (const uint32_t *)pIn->pData;
+  int sizeX = (int)pIn->dims[0].size;
+  int sizeY = (int)pIn->dims[1].size;
+  int numStrips = std::min(sizeY, 2 * frameWorkers->getConcurrency());
+  /* Events before each strip */
+  std::vector<size_t> stripStart(numStrips + 1, 0);
+  size_t numEvents, dims[1];
+  int offsetX = (int)pIn->dims[0].offset, offsetY = (int)pIn->dims[1].offset;
+  int binX = pIn->dims[0].binning, binY = pIn->dims[1].binning;
+  int events;
+
+  unlock();
+  frameWorkers->run(numStrips, [&](int strip) {
+    size_t first = (size_t)(sizeY * strip / numStrips);
+    size_t last = (size_t)(sizeY * (strip + 1) / numStrips);
+    stripStart[strip + 1] = pimegaCountNonZero(pData + first * sizeX, (last - first) * sizeX);
+  });
+  lock();
+  for (int i = 0; i < numStrips; i++) stripStart[i + 1] += stripStart[i];
+  numEvents = stripStart[numStrips];
+
+  if (numEvents > threshold * sizeX * sizeY) {
+    setIntegerParam(PimegaSparseActive, 0);
+    return pIn;
+  }
+
+  /* An empty frame still gets a buffer */
+  dims[0] = 2 * numEvents;
+  pOut = this->pNDArrayPool->alloc(1, dims, NDUInt32,
+                                   std::max(dims[0], (size_t)2) * sizeof(uint32_t), NULL);
+  if (!pOut) {
+    PIMEGA_PRINT(pimega, TRACE_MASK_ERROR, "%s: unable to allocate the sparse frame\n",
+                 __func__);
+    pIn->release();
+    return NULL;
+  }
+
+  unlock();
+  frameWorkers->run(numStrips, [&](int strip) {
+    size_t first = (size_t)(sizeY * strip / numStrips);
+    size_t last = (size_t)(sizeY * (strip + 1) / numStrips);
+    pimegaSparseFrame(pData + first * sizeX, (last - first) * sizeX, (uint32_t)(first * sizeX),
+                      (uint32_t *)pOut->pData + 2 * stripStart[strip]);
+  });
+  lock();
+
+  events = (int)numEvents;
+  NDAttributeList *pList = pOut->pAttributeList;
+  pList->add("PimegaSparseSizeX", "Width of the sparse frame", NDAttrInt32, &sizeX);
+  pList->add("PimegaSparseSizeY", "Height of the sparse frame", NDAttrInt32, &sizeY);
+  pList->add("PimegaSparseOffsetX", "ROI start X of the sparse frame", NDAttrInt32, &offsetX);
+  pList->add("PimegaSparseOffsetY", "ROI start Y of the sparse frame", NDAttrInt32, &offsetY);
+  pList->add("PimegaSparseBinX", "Binning X of the sparse frame", NDAttrInt32, &binX);
+  pList->add("PimegaSparseBinY", "Binning Y of the sparse frame", NDAttrInt32, &binY);
+  pList->add("PimegaSparseEvents", "Pixels with counts", NDAttrInt32, &events);
+  setIntegerParam(PimegaSparseActive, 1);
+  pIn->release();
+  return pOut;
+}
+
+/** Compresses a frame with bslz4 or Blosc. Like the output of NDPluginCodec
+ * the result keeps the dims and data type of the frame and is marked with the
+ * codec, so NDFileHDF5 writes it as a compressed chunk. If compression fails
+ * the frame is published uncompressed. */
+NDArray *pimegaDetector::compressFrame(NDArray *pIn, int encoding) {
+  NDArray *pOut;
+  NDArrayInfo info;
+  size_t size;
+  int level, shuffle, compressor;
+
+  pIn->getInfo(&info);
+  if (encoding == PIMEGA_ENCODING_BSLZ4)
+    size = pimegaBSLZ4Bound(info.nElements, info.bytesPerElement);
+  else
+    size = pimegaBloscBound(info.nElements, info.bytesPerElement);
+  pOut = allocFrame(pIn, pIn->dataType, size);
+  if (!pOut) return NULL;
+
+  getIntegerParam(PimegaBloscLevel, &level);
+  getIntegerParam(PimegaBloscShuffle, &shuffle);
+  getIntegerParam(PimegaBloscCompressor, &compressor);
+  unlock();
+  if (encoding == PIMEGA_ENCODING_BSLZ4)
+    size = pimegaCompressBSLZ4(pIn->pData, info.nElements, info.bytesPerElement, pOut->pData,
+                               frameWorkers);
+  else
+    size = pimegaCompressBlosc(pIn->pData, info.nElements, info.bytesPerElement, pOut->pData,
+                               level, shuffle, compressor, frameWorkers->getConcurrency());
+  lock();
+  if (size == 0) {
+    PIMEGA_PRINT(pimega, TRACE_MASK_ERROR, "%s: unable to compress the frame\n", __func__);
+    pOut->release();
+    return pIn;
+  }
+
+  pOut->codec.name = encoding == PIMEGA_ENCODING_BSLZ4 ? PIMEGA_CODEC_BSLZ4 : PIMEGA_CODEC_BLOSC;
+  pOut->compressedSize = size;
+  setDoubleParam(PimegaCompressionFactor, (double)info.totalBytes / size);
+  pIn->release();
+  return pOut;
+}
+
+/** Applies the pixel corrections and accumulation, computes the statistics
+ * and applies the ROI, binning, output data type, packing and compression to
+ * a received frame. Returns the frame to publish, which is pIn itself when
+ * there is nothing to do, or NULL if the frame went into the accumulator or
+ * the output array can not be allocated. pIn is released when a new array or
+ * NULL is returned. Called with the lock held; it is dropped while the
+ * kernels run. */
+NDArray *pimegaDetector::processFrame(NDArray *pIn) {
+  NDArray *pOut;
+  NDDataType_t dataType;
+  int binX, binY, minX, minY, sizeX, sizeY, encoding, bits, statsEnable, numAccumulate;
+  int geometryMode;
+  double threshold;
+  pimegaFrameStats stats;
+  NDArrayInfo info;
+  int frameX = (int)pIn->dims[0].size;
+  int frameY = (int)pIn->dims[1].size;
+  const uint32_t *pRoi;
+  size_t dims[2];
+  int numStrips;
+
+  if (remapChanged_) {
+    std::swap(remap_, nextRemap_);
+    std::swap(edges_, nextEdges_);
+    remapChanged_ = false;
+    setIntegerParam(PimegaGeometrySpans, (int)remap_.getNumSpans());
+  }
+
+  /* The ROI is in the remapped frame, so every row is corrected before
+   * remapping */
+  getIntegerParam(PimegaGeometryMode, &geometryMode);
+  if (geometryMode != PIMEGA_GEOMETRY_OFF && remap_.valid()) {
+    correctFrame(pIn, 0, frameY);
+    pIn = remapFrame(pIn);
+    if (!pIn) return NULL;
+    correctEdges(pIn);
+    frameX = (int)pIn->dims[0].size;
+    frameY = (int)pIn->dims[1].size;
+  }
+
+  getIntegerParam(ADBinX, &binX);
+  getIntegerParam(ADBinY, &binY);
+  getIntegerParam(ADMinX, &minX);
+  getIntegerParam(ADMinY, &minY);
+  getIntegerParam(ADSizeX, &sizeX);
+  getIntegerParam(ADSizeY, &sizeY);
+
+  /* Keep the ROI inside the frame and at least one block big */
+  minX = std::max(0, std::min(minX, frameX - 1));
+  minY = std::max(0, std::min(minY, frameY - 1));
+  sizeX = std::max(1, std::min(sizeX, frameX - minX));
+  sizeY = std::max(1, std::min(sizeY, frameY - minY));
+  binX = std::max(1, std::min(binX, sizeX));
+  binY = std::max(1, std::min(binY, sizeY));
+
+  /* Only the ROI rows are corrected, the others are not published. The
+   * accumulator sums whole frames, so then every row is corrected. */
+  getIntegerParam(PimegaAccumulateNum, &numAccumulate);
+  if (geometryMode == PIMEGA_GEOMETRY_OFF || !remap_.valid()) {
+    if (numAccumulate > 1)
+      correctFrame(pIn, 0, frameY);
+    else
+      correctFrame(pIn, minY, sizeY);
+  }
+
+  summedFrames_ = 1;
+  if (numAccumulate > 1 && !accumulateFrame(pIn, numAccumulate)) return NULL;
+
+  /* Statistics are taken on the ROI before binning, so saturation is seen
+   * per pixel */
+  getIntegerParam(PimegaStatsEnable, &statsEnable);
+  if (statsEnable) computeFrameStats(pIn, minX, minY, sizeX, sizeY, &stats);
+
+  if (binX == 1 && binY == 1 && sizeX == frameX && sizeY == frameY) {
+    pOut = pIn;
+  } else {
+    dims[0] = sizeX / binX;
+    dims[1] = sizeY / binY;
+    pOut = this->pNDArrayPool->alloc(2, dims, NDUInt32, 0, NULL);
+    if (!pOut) {
+      PIMEGA_PRINT(pimega, TRACE_MASK_ERROR, "%s: unable to allocate the processed frame\n",
+                   __func__);
+      pIn->release();
+      return NULL;
+    }
+    /* Only the ROI rows are read, each one from minX on. The output rows are
+     * split in strips over the frame workers. */
+    pRoi = (const uint32_t *)pIn->pData + (size_t)minY * frameX + minX;
+    numStrips = (int)std::min(dims[1], (size_t)(2 * frameWorkers->getConcurrency()));
+    unlock();
+    frameWorkers->run(numStrips, [&](int strip) {
+      size_t first = dims[1] * strip / numStrips;
+      size_t last = dims[1] * (strip + 1) / numStrips;
+      pimegaBinFrame(pRoi + first * binY * frameX, frameX, sizeX, (last - first) * binY, binX,
+                     binY, (uint32_t *)pOut->pData + first * dims[0]);
+    });
+    lock();
+    pOut->dims[0].offset = minX;
+    pOut->dims[1].offset = minY;
+    pOut->dims[0].binning = binX;
+    pOut->dims[1].binning = binY;
+    pIn->release();
+  }
+
+  /* Sparse frames fall back to dense ones above the threshold. Packing is
+   * only used when the counts fit in the packed pixel. */
+  getIntegerParam(PimegaFrameEncoding, &encoding);
+  bits = frameBits(binX, binY);
+  if (encoding == PIMEGA_ENCODING_SPARSE) {
+    getDoubleParam(PimegaSparseThreshold, &threshold);
+    pOut = sparseFrame(pOut, threshold);
+    if (!pOut) return NULL;
+  }
+  if (pOut->ndims == 1) {
+    /* Sparse frames are published as they are */
+  } else if (encoding == PIMEGA_ENCODING_PACKED && bits <= 6) {
+    pOut = packFrame(pOut, bits <= 1 ? 1 : 6);
+  } else {
+    dataType = outputDataType(binX, binY);
+    if (dataType != NDUInt32) pOut = narrowFrame(pOut, dataType);
+    if (pOut && (encoding == PIMEGA_ENCODING_BSLZ4 || encoding == PIMEGA_ENCODING_BLOSC))
+      pOut = compressFrame(pOut, encoding);
+  }
+  if (!pOut) return NULL;
 
+  if (statsEnable) publishFrameStats(&stats, pOut);
+  pOut->getInfo(&info);
+  setIntegerParam(NDDataType, pOut->dataType);
+  setIntegerParam(NDArraySizeX, (int)pOut->dims[0].size);
+  setIntegerParam(NDArraySizeY, pOut->ndims > 1 ? (int)pOut->dims[1].size : 1);
+  setIntegerParam(NDArraySize, (int)(pOut->codec.empty() ? info.totalBytes : pOut->compressedSize));
+  setStringParam(NDCodec, pOut->codec.name.c_str());
+  return pOut;
 }
 
 /** This thread controls acquisition, reads image files to get the image data,
@@ -76,8 +952,14 @@ void pimegaDetector::acqTask() {
   const char *functionName = "acqTask";
   int64_t acquireImageCount = 0, acquireImageSavedCount = 0;
   int acquireStatusError = 0;
+  int previousStatus;
+  uint64_t statusVersion = 0;
+
+  pimegaApplyPlacement(PIMEGA_THREAD_ACQUIRE);
   /* Loop forever */
   while (true) {
+    /* Messages and params of the iteration are published together at the end */
+    statusPublisher->begin();
     /* No acquisition in place */
     if (!acquire) {
       /* reset acquireStatus */
@@ -118,12 +1000,16 @@ void pimegaDetector::acqTask() {
         PIMEGA_PRINT(pimega, TRACE_MASK_FLOW, "%s: Acquire started\n", functionName);
         /* Get the current time */
         epicsTimeGetCurrent(&startTime);
+        acqPoll_.start(expectedRunTime(numExposuresVar));
       }
     }
     /* Decoupled this from the next loop. Only needs to update acquireStatus
        when this condition is true (acquire && (acquireStatus != DONE_ACQ) */
     if (acquire && (acquireStatus != DONE_ACQ)) {
+      previousStatus = acquireStatus;
       acquireStatus = status_acquire(pimega);
+      acqPoll_.countPoll();
+      if (acquireStatus != previousStatus) acqPoll_.progress();
     }
     /* will enter here when the detector did not finish acquisition
       (acquireStatus != DONE_ACQ) or when Elapsed time is chosen
@@ -145,12 +1031,14 @@ void pimegaDetector::acqTask() {
         remainingTime = 0;
       }
       if (triggerMode == pimega->trigger_in_enum.PIMEGA_TRIGGER_IN_INTERNAL) {
-        setDoubleParam(ADTimeRemaining, remainingTime);
+        statusPublisher->setDouble(ADTimeRemaining, remainingTime, TIME_REMAINING_PERIOD);
       } else {
-        setDoubleParam(ADTimeRemaining, elapsedTime);
+        statusPublisher->setDouble(ADTimeRemaining, elapsedTime, TIME_REMAINING_PERIOD);
       }
     }
-    eventStatus = epicsEventWaitWithTimeout(this->stopAcquireEventId_, 0);
+    /* Waits until the next poll, or less when a stop comes */
+    eventStatus = epicsEventWaitWithTimeout(this->stopAcquireEventId_, acqPoll_.next());
+    acqPoll_.countWakeup();
 
     /* Stop event detected */
     if (eventStatus == epicsEventWaitOK) {
@@ -170,14 +1058,10 @@ void pimegaDetector::acqTask() {
         abort_save(pimega);
         UPDATEIOCSTATUS("Stop send to the backend");
       }
-      callParamCallbacks();
+      statusPublisher->end();
       continue;
     }
 
-    /* Added this delay for the thread not to hog the processor. No need to run
-     * on full speed. */
-    usleep(1000);
-
     // printf("Index error = %d\n", pimega->acq_status_return.STATUS_INDEXERROR);
     /* Will enter here only one time when the acqusition time is over. The
       current configuration assumes that when time is up, the thread goes to
@@ -188,16 +1072,23 @@ void pimegaDetector::acqTask() {
        * modules is 0 */
       bool moduleError = false;
       uint64_t recievedBackendCount = UINT64_MAX, processedBackendCount;
+      pimegaStatusSnapshot snapshot;
+      statusCache.read(&snapshot);
+      const acq_status_return_t &backend = snapshot.status;
+      /* Waiting on the backend now, which moves when the capture task gets a
+       * new status */
+      if (snapshot.version != statusVersion) acqPoll_.progress();
+      statusVersion = snapshot.version;
       recievedBackendCount = 0;
-      processedBackendCount = pimega->acq_status_return.processedImageNum;
+      processedBackendCount = backend.processedImageNum;
       /* For several Acquires with one backend Capture call, the number of
          images sent to backend X is a multiple of the number of images sent to
          the detector Y ( X = K x Y ). So the offset to establish the end of a
          single acquire needs to be tracked */
       // acquireImageCount = recievedBackendCount - recievedBackendCountOffset;
-      acquireImageCount = pimega->acq_status_return.STATUS_NOOFFRAMES[pimega->pimega_module - 1];
+      acquireImageCount = backend.STATUS_NOOFFRAMES[pimega->pimega_module - 1];
       acquireImageSavedCount =
-          pimega->acq_status_return.STATUS_SAVEDFRAMENUM - recievedBackendCountOffset;
+          backend.STATUS_SAVEDFRAMENUM - recievedBackendCountOffset;
 
       /* Index enable */
       getIntegerParam(PimegaIndexEnable, &indexEnable);
@@ -215,12 +1106,12 @@ void pimegaDetector::acqTask() {
           /* Acquire and IOC status message management. Acquire still will wait
              for the images to be saved (if necessary) to go to 0 or will wait
              for index to receive the images or both */
-          if (pimega->acq_status_return.done != DONE_ACQ) {
+          if (backend.done != DONE_ACQ) {
             UPDATEIOCSTATUS("Not all images received. Waiting");
-          } else if (autoSave == 1 && pimega->acq_status_return.done != DONE_ACQ) {
+          } else if (autoSave == 1 && backend.done != DONE_ACQ) {
             UPDATEIOCSTATUS("Saving images..");
           } else if (indexEnableBool == true &&
-                     pimega->acq_status_return.STATUS_INDEXSENTACQUISITIONNUM <
+                     backend.STATUS_INDEXSENTACQUISITIONNUM <
                          (unsigned int)pimega->acquireParam.numCapture) {
             UPDATEIOCSTATUS("Sending frames to Index");
           } else if (processedBackendCount < (unsigned int)pimega->acquireParam.numCapture) {
@@ -247,14 +1138,14 @@ void pimegaDetector::acqTask() {
              to that of the Capture and server status message management block
            */
           if (pimega->acquireParam.numCapture != 0) {
-            if (pimega->acq_status_return.processedImageNum <
+            if (backend.processedImageNum <
                 (unsigned int)pimega->acquireParam.numCapture) {
               UPDATEIOCSTATUS("Waiting for trigger");
             } else if (autoSave == 1 &&
-                       processedBackendCount < pimega->acq_status_return.STATUS_SAVEDFRAMENUM) {
+                       processedBackendCount < backend.STATUS_SAVEDFRAMENUM) {
               UPDATEIOCSTATUS("Saving images..");
             } else if (indexEnableBool == true &&
-                       pimega->acq_status_return.STATUS_INDEXSENTACQUISITIONNUM <
+                       backend.STATUS_INDEXSENTACQUISITIONNUM <
                            (unsigned int)pimega->acquireParam.numCapture) {
               UPDATEIOCSTATUS("Sending frames to Index");
             } else if (acquireStatus == DONE_ACQ) {
@@ -291,13 +1182,13 @@ void pimegaDetector::acqTask() {
       if (moduleError != false) {
         UPDATEIOCSTATUS("Detector error");
         setIntegerParam(ADStatus, ADStatusError);
-      } else if (pimega->acq_status_return.STATUS_INDEXERROR != false) {
+      } else if (backend.STATUS_INDEXERROR != false) {
         UPDATEIOCSTATUS("Index error");
         setIntegerParam(ADStatus, ADStatusError);
       }
     }
     /* Call the callbacks to update any changes */
-    callParamCallbacks();
+    statusPublisher->end();
   }
 }
 
@@ -314,8 +1205,13 @@ void pimegaDetector::captureTask() {
   uint64_t prevAcquisitionCount = 0;
   uint64_t previousReceivedCount = 0;
   uint64_t recievedBackendCount, processedBackendCount;
+  pimegaStatusSnapshot snapshot;
+  const acq_status_return_t &backend = snapshot.status;
+
+  pimegaApplyPlacement(PIMEGA_THREAD_CAPTURE);
   /* Loop forever */
   while (true) {
+    statusPublisher->begin();
     if (!capture) {
       // Release the lock while we wait for an event that says acquire has
       // started, then lock again
@@ -327,6 +1223,7 @@ void pimegaDetector::captureTask() {
       recievedBackendCountOffset = 0;
       previousReceivedCount = 0;
       capture = 1;
+      capturePoll_.start(expectedRunTime(pimega->acquireParam.numCapture));
     }
 
     eventStatus = epicsEventWaitWithTimeout(this->stopCaptureEventId_, 0);
@@ -340,9 +1237,9 @@ void pimegaDetector::captureTask() {
       status |= abort_save(pimega);
       int counter = -1;
       while (counter != 0) {
-        get_acqStatus_from_backend(pimega);
-        counter = (int)pimega->acq_status_return.STATUS_SAVEDFRAMENUM;
-        usleep(1000);
+        waitBackendStatus(capturePoll_.next());
+        statusCache.read(&snapshot);
+        counter = (int)backend.STATUS_SAVEDFRAMENUM;
       }
 
       if (status != 0) {
@@ -353,20 +1250,20 @@ void pimegaDetector::captureTask() {
       } else {
         capture = 0;
         UPDATESERVERSTATUS("Backend stopped");
+        statusPublisher->end();
         continue;
       }
     }
 
-    /* Added this delay for the thread not to hog the processor. */
-    usleep(1000);
-
     if (capture) {
-      get_acqStatus_from_backend(pimega);
+      /* Paced by the status updates, or by capturePoll_ without them */
+      waitBackendStatus(capturePoll_.next());
+      statusCache.read(&snapshot);
       moduleError = false;
       recievedBackendCount = UINT64_MAX;
-      moduleError |= pimega->acq_status_return.STATUS_MODULEERROR[0];
+      moduleError |= backend.STATUS_MODULEERROR[0];
       recievedBackendCount = 0;
-      processedBackendCount = pimega->acq_status_return.processedImageNum;
+      processedBackendCount = backend.processedImageNum;
       /*Anamoly detection. Upon incorrect configuration the detector, a number
         of images larger that what has been requested may arrive. In that case,
         to establish the end of the capture, an upper bound
@@ -394,10 +1291,10 @@ void pimegaDetector::captureTask() {
     received_acq = 0;
     for (int module = 1; module <= pimega->max_num_modules; module++) {
       if (received_acq == 0 ||
-          (int)pimega->acq_status_return.STATUS_NOOFACQUISITIONS[module - 1] > received_acq) {
-        received_acq = (int)pimega->acq_status_return.STATUS_NOOFACQUISITIONS[module - 1];
-        if (received_acq < (int)pimega->acq_status_return.processedImageNum) {
-          received_acq = (int)pimega->acq_status_return.processedImageNum;
+          (int)backend.STATUS_NOOFACQUISITIONS[module - 1] > received_acq) {
+        received_acq = (int)backend.STATUS_NOOFACQUISITIONS[module - 1];
+        if (received_acq < (int)backend.processedImageNum) {
+          received_acq = (int)backend.processedImageNum;
         }
       }
     }
@@ -410,19 +1307,18 @@ void pimegaDetector::captureTask() {
         UPDATESERVERSTATUS("Aborted");
       } else if (received_acq < (int)pimega->acquireParam.numCapture) {
         UPDATESERVERSTATUS("Waiting for images");
-      } else if (autoSave == 1 && pimega->acq_status_return.done != DONE_ACQ) {
+      } else if (autoSave == 1 && backend.done != DONE_ACQ) {
         UPDATESERVERSTATUS("Saving");
-      } else if ((int)pimega->acq_status_return.processedImageNum <
+      } else if ((int)backend.processedImageNum <
                  (int)pimega->acquireParam.numCapture) {
         UPDATESERVERSTATUS("Processing images");
       } else {
         setParameter(NDFileCapture, 0);
         capture = 0;
-        setDoubleParam(ADTimeRemaining, 0);
+        statusPublisher->setDouble(ADTimeRemaining, 0, TIME_REMAINING_PERIOD);
         PIMEGA_PRINT(pimega, TRACE_MASK_FLOW, "%s: Backend finished\n", __func__);
         UPDATEIOCSTATUS("Acquisition finished");
         UPDATESERVERSTATUS("Backend done");
-        callParamCallbacks();
       }
     } else {
       UPDATESERVERSTATUS("Receiving images");
@@ -430,20 +1326,19 @@ void pimegaDetector::captureTask() {
     /* Errors reported by backend override previous messages. */
     if (moduleError != false) {
       UPDATESERVERSTATUS("Detector dropped frames");
-    } else if (pimega->acq_status_return.STATUS_INDEXERROR != false) {
+    } else if (backend.STATUS_INDEXERROR != false) {
       UPDATESERVERSTATUS("Index not responding");
     }
+    statusPublisher->end();
   }
 }
 
 void pimegaDetector::updateIOCStatus(const char *message, int size) {
-  epicsInt8 *array = (epicsInt8 *)message;
-  doCallbacksInt8Array(array, size, PimegaIOCStatusMessage, 0);
+  statusPublisher->message(PimegaIOCStatusMessage, message, size);
 }
 
 void pimegaDetector::updateServerStatus(const char *message, int size) {
-  epicsInt8 *array = (epicsInt8 *)message;
-  doCallbacksInt8Array(array, size, PimegaServerStatusMessage, 0);
+  statusPublisher->message(PimegaServerStatusMessage, message, size);
 }
 
 asynStatus pimegaDetector::writeInt32(asynUser *pasynUser, epicsInt32 value) {
@@ -454,6 +1349,7 @@ asynStatus pimegaDetector::writeInt32(asynUser *pasynUser, epicsInt32 value) {
 
   char ok_str[100] = "";
   int adstatus, backendStatus, acquireRunning;
+  int previewMode, trigger;
   // int acquiring;
   getParamName(function, &paramName);
   PIMEGA_PRINT(pimega, TRACE_MASK_FLOW, "%s: %s(%d) requested value %d\n", functionName, paramName,
@@ -561,8 +1457,9 @@ asynStatus pimegaDetector::writeInt32(asynUser *pasynUser, epicsInt32 value) {
                      "event signal to thread\n",
                      functionName);
         epicsEventSignal(this->stopCaptureEventId_);
+        epicsEventSignal(statusEventId_);
         epicsThreadSleep(.1);
-        setDoubleParam(ADTimeRemaining, 0);
+        statusPublisher->setDouble(ADTimeRemaining, 0, TIME_REMAINING_PERIOD);
         strcat(ok_str, "Acquisition stopped");
       } else {
         PIMEGA_PRINT(pimega, TRACE_MASK_ERROR, "%s: Backend already stopped. Sending asynError\n",
@@ -571,6 +1468,48 @@ asynStatus pimegaDetector::writeInt32(asynUser *pasynUser, epicsInt32 value) {
         strcat(ok_str, "Backend already stopped");
       }
     }
+  } else if (function == PimegaOutputDataType) {
+    strcat(ok_str, "Output data type set");
+  } else if (function == PimegaFrameEncoding) {
+    if ((value == PIMEGA_ENCODING_BSLZ4 && !pimegaBSLZ4Available()) ||
+        (value == PIMEGA_ENCODING_BLOSC && !pimegaBloscAvailable())) {
+      strncpy(pimega->error, "Codec not built in the driver", sizeof(pimega->error));
+      status = asynError;
+    } else {
+      strcat(ok_str, "Frame encoding set");
+    }
+  } else if (function == PimegaBloscCompressor || function == PimegaBloscLevel ||
+             function == PimegaBloscShuffle) {
+    strcat(ok_str, "Blosc compression set");
+  } else if (function == PimegaStatsEnable) {
+    strcat(ok_str, "Frame statistics set");
+  } else if (function == PimegaMaskEnable || function == PimegaFlatFieldEnable) {
+    correctionChanged_ = true;
+    accumulateReset_ = true;
+    strcat(ok_str, "Frame correction set");
+  } else if (function == PimegaAccumulateNum || function == PimegaAccumulateMode) {
+    accumulateReset_ = true;
+    setIntegerParam(PimegaAccumulateCount, 0);
+    strcat(ok_str, "Frame accumulation set");
+  } else if (function == PimegaEdgeCorrection) {
+    int mode, chipGap;
+    getParameter(PimegaGeometryMode, &mode);
+    getParameter(PimegaGeometryChipGap, &chipGap);
+    if (value && (mode != PIMEGA_GEOMETRY_MODEL || chipGap < 2)) {
+      strncpy(pimega->error, "Needs the Model geometry with a chip gap of 2 or more",
+              sizeof(pimega->error));
+      status = asynError;
+    } else {
+      accumulateReset_ = true;
+      strcat(ok_str, "Edge correction set");
+    }
+  } else if (function == PimegaModuleMask) {
+    if (moduleAssembler) moduleAssembler->setModuleMask((uint32_t)value);
+    strcat(ok_str, "Module mask set");
+  } else if (function == PimegaPreviewMode) {
+    getParameter(ADTriggerMode, &trigger);
+    updatePreview(value, trigger);
+    strcat(ok_str, "Preview mode set");
   } else if (acquireRunning == 1) {
     strncpy(pimega->error, "Stop current acquisition first", sizeof(pimega->error));
     status = asynError;
@@ -606,6 +1545,10 @@ asynStatus pimegaDetector::writeInt32(asynUser *pasynUser, epicsInt32 value) {
     strcat(ok_str, "Module selected");
   } else if (function == ADTriggerMode) {
     status |= triggerMode((enum ioc_trigger_mode_t)value);
+    if (status == asynSuccess) {
+      getParameter(PimegaPreviewMode, &previewMode);
+      updatePreview(previewMode, value);
+    }
     strcat(ok_str, "Trigger mode set");
   } else if (function == PimegaConfigDiscL) {
     UPDATEIOCSTATUS("Setting ConfigDiscL value");
@@ -617,6 +1560,20 @@ asynStatus pimegaDetector::writeInt32(asynUser *pasynUser, epicsInt32 value) {
   } else if (function == PimegaMedipixChip) {
     status |= imgChipID(value);
     strcat(ok_str, "Chip selected");
+  } else if (function == PimegaGeometryMode || function == PimegaGeometryChipGap ||
+             function == PimegaGeometryModuleGap) {
+    int mode, chipGap, moduleGap;
+    char file[256];
+    getParameter(PimegaGeometryMode, &mode);
+    getParameter(PimegaGeometryChipGap, &chipGap);
+    getParameter(PimegaGeometryModuleGap, &moduleGap);
+    getStringParam(PimegaGeometryFile, sizeof(file), file);
+    if (function == PimegaGeometryMode) mode = value;
+    if (function == PimegaGeometryChipGap) chipGap = value;
+    if (function == PimegaGeometryModuleGap) moduleGap = value;
+    status |= updateRemap(mode, file, chipGap, moduleGap);
+    accumulateReset_ = true;
+    strcat(ok_str, "Geometry set");
   } else if (function == PimegaPixelMode) {
     status |= setOMRValue(OMR_CSM_SPM, value, function);
     strcat(ok_str, "Pixel mode set");
@@ -730,6 +1687,15 @@ asynStatus pimegaDetector::writeInt32(asynUser *pasynUser, epicsInt32 value) {
   } else if (function == PimegaFrameProcessMode) {
     setParameter(function, value);
     strcat(ok_str, "Frame process mode set");
+  } else if (function == PimegaFrameQueuePolicy) {
+    frameQueuePolicy = value;
+    strcat(ok_str, "Frame queue policy set");
+  } else if (function == ADMinX || function == ADMinY || function == ADSizeX ||
+             function == ADSizeY) {
+    /* A new ROI starts a new sum */
+    accumulateReset_ = true;
+    status = ADDriver::writeInt32(pasynUser, value);
+    strcat(ok_str, "ROI set");
   } else {
     if (function < FIRST_PIMEGA_PARAM) {
       status = ADDriver::writeInt32(pasynUser, value);
@@ -800,6 +1766,53 @@ asynStatus pimegaDetector::writeInt32Array(asynUser *pasynUser, epicsInt32 *valu
   return ((asynStatus)status);
 }
 
+/** The pixel mask can also be written as a waveform of maxSizeX x maxSizeY
+ * pixels, non zero for the pixels to zero */
+asynStatus pimegaDetector::writeInt8Array(asynUser *pasynUser, epicsInt8 *value,
+                                          size_t nElements) {
+  int function = pasynUser->reason;
+
+  if (function != PimegaMask) return ADDriver::writeInt8Array(pasynUser, value, nElements);
+
+  if (nElements != (size_t)maxSizeX * maxSizeY) {
+    error("Pixel mask has %d elements, %d expected\n", (int)nElements, maxSizeX * maxSizeY);
+    UPDATEIOCSTATUS("Pixel mask size does not match the detector");
+    return asynError;
+  }
+  pixelMask_.assign((const uint8_t *)value, (const uint8_t *)value + nElements);
+  correctionChanged_ = true;
+  accumulateReset_ = true;
+  UPDATEIOCSTATUS("Pixel mask set");
+  return asynSuccess;
+}
+
+/** Flat field coefficients written as a waveform of maxSizeX x maxSizeY
+ * pixels */
+asynStatus pimegaDetector::writeFloat32Array(asynUser *pasynUser, epicsFloat32 *value,
+                                             size_t nElements) {
+  int function = pasynUser->reason;
+
+  if (function != PimegaFlatField)
+    return ADDriver::writeFloat32Array(pasynUser, value, nElements);
+
+  if (nElements != (size_t)maxSizeX * maxSizeY) {
+    error("Flat field has %d elements, %d expected\n", (int)nElements, maxSizeX * maxSizeY);
+    UPDATEIOCSTATUS("Flat field size does not match the detector");
+    return asynError;
+  }
+  if (checkFlatField(value, nElements) != asynSuccess) {
+    error("%s\n", pimega->error);
+    UPDATEIOCSTATUS(pimega->error);
+    pimega->error[0] = '\0';
+    return asynError;
+  }
+  flatField_.assign(value, value + nElements);
+  correctionChanged_ = true;
+  accumulateReset_ = true;
+  UPDATEIOCSTATUS("Flat field set");
+  return asynSuccess;
+}
+
 asynStatus pimegaDetector::writeOctet(asynUser *pasynUser, const char *value, size_t maxChars,
                                       size_t *nActual) {
   int function = pasynUser->reason;
@@ -832,6 +1845,50 @@ asynStatus pimegaDetector::writeOctet(asynUser *pasynUser, const char *value, si
     *nActual = maxChars;
     setParameter(function, value);
     strcat(ok_str, "Metadata Value set");
+  } else if (function == PimegaMaskFile) {
+    /* An empty name removes the mask */
+    std::vector<uint8_t> mask;
+    *nActual = maxChars;
+    if (value[0] != '\0') {
+      mask.resize((size_t)maxSizeX * maxSizeY);
+      status = loadPixelMap(value, mask.data(), sizeof(uint8_t));
+    }
+    if (status == asynSuccess) {
+      pixelMask_.swap(mask);
+      correctionChanged_ = true;
+      accumulateReset_ = true;
+      setParameter(function, value);
+      strcat(ok_str, "Pixel mask loaded");
+    }
+  } else if (function == PimegaGeometryFile) {
+    int mode, chipGap, moduleGap;
+    *nActual = maxChars;
+    getParameter(PimegaGeometryMode, &mode);
+    getParameter(PimegaGeometryChipGap, &chipGap);
+    getParameter(PimegaGeometryModuleGap, &moduleGap);
+    /* The file is only read when it is the geometry in use */
+    if (mode == PIMEGA_GEOMETRY_FILE) status = updateRemap(mode, value, chipGap, moduleGap);
+    if (status == asynSuccess) {
+      accumulateReset_ = true;
+      setParameter(function, value);
+      strcat(ok_str, "Geometry file set");
+    }
+  } else if (function == PimegaFlatFieldFile) {
+    /* An empty name removes the flat field */
+    std::vector<float> flatField;
+    *nActual = maxChars;
+    if (value[0] != '\0') {
+      flatField.resize((size_t)maxSizeX * maxSizeY);
+      status = loadPixelMap(value, flatField.data(), sizeof(float));
+      if (status == asynSuccess) status = checkFlatField(flatField.data(), flatField.size());
+    }
+    if (status == asynSuccess) {
+      flatField_.swap(flatField);
+      correctionChanged_ = true;
+      accumulateReset_ = true;
+      setParameter(function, value);
+      strcat(ok_str, "Flat field loaded");
+    }
   } else {
     /* If this parameter belongs to a base class call its method */
     if (function < FIRST_PIMEGA_PARAM) {
@@ -882,7 +1939,24 @@ asynStatus pimegaDetector::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
                function, value);
 
   getParameter(ADAcquire, &acquireRunning);
-  if (acquireRunning == 1) {
+  if (function == PimegaPreviewRate) {
+    if (value < 0) {
+      strncpy(pimega->error, "Preview rate must not be negative", sizeof(pimega->error));
+      status = asynError;
+    } else {
+      previewPeriod = value > 0 ? 1.0 / value : 0;
+      setParameter(PimegaPreviewRate, value);
+      strcat(ok_str, "Preview rate set");
+    }
+  } else if (function == PimegaSparseThreshold) {
+    if (value < 0 || value > 1) {
+      strncpy(pimega->error, "Sparse threshold must be between 0 and 1", sizeof(pimega->error));
+      status = asynError;
+    } else {
+      setParameter(PimegaSparseThreshold, value);
+      strcat(ok_str, "Sparse threshold set");
+    }
+  } else if (acquireRunning == 1) {
     strncpy(pimega->error, "Stop current acquisition first", sizeof(pimega->error));
     status = asynError;
   } else if (function == ADAcquireTime) {
@@ -1001,7 +2075,9 @@ asynStatus pimegaDetector::readFloat64(asynUser *pasynUser, epicsFloat64 *value)
   getParameter(ADAcquire, &acquireRunning);
 
   if (function == PimegaBackBuffer) {
-    *value = pimega->acq_status_return.STATUS_BUFFERUSED[0] * 100;
+    pimegaStatusSnapshot snapshot;
+    statusCache.read(&snapshot);
+    *value = snapshot.status.STATUS_BUFFERUSED[0] * 100;
   }
 
   else if (function == PimegaDacOutSense) {
@@ -1046,10 +2122,13 @@ asynStatus pimegaDetector::readInt32(asynUser *pasynUser, epicsInt32 *value) {
   getParameter(NDAutoSave, &autoSave);
 
   if (function == PimegaBackendStats) {
-    if (pimega->acq_status_return.STATUS_MODULEERROR[0] == 1 ||
-        pimega->acq_status_return.STATUS_MODULEERROR[1] == 1 ||
-        pimega->acq_status_return.STATUS_MODULEERROR[2] == 1 ||
-        pimega->acq_status_return.STATUS_MODULEERROR[3] == 1)
+    pimegaStatusSnapshot snapshot;
+    statusCache.read(&snapshot);
+    const acq_status_return_t &backend = snapshot.status;
+    if (backend.STATUS_MODULEERROR[0] == 1 ||
+        backend.STATUS_MODULEERROR[1] == 1 ||
+        backend.STATUS_MODULEERROR[2] == 1 ||
+        backend.STATUS_MODULEERROR[3] == 1)
       error = 1;
     else
       error = 0;
@@ -1057,48 +2136,48 @@ asynStatus pimegaDetector::readInt32(asynUser *pasynUser, epicsInt32 *value) {
     received_acq = 0;
     for (int module = 1; module <= pimega->max_num_modules; module++) {
       if (received_acq == 0 ||
-          (int)pimega->acq_status_return.STATUS_NOOFACQUISITIONS[module - 1] > received_acq) {
-        received_acq = (int)pimega->acq_status_return.STATUS_NOOFACQUISITIONS[module - 1];
-        if (received_acq < (int)pimega->acq_status_return.processedImageNum) {
-          received_acq = (int)pimega->acq_status_return.processedImageNum;
+          (int)backend.STATUS_NOOFACQUISITIONS[module - 1] > received_acq) {
+        received_acq = (int)backend.STATUS_NOOFACQUISITIONS[module - 1];
+        if (received_acq < (int)backend.processedImageNum) {
+          received_acq = (int)backend.processedImageNum;
         }
       }
     }
 
     setParameter(PimegaReceiveError, error);
-    setParameter(PimegaM1ReceiveError, (int)pimega->acq_status_return.STATUS_MODULEERROR[0]);
-    setParameter(PimegaM2ReceiveError, (int)pimega->acq_status_return.STATUS_MODULEERROR[1]);
-    setParameter(PimegaM3ReceiveError, (int)pimega->acq_status_return.STATUS_MODULEERROR[2]);
-    setParameter(PimegaM4ReceiveError, (int)pimega->acq_status_return.STATUS_MODULEERROR[3]);
-    setParameter(PimegaM1LostFrameCount, (int)pimega->acq_status_return.STATUS_LOSTFRAMECNT[0]);
-    setParameter(PimegaM2LostFrameCount, (int)pimega->acq_status_return.STATUS_LOSTFRAMECNT[1]);
-    setParameter(PimegaM3LostFrameCount, (int)pimega->acq_status_return.STATUS_LOSTFRAMECNT[2]);
-    setParameter(PimegaM4LostFrameCount, (int)pimega->acq_status_return.STATUS_LOSTFRAMECNT[3]);
-    setParameter(PimegaM1RxFrameCount, (int)pimega->acq_status_return.STATUS_NOOFFRAMES[0]);
-    setParameter(PimegaM2RxFrameCount, (int)pimega->acq_status_return.STATUS_NOOFFRAMES[1]);
-    setParameter(PimegaM3RxFrameCount, (int)pimega->acq_status_return.STATUS_NOOFFRAMES[2]);
-    setParameter(PimegaM4RxFrameCount, (int)pimega->acq_status_return.STATUS_NOOFFRAMES[3]);
+    setParameter(PimegaM1ReceiveError, (int)backend.STATUS_MODULEERROR[0]);
+    setParameter(PimegaM2ReceiveError, (int)backend.STATUS_MODULEERROR[1]);
+    setParameter(PimegaM3ReceiveError, (int)backend.STATUS_MODULEERROR[2]);
+    setParameter(PimegaM4ReceiveError, (int)backend.STATUS_MODULEERROR[3]);
+    setParameter(PimegaM1LostFrameCount, (int)backend.STATUS_LOSTFRAMECNT[0]);
+    setParameter(PimegaM2LostFrameCount, (int)backend.STATUS_LOSTFRAMECNT[1]);
+    setParameter(PimegaM3LostFrameCount, (int)backend.STATUS_LOSTFRAMECNT[2]);
+    setParameter(PimegaM4LostFrameCount, (int)backend.STATUS_LOSTFRAMECNT[3]);
+    setParameter(PimegaM1RxFrameCount, (int)backend.STATUS_NOOFFRAMES[0]);
+    setParameter(PimegaM2RxFrameCount, (int)backend.STATUS_NOOFFRAMES[1]);
+    setParameter(PimegaM3RxFrameCount, (int)backend.STATUS_NOOFFRAMES[2]);
+    setParameter(PimegaM4RxFrameCount, (int)backend.STATUS_NOOFFRAMES[3]);
     setParameter(PimegaM1AquisitionCount,
-                 (int)pimega->acq_status_return.STATUS_NOOFACQUISITIONS[0]);
+                 (int)backend.STATUS_NOOFACQUISITIONS[0]);
     setParameter(PimegaM2AquisitionCount,
-                 (int)pimega->acq_status_return.STATUS_NOOFACQUISITIONS[1]);
+                 (int)backend.STATUS_NOOFACQUISITIONS[1]);
     setParameter(PimegaM3AquisitionCount,
-                 (int)pimega->acq_status_return.STATUS_NOOFACQUISITIONS[2]);
+                 (int)backend.STATUS_NOOFACQUISITIONS[2]);
     setParameter(PimegaM4AquisitionCount,
-                 (int)pimega->acq_status_return.STATUS_NOOFACQUISITIONS[3]);
+                 (int)backend.STATUS_NOOFACQUISITIONS[3]);
     setParameter(PimegaM1RdmaBufferUsage,
-                 (double)pimega->acq_status_return.STATUS_BUFFERUSED[0] * 100);
+                 (double)backend.STATUS_BUFFERUSED[0] * 100);
     setParameter(PimegaM2RdmaBufferUsage,
-                 (double)pimega->acq_status_return.STATUS_BUFFERUSED[1] * 100);
+                 (double)backend.STATUS_BUFFERUSED[1] * 100);
     setParameter(PimegaM3RdmaBufferUsage,
-                 (double)pimega->acq_status_return.STATUS_BUFFERUSED[2] * 100);
+                 (double)backend.STATUS_BUFFERUSED[2] * 100);
     setParameter(PimegaM4RdmaBufferUsage,
-                 (double)pimega->acq_status_return.STATUS_BUFFERUSED[3] * 100);
-    setParameter(PimegaIndexError, (int)pimega->acq_status_return.STATUS_INDEXERROR);
-    setParameter(PimegaIndexCounter, (int)pimega->acq_status_return.STATUS_INDEXSENTACQUISITIONNUM);
+                 (double)backend.STATUS_BUFFERUSED[3] * 100);
+    setParameter(PimegaIndexError, (int)backend.STATUS_INDEXERROR);
+    setParameter(PimegaIndexCounter, (int)backend.STATUS_INDEXSENTACQUISITIONNUM);
     setParameter(ADNumImagesCounter, received_acq);
-    setParameter(PimegaProcessedImageCounter, (int)pimega->acq_status_return.processedImageNum);
-    setParameter(NDFileNumCaptured, (int)pimega->acq_status_return.STATUS_SAVEDFRAMENUM);
+    setParameter(PimegaProcessedImageCounter, (int)backend.processedImageNum);
+    setParameter(NDFileNumCaptured, (int)backend.STATUS_SAVEDFRAMENUM);
     callParamCallbacks();
   } else if (function == PimegaModule) {
     *value = pimega->pimega_module;
@@ -1120,7 +2199,19 @@ asynStatus pimegaDetector::readInt32(asynUser *pasynUser, epicsInt32 *value) {
  * to -1 to allow an unlimited amount of memory. \param[in] priority The thread
  * priority for the asyn port driver thread if ASYN_CANBLOCK is set in
  * asynFlags. \param[in] stackSize The stack size for the asyn port driver
- * thread if ASYN_CANBLOCK is set in asynFlags.
+ * thread if ASYN_CANBLOCK is set in asynFlags. \param[in] frameTransport How
+ * visualizer frames reach the NDArrays, see pimega_frame_transport_t.
+ * \param[in] frameBuffers Number of receive buffers in the ring used by
+ * PIMEGA_FRAME_TRANSPORT_RING, of slots in the shared memory ring of
+ * PIMEGA_FRAME_TRANSPORT_SHMEM, or of frames assembled at the same time by
+ * PIMEGA_FRAME_TRANSPORT_MODULES. 0 selects DEFAULT_FRAME_RING_SIZE.
+ * \param[in] frameQueueSize Number of frames waiting for the dispatch thread
+ * before the frame queue policy applies. 0 selects DEFAULT_FRAME_QUEUE_SIZE.
+ * \param[in] frameThreads Number of extra threads the frame kernels are split
+ * over, besides the dispatch thread. 0 uses every CPU, up to
+ * DEFAULT_FRAME_THREADS.
+ * \param[in] hugePages Huge pages for the received frame buffers, see
+ * pimega_huge_pages_t.
  */
 extern "C" int pimegaDetectorConfig(const char *portName, const char *address_module01,
                                     const char *address_module02, const char *address_module03,
@@ -1131,12 +2222,15 @@ extern "C" int pimegaDetectorConfig(const char *portName, const char *address_mo
                                     int maxSizeY, int detectorModel, int maxBuffers,
                                     size_t maxMemory, int priority, int stackSize, int simulate,
                                     int backendOn, int log, unsigned short backend_port,
-                                    unsigned short vis_frame_port, int IntAcqResetRDMA) {
+                                    unsigned short vis_frame_port, int IntAcqResetRDMA,
+                                    int frameTransport, int frameBuffers,
+                                    int frameQueueSize, int frameThreads, int hugePages) {
   new pimegaDetector(portName, address_module01, address_module02, address_module03,
                      address_module04, address_module05, address_module06, address_module07,
                      address_module08, address_module09, address_module10, port, maxSizeX, maxSizeY,
                      detectorModel, maxBuffers, maxMemory, priority, stackSize, simulate, backendOn,
-                     log, backend_port, vis_frame_port, IntAcqResetRDMA);
+                     log, backend_port, vis_frame_port, IntAcqResetRDMA, frameTransport,
+                     frameBuffers, frameQueueSize, frameThreads, hugePages);
 
   return (asynSuccess);
 }
@@ -1157,7 +2251,19 @@ extern "C" int pimegaDetectorConfig(const char *portName, const char *address_mo
  * to -1 to allow an unlimited amount of memory. \param[in] priority The thread
  * priority for the asyn port driver thread if ASYN_CANBLOCK is set in
  * asynFlags. \param[in] stackSize The stack size for the asyn port driver
- * thread if ASYN_CANBLOCK is set in asynFlags.
+ * thread if ASYN_CANBLOCK is set in asynFlags. \param[in] frameTransport How
+ * visualizer frames reach the NDArrays, see pimega_frame_transport_t.
+ * \param[in] frameBuffers Number of receive buffers in the ring used by
+ * PIMEGA_FRAME_TRANSPORT_RING, of slots in the shared memory ring of
+ * PIMEGA_FRAME_TRANSPORT_SHMEM, or of frames assembled at the same time by
+ * PIMEGA_FRAME_TRANSPORT_MODULES. 0 selects DEFAULT_FRAME_RING_SIZE.
+ * \param[in] frameQueueSize Number of frames waiting for the dispatch thread
+ * before the frame queue policy applies. 0 selects DEFAULT_FRAME_QUEUE_SIZE.
+ * \param[in] frameThreads Number of extra threads the frame kernels are split
+ * over, besides the dispatch thread. 0 uses every CPU, up to
+ * DEFAULT_FRAME_THREADS.
+ * \param[in] hugePages Huge pages for the received frame buffers, see
+ * pimega_huge_pages_t.
  */
 pimegaDetector::pimegaDetector(const char *portName, const char *address_module01,
                                const char *address_module02, const char *address_module03,
@@ -1168,7 +2274,8 @@ pimegaDetector::pimegaDetector(const char *portName, const char *address_module0
                                int detectorModel, int maxBuffers, size_t maxMemory, int priority,
                                int stackSize, int simulate, int backendOn, int log,
                                unsigned short backend_port, unsigned short vis_frame_port,
-                               int IntAcqResetRDMA)
+                               int IntAcqResetRDMA, int frameTransport, int frameBuffers,
+                               int frameQueueSize, int frameThreads, int hugePages)
 
     : ADDriver(portName, 1, 0, maxBuffers, maxMemory,
                asynInt32ArrayMask | asynFloat64ArrayMask | asynFloat32ArrayMask |
@@ -1178,11 +2285,29 @@ pimegaDetector::pimegaDetector(const char *portName, const char *address_module0
                ASYN_CANBLOCK, 1, /* ASYN_CANBLOCK=1, ASYN_MULTIDEVICE=0, autoConnect=1 */
                priority, stackSize),
 
+      frameQueuePolicy(PIMEGA_FRAME_QUEUE_DROP_OLDEST),
+      framesDropped(0),
+      previewActive(false),
+      previewPeriod(1.0 / DEFAULT_PREVIEW_RATE),
+      previewFrame(nullptr),
       pollTime_(DEFAULT_POLL_TIME),
-      forceCallback_(1)
+      forceCallback_(1),
+      detectorModel(detectorModel),
+      correctionChanged_(true),
+      remapChanged_(false),
+      numAccumulated_(0),
+      accumulateReset_(true),
+      summedFrames_(1),
+      framesPublished_(0),
+      bytesPublished_(0),
+      lastFramesPublished_(0),
+      lastBytesPublished_(0),
+      lastTimingNs_(pimegaTimeNs())
 
 {
   BoolAcqResetRDMA = (bool)IntAcqResetRDMA;
+  this->frameTransport = frameTransport;
+  this->frameBuffers = frameBuffers;
   int status = asynSuccess;
   const char *functionName = "pimegaDetector::pimegaDetector";
   const char *ips[] = {address_module01, address_module02, address_module03, address_module04,
@@ -1230,6 +2355,7 @@ pimegaDetector::pimegaDetector(const char *portName, const char *address_module0
     printf("%s:%s epicsEventCreate failure for capture stop event\n", driverName, functionName);
     return;
   }
+  statusEventId_ = epicsEventMustCreate(epicsEventEmpty);
 
   pimega = pimega_new((pimega_detector_model_t)detectorModel, true);
   pimega_global = pimega;
@@ -1248,6 +2374,30 @@ pimegaDetector::pimegaDetector(const char *portName, const char *address_module0
   if (pimega) PIMEGA_PRINT(pimega, TRACE_MASK_FLOW, "pimegaDetector: Pimega struct created\n");
 
   pimega->simulate = simulate;
+
+  /* Frames are queued by the receive thread and sent to the plugins by the
+   * dispatch thread */
+  frameQueuedEventId_ = epicsEventMustCreate(epicsEventEmpty);
+  frameDequeuedEventId_ = epicsEventMustCreate(epicsEventEmpty);
+  lastPreviewTime_ = 0;
+  frameQueue =
+      new pimegaFrameQueue(frameQueueSize > 0 ? frameQueueSize : DEFAULT_FRAME_QUEUE_SIZE);
+  if (frameThreads <= 0)
+    frameThreads = std::min(epicsThreadGetCPUs() - 1, DEFAULT_FRAME_THREADS);
+  frameWorkers = new pimegaWorkerPool("pimegaFrameWorker", std::max(frameThreads, 0),
+                                      PIMEGA_THREAD_WORKERS);
+  if (epicsThreadCreate("pimegaDispatchTask", epicsThreadPriorityMedium,
+                        epicsThreadGetStackSize(epicsThreadStackMedium),
+                        (EPICSTHREADFUNC)dispatchTaskC, this) == NULL)
+    panic("Unable to start the frame dispatch task. Aborting");
+
+  statusPublisher = new pimegaStatusPublisher(this);
+
+  /* Received frames come from this pool whatever the transport */
+  framePool = new pimegaNDArrayPool(this);
+  framePool->setNumaNode(pimegaGetNumaNode(PIMEGA_THREAD_BUFFERS));
+  framePool->setHugePages(hugePages);
+
   connect(ips, port, backend_port, vis_frame_port);
   status = prepare_pimega(pimega);
   if (status != PIMEGA_SUCCESS) panic("Unable to prepare pimega. Aborting");
@@ -1308,14 +2458,33 @@ void pimegaDetector::connect(const char *address[10], unsigned short port,
   sprintf(connection_address, "tcp://127.0.0.1:%d", vis_frame_port);
   const std::string visualizer_topic = "pimega_frame_visualizer";
   const size_t max_frame_size = maxSizeX * maxSizeY * sizeof(vis_dtype);
-  message_consumer = new ZmqMessageConsumer(
-          connection_address,
-          visualizer_topic,
-          max_frame_size);
 
-  message_consumer->subscribe("ioc_frame_visualizer_callback", [this](void* data) {
-      this->updateEpicsFrame(reinterpret_cast<vis_dtype*>(data));
-  });
+  /* zmq_connect succeeds whether or not the backend publishes its status, so
+   * there is no telling here; the capture task polls whenever nothing is
+   * pushed, and report() shows which it is */
+  statusSubscriber = new pimegaStatusSubscriber(connection_address, PIMEGA_STATUS_TOPIC,
+                                                sizeof(pimega->acq_status_return),
+                                                statusEventId_);
+  statusSubscriber->start();
+
+  if (frameTransport == PIMEGA_FRAME_TRANSPORT_SHMEM) {
+    sprintf(connection_address, "%s%d", PIMEGA_SHMEM_PREFIX, vis_frame_port);
+    connectFrameReceiver(connection_address, visualizer_topic, max_frame_size);
+  } else if (frameTransport == PIMEGA_FRAME_TRANSPORT_MODULES) {
+    connectModuleAssembler(connection_address, visualizer_topic, max_frame_size);
+  } else if (frameTransport == PIMEGA_FRAME_TRANSPORT_ZERO_COPY ||
+             frameTransport == PIMEGA_FRAME_TRANSPORT_RING) {
+    connectFrameReceiver(connection_address, visualizer_topic, max_frame_size);
+  } else {
+    message_consumer = new ZmqMessageConsumer(
+            connection_address,
+            visualizer_topic,
+            max_frame_size);
+
+    message_consumer->subscribe("ioc_frame_visualizer_callback", [this](void* data) {
+        this->updateEpicsFrame(reinterpret_cast<vis_dtype*>(data));
+    });
+  }
 
   rc = pimega_connect_backend(pimega, "127.0.0.1", backend_port);
   if (rc != PIMEGA_SUCCESS) panic("Unable to connect with Backend. Aborting");
@@ -1326,6 +2495,104 @@ void pimegaDetector::connect(const char *address[10], unsigned short port,
   if (rc != PIMEGA_SUCCESS) panic("Unable to connect with detector. Aborting");
 }
 
+/** Gets a new backend status and publishes it to statusCache. This is the
+ * only place acq_status_return is fetched; everything else reads the cache.
+ * Takes the newest status the backend pushed, waiting up to timeout for one,
+ * and asks the backend when none came so a backend that does not publish its
+ * status still works, only slower. A pushed status, or a polled one that
+ * differs from the previous, tells capturePoll_ the backend is moving. */
+void pimegaDetector::waitBackendStatus(double timeout) {
+  acq_status_return_t previous;
+
+  if (statusSubscriber) {
+    if (statusSubscriber->take(&pimega->acq_status_return, &statusSeen_) ||
+        (epicsEventWaitWithTimeout(statusEventId_, timeout) == epicsEventWaitOK &&
+         statusSubscriber->take(&pimega->acq_status_return, &statusSeen_))) {
+      statusPushed_++;
+      capturePoll_.countWakeup();
+      capturePoll_.progress();
+      statusCache.publish(pimega->acq_status_return);
+      return;
+    }
+  } else {
+    epicsEventWaitWithTimeout(statusEventId_, timeout);
+  }
+  capturePoll_.countWakeup();
+  previous = pimega->acq_status_return;
+  get_acqStatus_from_backend(pimega);
+  statusPolled_++;
+  capturePoll_.countPoll();
+  if (memcmp(&previous, &pimega->acq_status_return, sizeof(previous)) != 0)
+    capturePoll_.progress();
+  statusCache.publish(pimega->acq_status_return);
+}
+
+/** Seconds an internally triggered run of numFrames should take, the same
+ * way acqTask counts down ADTimeRemaining. 0 when it cannot be told. */
+double pimegaDetector::expectedRunTime(int numFrames) {
+  double acquireTime, acquirePeriod;
+  int triggerMode;
+
+  getIntegerParam(ADTriggerMode, &triggerMode);
+  if (triggerMode != IOC_TRIGGER_MODE_INTERNAL || numFrames <= 0) return 0;
+  getDoubleParam(ADAcquireTime, &acquireTime);
+  getDoubleParam(ADAcquirePeriod, &acquirePeriod);
+  if (acquirePeriod != 0) return acquirePeriod * (numFrames - 1) + acquireTime;
+  return acquireTime * numFrames;
+}
+
+/** Preview replaces the frame queue when PreviewMode is On, or when it is
+ * Alignment and the detector is in the alignment trigger mode. */
+void pimegaDetector::updatePreview(int mode, int trigger) {
+  previewActive = mode == PIMEGA_PREVIEW_ON ||
+                  (mode == PIMEGA_PREVIEW_ALIGNMENT && trigger == IOC_TRIGGER_MODE_ALIGNMENT);
+}
+
+/** Starts the driver owned frame receiver used by the zero-copy, ring and
+ * shared memory transports. */
+void pimegaDetector::connectFrameReceiver(const char *address, const std::string &topic,
+                                          size_t frameSize) {
+  frameReceiver = new pimegaFrameReceiver(
+          address, topic, frameTransport, maxSizeX, maxSizeY, vis_ndarray_dtype, frameSize,
+          framePool, [this](NDArray *pArray) {
+      this->publishFrame(pArray);
+  });
+
+  if (frameTransport == PIMEGA_FRAME_TRANSPORT_RING) {
+    if (frameBuffers <= 0) frameBuffers = DEFAULT_FRAME_RING_SIZE;
+    if (frameReceiver->allocRing(frameBuffers) != 0)
+      panic("Unable to allocate the frame ring. Aborting");
+  } else if (frameTransport == PIMEGA_FRAME_TRANSPORT_SHMEM) {
+    if (frameBuffers <= 0) frameBuffers = DEFAULT_FRAME_RING_SIZE;
+    if (frameReceiver->createShmem(frameBuffers) != 0)
+      panic("Unable to create the shared memory frame ring. Aborting");
+  }
+  frameReceiver->setTiming(frameTiming);
+  if (frameReceiver->start() != 0) panic("Unable to start the frame receiver. Aborting");
+}
+
+/** Starts the per module receive threads of PIMEGA_FRAME_TRANSPORT_MODULES.
+ * The module layout comes from the detector model and has to cover the whole
+ * frame. */
+void pimegaDetector::connectModuleAssembler(const char *address, const std::string &topic,
+                                            size_t frameSize) {
+  pimegaGeometry geometry;
+
+  if (pimegaGetGeometry(detectorModel, &geometry) != 0 ||
+      geometry.modulesX * geometry.chipsX * PIMEGA_CHIP_SIZE != maxSizeX ||
+      geometry.modulesY * geometry.chipsY * PIMEGA_CHIP_SIZE != maxSizeY)
+    panic("The detector model has no module layout for this frame size. Aborting");
+
+  moduleAssembler = new pimegaModuleAssembler(
+          address, topic, geometry, vis_ndarray_dtype, frameSize,
+          frameBuffers > 0 ? frameBuffers : DEFAULT_FRAME_RING_SIZE, framePool,
+          [this](NDArray *pArray) {
+      this->publishFrame(pArray);
+  });
+  moduleAssembler->setTiming(frameTiming);
+  if (moduleAssembler->start() != 0) panic("Unable to start the module receivers. Aborting");
+}
+
 void pimegaDetector::setParameter(int index, const char *value) {
   asynStatus status;
 
@@ -1503,6 +2770,83 @@ void pimegaDetector::createParameters(void) {
   createParam(pimegaMetadataValueString, asynParamOctet, &PimegaMetadataValue);
   createParam(pimegaMetadataOMString, asynParamOctet, &PimegaMetadataOM);
   createParam(pimegaFrameProcessModeString, asynParamInt32, &PimegaFrameProcessMode);
+  createParam(pimegaFrameQueuePolicyString, asynParamInt32, &PimegaFrameQueuePolicy);
+  createParam(pimegaFrameQueueDepthString, asynParamInt32, &PimegaFrameQueueDepth);
+  createParam(pimegaFrameQueueDroppedString, asynParamInt32, &PimegaFrameQueueDropped);
+  createParam(pimegaPreviewModeString, asynParamInt32, &PimegaPreviewMode);
+  createParam(pimegaPreviewRateString, asynParamFloat64, &PimegaPreviewRate);
+  createParam(pimegaOutputDataTypeString, asynParamInt32, &PimegaOutputDataType);
+  createParam(pimegaFrameEncodingString, asynParamInt32, &PimegaFrameEncoding);
+  createParam(pimegaStatsEnableString, asynParamInt32, &PimegaStatsEnable);
+  createParam(pimegaStatsTotalString, asynParamFloat64, &PimegaStatsTotal);
+  createParam(pimegaStatsMinString, asynParamFloat64, &PimegaStatsMin);
+  createParam(pimegaStatsMaxString, asynParamFloat64, &PimegaStatsMax);
+  createParam(pimegaStatsMeanString, asynParamFloat64, &PimegaStatsMean);
+  createParam(pimegaStatsSaturatedString, asynParamInt32, &PimegaStatsSaturated);
+  createParam(pimegaStatsZerosString, asynParamInt32, &PimegaStatsZeros);
+  createParam(pimegaMaskEnableString, asynParamInt32, &PimegaMaskEnable);
+  createParam(pimegaMaskFileString, asynParamOctet, &PimegaMaskFile);
+  createParam(pimegaMaskString, asynParamInt8Array, &PimegaMask);
+  createParam(pimegaFlatFieldEnableString, asynParamInt32, &PimegaFlatFieldEnable);
+  createParam(pimegaFlatFieldFileString, asynParamOctet, &PimegaFlatFieldFile);
+  createParam(pimegaFlatFieldString, asynParamFloat32Array, &PimegaFlatField);
+  createParam(pimegaNumMaskedPixelsString, asynParamInt32, &PimegaNumMaskedPixels);
+  createParam(pimegaBloscCompressorString, asynParamInt32, &PimegaBloscCompressor);
+  createParam(pimegaBloscLevelString, asynParamInt32, &PimegaBloscLevel);
+  createParam(pimegaBloscShuffleString, asynParamInt32, &PimegaBloscShuffle);
+  createParam(pimegaCompressionFactorString, asynParamFloat64, &PimegaCompressionFactor);
+  createParam(pimegaSparseThresholdString, asynParamFloat64, &PimegaSparseThreshold);
+  createParam(pimegaSparseActiveString, asynParamInt32, &PimegaSparseActive);
+  createParam(pimegaAccumulateNumString, asynParamInt32, &PimegaAccumulateNum);
+  createParam(pimegaAccumulateModeString, asynParamInt32, &PimegaAccumulateMode);
+  createParam(pimegaAccumulateCountString, asynParamInt32, &PimegaAccumulateCount);
+  createParam(pimegaFrameRateString, asynParamFloat64, &PimegaFrameRate);
+  createParam(pimegaDataRateString, asynParamFloat64, &PimegaDataRate);
+  createParam(pimegaLatencyP50String, asynParamFloat64, &PimegaLatencyP50);
+  createParam(pimegaLatencyP99String, asynParamFloat64, &PimegaLatencyP99);
+  createParam(pimegaLatencyMaxString, asynParamFloat64, &PimegaLatencyMax);
+  createParam(pimegaStageLatencyP50String, asynParamFloat64Array, &PimegaStageLatencyP50);
+  createParam(pimegaStageLatencyP99String, asynParamFloat64Array, &PimegaStageLatencyP99);
+  createParam(pimegaStageLatencyMaxString, asynParamFloat64Array, &PimegaStageLatencyMax);
+  createParam(pimegaLatencyHistogramString, asynParamInt32Array, &PimegaLatencyHistogram);
+  createParam(pimegaLatencyHistogramBinsString, asynParamFloat64Array,
+              &PimegaLatencyHistogramBins);
+  createParam(pimegaModuleMaskString, asynParamInt32, &PimegaModuleMask);
+  createParam(pimegaIncompleteFramesString, asynParamInt32, &PimegaIncompleteFrames);
+  createParam(pimegaGeometryModeString, asynParamInt32, &PimegaGeometryMode);
+  createParam(pimegaGeometryFileString, asynParamOctet, &PimegaGeometryFile);
+  createParam(pimegaGeometryChipGapString, asynParamInt32, &PimegaGeometryChipGap);
+  createParam(pimegaGeometryModuleGapString, asynParamInt32, &PimegaGeometryModuleGap);
+  createParam(pimegaGeometrySpansString, asynParamInt32, &PimegaGeometrySpans);
+  createParam(pimegaEdgeCorrectionString, asynParamInt32, &PimegaEdgeCorrection);
+  createParam(pimegaHugePagesString, asynParamInt32, &PimegaHugePages);
+  createParam(pimegaHugePageBuffersString, asynParamInt32, &PimegaHugePageBuffers);
+  createParam(pimegaAcqPollRateString, asynParamFloat64, &PimegaAcqPollRate);
+  createParam(pimegaAcqWakeupRateString, asynParamFloat64, &PimegaAcqWakeupRate);
+  createParam(pimegaCapturePollRateString, asynParamFloat64, &PimegaCapturePollRate);
+  createParam(pimegaCaptureWakeupRateString, asynParamFloat64, &PimegaCaptureWakeupRate);
+  createParam(pimegaStatusMsgEmittedString, asynParamInt32, &PimegaStatusMsgEmitted);
+  createParam(pimegaStatusMsgSuppressedString, asynParamInt32, &PimegaStatusMsgSuppressed);
+  createParam(pimegaStatusParamEmittedString, asynParamInt32, &PimegaStatusParamEmitted);
+  createParam(pimegaStatusParamSuppressedString, asynParamInt32, &PimegaStatusParamSuppressed);
+  createParam(pimegaM1RxRateString, asynParamFloat64Array, &PimegaM1RxRate);
+  createParam(pimegaM1LostRateString, asynParamFloat64Array, &PimegaM1LostRate);
+  createParam(pimegaM1BufferTrendString, asynParamFloat64Array, &PimegaM1BufferTrend);
+  createParam(pimegaM1TimeToFullString, asynParamFloat64, &PimegaM1TimeToFull);
+  createParam(pimegaM2RxRateString, asynParamFloat64Array, &PimegaM2RxRate);
+  createParam(pimegaM2LostRateString, asynParamFloat64Array, &PimegaM2LostRate);
+  createParam(pimegaM2BufferTrendString, asynParamFloat64Array, &PimegaM2BufferTrend);
+  createParam(pimegaM2TimeToFullString, asynParamFloat64, &PimegaM2TimeToFull);
+  createParam(pimegaM3RxRateString, asynParamFloat64Array, &PimegaM3RxRate);
+  createParam(pimegaM3LostRateString, asynParamFloat64Array, &PimegaM3LostRate);
+  createParam(pimegaM3BufferTrendString, asynParamFloat64Array, &PimegaM3BufferTrend);
+  createParam(pimegaM3TimeToFullString, asynParamFloat64, &PimegaM3TimeToFull);
+  createParam(pimegaM4RxRateString, asynParamFloat64Array, &PimegaM4RxRate);
+  createParam(pimegaM4LostRateString, asynParamFloat64Array, &PimegaM4LostRate);
+  createParam(pimegaM4BufferTrendString, asynParamFloat64Array, &PimegaM4BufferTrend);
+  createParam(pimegaM4TimeToFullString, asynParamFloat64, &PimegaM4TimeToFull);
+  createParam(pimegaProcessedRateString, asynParamFloat64Array, &PimegaProcessedRate);
+  createParam(pimegaSavedRateString, asynParamFloat64Array, &PimegaSavedRate);
   /* Do callbacks so higher layers see any changes */
   callParamCallbacks();
 }
@@ -1598,6 +2942,62 @@ asynStatus pimegaDetector::setDefaults(void) {
   setParameter(PimegaMPAvgTSensorM4, 0.0);
   setParameter(NDFileNumCaptured, 0);
   setParameter(PimegaFrameProcessMode, 0);
+  setParameter(PimegaFrameQueuePolicy, (int)frameQueuePolicy);
+  setParameter(PimegaFrameQueueDepth, 0);
+  setParameter(PimegaFrameQueueDropped, 0);
+  setParameter(PimegaPreviewMode, PIMEGA_PREVIEW_OFF);
+  setParameter(PimegaPreviewRate, DEFAULT_PREVIEW_RATE);
+  setParameter(PimegaOutputDataType, PIMEGA_OUTPUT_UINT32);
+  setParameter(PimegaFrameEncoding, PIMEGA_ENCODING_NONE);
+  setParameter(PimegaStatsEnable, 0);
+  setParameter(PimegaStatsTotal, 0.0);
+  setParameter(PimegaStatsMin, 0.0);
+  setParameter(PimegaStatsMax, 0.0);
+  setParameter(PimegaStatsMean, 0.0);
+  setParameter(PimegaStatsSaturated, 0);
+  setParameter(PimegaStatsZeros, 0);
+  setParameter(PimegaMaskEnable, 0);
+  setParameter(PimegaMaskFile, "");
+  setParameter(PimegaFlatFieldEnable, 0);
+  setParameter(PimegaFlatFieldFile, "");
+  setParameter(PimegaNumMaskedPixels, 0);
+  setParameter(PimegaBloscCompressor, PIMEGA_BLOSC_LZ4);
+  setParameter(PimegaBloscLevel, 5);
+  setParameter(PimegaBloscShuffle, 2); /* bit shuffle */
+  setParameter(PimegaCompressionFactor, 1.0);
+  setParameter(PimegaSparseThreshold, DEFAULT_SPARSE_THRESHOLD);
+  setParameter(PimegaSparseActive, 0);
+  setParameter(PimegaAccumulateNum, 1);
+  setParameter(PimegaAccumulateMode, PIMEGA_ACCUMULATE_SUM);
+  setParameter(PimegaAccumulateCount, 0);
+  setParameter(PimegaFrameRate, 0.0);
+  setParameter(PimegaDataRate, 0.0);
+  setParameter(PimegaLatencyP50, 0.0);
+  setParameter(PimegaLatencyP99, 0.0);
+  setParameter(PimegaLatencyMax, 0.0);
+  setParameter(PimegaModuleMask,
+               moduleAssembler ? (1 << moduleAssembler->getNumModules()) - 1 : 0);
+  setParameter(PimegaIncompleteFrames, 0);
+  setParameter(PimegaGeometryMode, PIMEGA_GEOMETRY_OFF);
+  setParameter(PimegaGeometryFile, "");
+  setParameter(PimegaGeometryChipGap, DEFAULT_CHIP_GAP);
+  setParameter(PimegaGeometryModuleGap, DEFAULT_MODULE_GAP);
+  setParameter(PimegaGeometrySpans, 0);
+  setParameter(PimegaEdgeCorrection, 0);
+  setParameter(PimegaHugePages, framePool->getHugePages());
+  setParameter(PimegaHugePageBuffers, 0);
+  setParameter(PimegaAcqPollRate, 0.0);
+  setParameter(PimegaAcqWakeupRate, 0.0);
+  setParameter(PimegaCapturePollRate, 0.0);
+  setParameter(PimegaCaptureWakeupRate, 0.0);
+  setParameter(PimegaStatusMsgEmitted, 0);
+  setParameter(PimegaStatusMsgSuppressed, 0);
+  setParameter(PimegaStatusParamEmitted, 0);
+  setParameter(PimegaStatusParamSuppressed, 0);
+  setParameter(PimegaM1TimeToFull, -1.0);
+  setParameter(PimegaM2TimeToFull, -1.0);
+  setParameter(PimegaM3TimeToFull, -1.0);
+  setParameter(PimegaM4TimeToFull, -1.0);
 
   setParameter(PimegaModule, 10);
   setParameter(PimegaMedipixBoard, 2);
@@ -1681,6 +3081,45 @@ void pimegaDetector::report(FILE *fp, int details) {
     int dataType;
     getIntegerParam(NDDataType, &dataType);
     fprintf(fp, "  Data type:         %d\n", dataType);
+    fprintf(fp, "  Frame kernels:     %s\n", pimegaFrameOpsISA());
+    fprintf(fp, "  Frame workers:     %d\n", frameWorkers->getConcurrency());
+    pimegaReportPlacement(fp);
+    fprintf(fp, "  Frame codecs:      %s%s\n", pimegaBSLZ4Available() ? PIMEGA_CODEC_BSLZ4 " " : "",
+            pimegaBloscAvailable() ? PIMEGA_CODEC_BLOSC : "");
+    if (frameReceiver) {
+      fprintf(fp, "  Frames received:   %llu\n",
+              (unsigned long long)frameReceiver->getNumReceived());
+      fprintf(fp, "  Receive errors:    %llu\n",
+              (unsigned long long)frameReceiver->getNumErrors());
+      fprintf(fp, "  Ring full:         %llu\n",
+              (unsigned long long)frameReceiver->getNumRingFull());
+      fprintf(fp, "  Shmem overruns:    %llu\n",
+              (unsigned long long)frameReceiver->getNumOverruns());
+    }
+    fprintf(fp, "  Status pushed:     %llu\n", (unsigned long long)statusPushed_);
+    fprintf(fp, "  Status polled:     %llu\n", (unsigned long long)statusPolled_);
+    pimegaStatusSnapshot snapshot;
+    statusCache.read(&snapshot);
+    fprintf(fp, "  Status version:    %llu, %.3f s old\n", (unsigned long long)snapshot.version,
+            snapshot.version ? pimegaWallTime() - snapshot.timestamp : 0.0);
+    if (statusSubscriber) {
+      fprintf(fp, "  Status channel:    %s\n", statusSubscriber->getNumUpdates() > 0
+                                                  ? "pushed by the backend"
+                                                  : "nothing pushed, polling");
+      fprintf(fp, "  Status errors:     %llu\n",
+              (unsigned long long)statusSubscriber->getNumErrors());
+    }
+    if (moduleAssembler) {
+      fprintf(fp, "  Modules:           %d\n", moduleAssembler->getNumModules());
+      fprintf(fp, "  Frames assembled:  %llu\n",
+              (unsigned long long)moduleAssembler->getNumAssembled());
+      fprintf(fp, "  Frames incomplete: %llu\n",
+              (unsigned long long)moduleAssembler->getNumIncomplete());
+      fprintf(fp, "  Late tiles:        %llu\n",
+              (unsigned long long)moduleAssembler->getNumLate());
+      fprintf(fp, "  Tile errors:       %llu\n",
+              (unsigned long long)moduleAssembler->getNumErrors());
+    }
   }
 
   ADDriver::report(fp, details);
@@ -1689,6 +3128,9 @@ void pimegaDetector::report(FILE *fp, int details) {
 asynStatus pimegaDetector::startAcquire(void) {
   int rc = 0;
   pimega->pimegaParam.software_trigger = false;
+  framesDropped = 0;
+  accumulateReset_ = true;
+  if (moduleAssembler) moduleAssembler->reset();
   if (BoolAcqResetRDMA) {
     send_allinitArgs_allModules(pimega);
   }
@@ -1714,6 +3156,7 @@ asynStatus pimegaDetector::startCaptureBackend(void) {
 
   /* Clean up */
   reset_acq_status_return(pimega);
+  statusCache.publish(pimega->acq_status_return);
 
   /* Create the full filename */
   createFileName(sizeof(fullFileName), fullFileName);
@@ -1920,6 +3363,8 @@ asynStatus pimegaDetector::checkSensors(void) {
     doCallbacksInt32Array(PimegaDisabledSensors_, pimega->num_all_chips, idxParam, 0);
     idxParam++;
   }
+  /* The disabled chips are zeroed by the correction stage */
+  correctionChanged_ = true;
 
   if (rc != PIMEGA_SUCCESS) return asynError;
   return asynSuccess;
@@ -2383,6 +3828,11 @@ static const iocshArg pimegaDetectorConfigArg21 = {"log", iocshArgInt};
 static const iocshArg pimegaDetectorConfigArg22 = {"backend_port", iocshArgInt};
 static const iocshArg pimegaDetectorConfigArg23 = {"vis_frame_port", iocshArgInt};
 static const iocshArg pimegaDetectorConfigArg24 = {"IntAcqResetRDMA", iocshArgInt};
+static const iocshArg pimegaDetectorConfigArg25 = {"frameTransport", iocshArgInt};
+static const iocshArg pimegaDetectorConfigArg26 = {"frameBuffers", iocshArgInt};
+static const iocshArg pimegaDetectorConfigArg27 = {"frameQueueSize", iocshArgInt};
+static const iocshArg pimegaDetectorConfigArg28 = {"frameThreads", iocshArgInt};
+static const iocshArg pimegaDetectorConfigArg29 = {"hugePages", iocshArgInt};
 static const iocshArg *const pimegaDetectorConfigArgs[] = {
     &pimegaDetectorConfigArg0,  &pimegaDetectorConfigArg1,  &pimegaDetectorConfigArg2,
     &pimegaDetectorConfigArg3,  &pimegaDetectorConfigArg4,  &pimegaDetectorConfigArg5,
@@ -2392,8 +3842,9 @@ static const iocshArg *const pimegaDetectorConfigArgs[] = {
     &pimegaDetectorConfigArg15, &pimegaDetectorConfigArg16, &pimegaDetectorConfigArg17,
     &pimegaDetectorConfigArg18, &pimegaDetectorConfigArg19, &pimegaDetectorConfigArg20,
     &pimegaDetectorConfigArg21, &pimegaDetectorConfigArg22, &pimegaDetectorConfigArg23,
-    &pimegaDetectorConfigArg24};
-static const iocshFuncDef configpimegaDetector = {"pimegaDetectorConfig", 25,
+    &pimegaDetectorConfigArg24, &pimegaDetectorConfigArg25, &pimegaDetectorConfigArg26,
+    &pimegaDetectorConfigArg27, &pimegaDetectorConfigArg28, &pimegaDetectorConfigArg29};
+static const iocshFuncDef configpimegaDetector = {"pimegaDetectorConfig", 30,
                                                   pimegaDetectorConfigArgs};
 
 static void configpimegaDetectorCallFunc(const iocshArgBuf *args) {
@@ -2401,7 +3852,9 @@ static void configpimegaDetectorCallFunc(const iocshArgBuf *args) {
                        args[5].sval, args[6].sval, args[7].sval, args[8].sval, args[9].sval,
                        args[10].sval, args[11].ival, args[12].ival, args[13].ival, args[14].ival,
                        args[15].ival, args[16].ival, args[17].ival, args[18].ival, args[19].ival,
-                       args[20].ival, args[21].ival, args[22].ival, args[23].ival, args[24].ival);
+                       args[20].ival, args[21].ival, args[22].ival, args[23].ival, args[24].ival,
+                       args[25].ival, args[26].ival, args[27].ival, args[28].ival,
+                       args[29].ival);
 }
 
 static void pimegaDetectorRegister(void) {
@@ -2426,3 +3879,40 @@ static void pimegaPrintMaskRegister(void) {
 extern "C" {
 epicsExportRegistrar(pimegaPrintMaskRegister);
 }
+
+static const iocshArg pimegaThreadPlacementArg0 = {
+    "thread {receive, dispatch, workers, acquire, capture, alarm, buffers}", iocshArgString};
+static const iocshArg pimegaThreadPlacementArg1 = {"CPU list, e.g. 2-5,8", iocshArgString};
+static const iocshArg pimegaThreadPlacementArg2 = {"SCHED_FIFO priority, 0 for none",
+                                                   iocshArgInt};
+static const iocshArg pimegaThreadPlacementArg3 = {"NUMA node, empty or none for none",
+                                                   iocshArgString};
+static const iocshArg *const pimegaThreadPlacementArgs[] = {
+    &pimegaThreadPlacementArg0, &pimegaThreadPlacementArg1, &pimegaThreadPlacementArg2,
+    &pimegaThreadPlacementArg3};
+static const iocshFuncDef pimegaThreadPlacementFuncIocsh = {"pimegaThreadPlacement", 4,
+                                                            pimegaThreadPlacementArgs};
+
+/* An omitted NUMA node must not read as node 0, so it is taken as a string */
+void pimegaThreadPlacementFunc(const iocshArgBuf *args) {
+  const char *node = args[3].sval;
+  char *end;
+  long numaNode = -1;
+
+  if (node && *node && strcmp(node, "none") != 0) {
+    numaNode = strtol(node, &end, 10);
+    if (*end || numaNode < -1) {
+      printf("pimegaThreadPlacement: invalid NUMA node %s\n", node);
+      return;
+    }
+  }
+  pimegaSetPlacement(args[0].sval, args[1].sval, args[2].ival, (int)numaNode);
+}
+
+static void pimegaThreadPlacementRegister(void) {
+  iocshRegister(&pimegaThreadPlacementFuncIocsh, pimegaThreadPlacementFunc);
+}
+
+extern "C" {
+epicsExportRegistrar(pimegaThreadPlacementRegister);
+}
@@ -13,8 +13,11 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <map>
+#include <vector>
 
 // EPICS includes
 #include <cantProceed.h>
@@ -54,8 +57,25 @@
 #include <lib/zmq_message_broker.hpp>
 #include <pimega.h>
 
+#include "pimegaFrameCodec.h"
+#include "pimegaFrameOps.h"
+#include "pimegaFrameQueue.h"
+#include "pimegaFrameReceiver.h"
+#include "pimegaFrameTiming.h"
+#include "pimegaModuleAssembler.h"
+#include "pimegaModuleMetrics.h"
+#include "pimegaPollScheduler.h"
+#include "pimegaEdgeCorrection.h"
+#include "pimegaRemap.h"
+#include "pimegaStatusCache.h"
+#include "pimegaStatusPublisher.h"
+#include "pimegaStatusSubscriber.h"
+#include "pimegaThreadPlacement.h"
+#include "pimegaGeometry.h"
+#include "pimegaNDArrayPool.h"
+#include "pimegaWorkerPool.h"
+
 #define PIMEGA_MAX_FILENAME_LEN 300
-#define MAX_BAD_PIXELS 100
 /** Time to poll when reading from Labview */
 #define ASYN_POLL_TIME .01
 
@@ -89,6 +109,59 @@ typedef enum ioc_trigger_mode_t {
   IOC_TRIGGER_MODE_ALIGNMENT = 2
 } ioc_trigger_mode_t;
 
+typedef enum pimega_preview_mode_t {
+  PIMEGA_PREVIEW_OFF = 0,
+  PIMEGA_PREVIEW_ON = 1,
+  /* Preview only while the trigger mode is IOC_TRIGGER_MODE_ALIGNMENT */
+  PIMEGA_PREVIEW_ALIGNMENT = 2
+} pimega_preview_mode_t;
+
+#define DEFAULT_PREVIEW_RATE 10.0
+
+typedef enum pimega_output_type_t {
+  /* Smallest type that holds the counter depth after binning */
+  PIMEGA_OUTPUT_AUTO = 0,
+  PIMEGA_OUTPUT_UINT8 = 1,
+  PIMEGA_OUTPUT_UINT16 = 2,
+  PIMEGA_OUTPUT_UINT32 = 3
+} pimega_output_type_t;
+
+typedef enum pimega_frame_encoding_t {
+  PIMEGA_ENCODING_NONE = 0,
+  /* 1 bit bitmap or 6 bit packing when the counts fit, see pimegaFrameOps.h */
+  PIMEGA_ENCODING_PACKED = 1,
+  /* Compressed with the codecs of pimegaFrameCodec.h */
+  PIMEGA_ENCODING_BSLZ4 = 2,
+  PIMEGA_ENCODING_BLOSC = 3,
+  /* (index, count) pairs of the pixels with counts, see pimegaFrameOps.h */
+  PIMEGA_ENCODING_SPARSE = 4
+} pimega_frame_encoding_t;
+
+typedef enum pimega_accumulate_mode_t {
+  PIMEGA_ACCUMULATE_SUM = 0,
+  PIMEGA_ACCUMULATE_MEAN = 1
+} pimega_accumulate_mode_t;
+
+typedef enum pimega_geometry_mode_t {
+  /* Raw frames as the backend assembles them */
+  PIMEGA_GEOMETRY_OFF = 0,
+  /* Chips of the detector model layout with GeometryChipGap and
+   * GeometryModuleGap pixels between them */
+  PIMEGA_GEOMETRY_MODEL = 1,
+  /* Blocks of GeometryFile, see pimegaRemap.cpp */
+  PIMEGA_GEOMETRY_FILE = 2
+} pimega_geometry_mode_t;
+
+/* Room for the wide edge pixels of two neighbouring chips, 3 pixels wide
+ * each */
+#define DEFAULT_CHIP_GAP 4
+#define DEFAULT_MODULE_GAP 0
+
+/* Fraction of pixels with counts above which sparse frames are sent dense */
+#define DEFAULT_SPARSE_THRESHOLD 0.1
+
+#define DEFAULT_FRAME_THREADS 8
+
 #define pimegaMedipixModeString "MEDIPIX_MODE"
 #define pimegaefuseIDString "EFUSE_ID"
 #define pimegaOmrOPModeString "OMR_OP_MODE"
@@ -220,6 +293,82 @@ typedef enum ioc_trigger_mode_t {
 #define pimegaMetadataValueString "METADATA_VALUE"
 #define pimegaMetadataOMString "METADATA_OM"
 #define pimegaFrameProcessModeString "FRAME_PROCESS_MODE"
+#define pimegaFrameQueuePolicyString "FRAME_QUEUE_POLICY"
+#define pimegaFrameQueueDepthString "FRAME_QUEUE_DEPTH"
+#define pimegaFrameQueueDroppedString "FRAME_QUEUE_DROPPED"
+#define pimegaPreviewModeString "PREVIEW_MODE"
+#define pimegaPreviewRateString "PREVIEW_RATE"
+#define pimegaOutputDataTypeString "OUTPUT_DATA_TYPE"
+#define pimegaFrameEncodingString "FRAME_ENCODING"
+#define pimegaStatsEnableString "STATS_ENABLE"
+#define pimegaStatsTotalString "STATS_TOTAL"
+#define pimegaStatsMinString "STATS_MIN"
+#define pimegaStatsMaxString "STATS_MAX"
+#define pimegaStatsMeanString "STATS_MEAN"
+#define pimegaStatsSaturatedString "STATS_SATURATED"
+#define pimegaStatsZerosString "STATS_ZEROS"
+#define pimegaMaskEnableString "MASK_ENABLE"
+#define pimegaMaskFileString "MASK_FILE"
+#define pimegaMaskString "MASK"
+#define pimegaFlatFieldEnableString "FLATFIELD_ENABLE"
+#define pimegaFlatFieldFileString "FLATFIELD_FILE"
+#define pimegaFlatFieldString "FLATFIELD"
+#define pimegaNumMaskedPixelsString "NUM_MASKED_PIXELS"
+#define pimegaBloscCompressorString "BLOSC_COMPRESSOR"
+#define pimegaBloscLevelString "BLOSC_LEVEL"
+#define pimegaBloscShuffleString "BLOSC_SHUFFLE"
+#define pimegaCompressionFactorString "COMPRESSION_FACTOR"
+#define pimegaSparseThresholdString "SPARSE_THRESHOLD"
+#define pimegaSparseActiveString "SPARSE_ACTIVE"
+#define pimegaAccumulateNumString "ACCUMULATE_NUM"
+#define pimegaAccumulateModeString "ACCUMULATE_MODE"
+#define pimegaAccumulateCountString "ACCUMULATE_COUNT"
+#define pimegaFrameRateString "FRAME_RATE"
+#define pimegaDataRateString "DATA_RATE"
+#define pimegaLatencyP50String "LATENCY_P50"
+#define pimegaLatencyP99String "LATENCY_P99"
+#define pimegaLatencyMaxString "LATENCY_MAX"
+#define pimegaStageLatencyP50String "STAGE_LATENCY_P50"
+#define pimegaStageLatencyP99String "STAGE_LATENCY_P99"
+#define pimegaStageLatencyMaxString "STAGE_LATENCY_MAX"
+#define pimegaLatencyHistogramString "LATENCY_HISTOGRAM"
+#define pimegaLatencyHistogramBinsString "LATENCY_HISTOGRAM_BINS"
+#define pimegaModuleMaskString "MODULE_MASK"
+#define pimegaIncompleteFramesString "INCOMPLETE_FRAMES"
+#define pimegaGeometryModeString "GEOMETRY_MODE"
+#define pimegaGeometryFileString "GEOMETRY_FILE"
+#define pimegaGeometryChipGapString "GEOMETRY_CHIP_GAP"
+#define pimegaGeometryModuleGapString "GEOMETRY_MODULE_GAP"
+#define pimegaGeometrySpansString "GEOMETRY_SPANS"
+#define pimegaEdgeCorrectionString "EDGE_CORRECTION"
+#define pimegaHugePagesString "HUGE_PAGES"
+#define pimegaHugePageBuffersString "HUGE_PAGE_BUFFERS"
+#define pimegaAcqPollRateString "ACQ_POLL_RATE"
+#define pimegaAcqWakeupRateString "ACQ_WAKEUP_RATE"
+#define pimegaCapturePollRateString "CAPTURE_POLL_RATE"
+#define pimegaCaptureWakeupRateString "CAPTURE_WAKEUP_RATE"
+#define pimegaStatusMsgEmittedString "STATUS_MSG_EMITTED"
+#define pimegaStatusMsgSuppressedString "STATUS_MSG_SUPPRESSED"
+#define pimegaStatusParamEmittedString "STATUS_PARAM_EMITTED"
+#define pimegaStatusParamSuppressedString "STATUS_PARAM_SUPPRESSED"
+#define pimegaM1RxRateString "M1_RX_RATE"
+#define pimegaM1LostRateString "M1_LOST_RATE"
+#define pimegaM1BufferTrendString "M1_BUFFER_TREND"
+#define pimegaM1TimeToFullString "M1_TIME_TO_FULL"
+#define pimegaM2RxRateString "M2_RX_RATE"
+#define pimegaM2LostRateString "M2_LOST_RATE"
+#define pimegaM2BufferTrendString "M2_BUFFER_TREND"
+#define pimegaM2TimeToFullString "M2_TIME_TO_FULL"
+#define pimegaM3RxRateString "M3_RX_RATE"
+#define pimegaM3LostRateString "M3_LOST_RATE"
+#define pimegaM3BufferTrendString "M3_BUFFER_TREND"
+#define pimegaM3TimeToFullString "M3_TIME_TO_FULL"
+#define pimegaM4RxRateString "M4_RX_RATE"
+#define pimegaM4LostRateString "M4_LOST_RATE"
+#define pimegaM4BufferTrendString "M4_BUFFER_TREND"
+#define pimegaM4TimeToFullString "M4_TIME_TO_FULL"
+#define pimegaProcessedRateString "PROCESSED_RATE"
+#define pimegaSavedRateString "SAVED_RATE"
 
 class pimegaDetector : public ADDriver {
  public:
@@ -230,7 +379,8 @@ class pimegaDetector : public ADDriver {
                  const char *address_module09, const char *address_module10, int port, int maxSizeX,
                  int maxSizeY, int detectorModel, int maxBuffers, size_t maxMemory, int priority,
                  int stackSize, int simulate, int backendOn, int log, unsigned short backend_port,
-                 unsigned short vis_frame_port, int IntAcqResetRDMA);
+                 unsigned short vis_frame_port, int IntAcqResetRDMA, int frameTransport,
+                 int frameBuffers, int frameQueueSize, int frameThreads, int hugePages);
 
   virtual asynStatus writeFloat64(asynUser *pasynUser, epicsFloat64 value);
   virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
@@ -241,11 +391,16 @@ class pimegaDetector : public ADDriver {
   virtual asynStatus writeOctet(asynUser *pasynUser, const char *value, size_t maxChars,
                                 size_t *nActual);
   virtual asynStatus writeInt32Array(asynUser *pasynUser, epicsInt32 *value, size_t nElements);
+  virtual asynStatus writeInt8Array(asynUser *pasynUser, epicsInt8 *value, size_t nElements);
+  virtual asynStatus writeFloat32Array(asynUser *pasynUser, epicsFloat32 *value,
+                                       size_t nElements);
   virtual void report(FILE *fp, int details);
   virtual void alarmTask(void);
   virtual void acqTask(void);
   virtual void captureTask(void);
+  void dispatchTask(void);
   virtual void updateEpicsFrame(vis_dtype* data);
+  void publishFrame(NDArray *pArray);
   void updateIOCStatus(const char *message, int size);
   void updateServerStatus(const char *message, int size);
   void newImageTask();
@@ -391,10 +546,113 @@ class pimegaDetector : public ADDriver {
   int PimegaMetadataOM;
   int PimegaIndexError;
   int PimegaFrameProcessMode;
+  int PimegaFrameQueuePolicy;
+  int PimegaFrameQueueDepth;
+  int PimegaFrameQueueDropped;
+  int PimegaPreviewMode;
+  int PimegaPreviewRate;
+  int PimegaOutputDataType;
+  int PimegaFrameEncoding;
+  int PimegaStatsEnable;
+  int PimegaStatsTotal;
+  int PimegaStatsMin;
+  int PimegaStatsMax;
+  int PimegaStatsMean;
+  int PimegaStatsSaturated;
+  int PimegaStatsZeros;
+  int PimegaMaskEnable;
+  int PimegaMaskFile;
+  int PimegaMask;
+  int PimegaFlatFieldEnable;
+  int PimegaFlatFieldFile;
+  int PimegaFlatField;
+  int PimegaNumMaskedPixels;
+  int PimegaBloscCompressor;
+  int PimegaBloscLevel;
+  int PimegaBloscShuffle;
+  int PimegaCompressionFactor;
+  int PimegaSparseThreshold;
+  int PimegaSparseActive;
+  int PimegaAccumulateNum;
+  int PimegaAccumulateMode;
+  int PimegaAccumulateCount;
+  int PimegaFrameRate;
+  int PimegaDataRate;
+  int PimegaLatencyP50;
+  int PimegaLatencyP99;
+  int PimegaLatencyMax;
+  int PimegaStageLatencyP50;
+  int PimegaStageLatencyP99;
+  int PimegaStageLatencyMax;
+  int PimegaLatencyHistogram;
+  int PimegaLatencyHistogramBins;
+  int PimegaModuleMask;
+  int PimegaIncompleteFrames;
+  int PimegaGeometryMode;
+  int PimegaGeometryFile;
+  int PimegaGeometryChipGap;
+  int PimegaGeometryModuleGap;
+  int PimegaGeometrySpans;
+  int PimegaEdgeCorrection;
+  int PimegaHugePages;
+  int PimegaHugePageBuffers;
+  int PimegaAcqPollRate;
+  int PimegaAcqWakeupRate;
+  int PimegaCapturePollRate;
+  int PimegaCaptureWakeupRate;
+  int PimegaStatusMsgEmitted;
+  int PimegaStatusMsgSuppressed;
+  int PimegaStatusParamEmitted;
+  int PimegaStatusParamSuppressed;
+  int PimegaM1RxRate;
+  int PimegaM1LostRate;
+  int PimegaM1BufferTrend;
+  int PimegaM1TimeToFull;
+  int PimegaM2RxRate;
+  int PimegaM2LostRate;
+  int PimegaM2BufferTrend;
+  int PimegaM2TimeToFull;
+  int PimegaM3RxRate;
+  int PimegaM3LostRate;
+  int PimegaM3BufferTrend;
+  int PimegaM3TimeToFull;
+  int PimegaM4RxRate;
+  int PimegaM4LostRate;
+  int PimegaM4BufferTrend;
+  int PimegaM4TimeToFull;
+  int PimegaProcessedRate;
+  int PimegaSavedRate;
   NDArray *PimegaNDArray = NULL;
   int PimegaLogFile;
   bool BoolAcqResetRDMA = false;
   IMessageConsumer* message_consumer = nullptr;
+  pimegaFrameReceiver *frameReceiver = nullptr;
+  pimegaModuleAssembler *moduleAssembler = nullptr;
+  pimegaNDArrayPool *framePool = nullptr;
+  pimegaStatusPublisher *statusPublisher = nullptr;
+  pimegaStatusSubscriber *statusSubscriber = nullptr;
+  /* Backend status for every thread, fetched by the capture task */
+  pimegaStatusCache statusCache;
+  /* Rates of the backend counters, sampled by alarmTask */
+  pimegaModuleMetrics moduleMetrics;
+  uint64_t statusSeen_ = 0;
+  uint64_t statusPushed_ = 0;
+  uint64_t statusPolled_ = 0;
+  /* Wait times of acqTask and captureTask */
+  pimegaPollScheduler acqPoll_;
+  pimegaPollScheduler capturePoll_;
+  int frameTransport;
+  int frameBuffers;
+  pimegaFrameQueue *frameQueue = nullptr;
+  pimegaWorkerPool *frameWorkers = nullptr;
+  std::atomic<int> frameQueuePolicy;
+  std::atomic<uint64_t> framesDropped;
+  std::atomic<bool> previewActive;
+  std::atomic<double> previewPeriod;
+  /* Newest frame not yet dispatched in preview mode */
+  std::atomic<NDArray *> previewFrame;
+  /* Indexed by pimega_frame_stage_t */
+  pimegaStageTiming frameTiming[PIMEGA_NUM_STAGES];
 #define LAST_PIMEGA_PARAM PimegaLogFile
 
  private:
@@ -410,11 +668,54 @@ class pimegaDetector : public ADDriver {
   epicsEventId stopAcquireEventId_;
   epicsEventId startCaptureEventId_;
   epicsEventId stopCaptureEventId_;
+  /* Signalled by the status subscriber, and by a capture stop request */
+  epicsEventId statusEventId_;
+  epicsEventId frameQueuedEventId_;
+  epicsEventId frameDequeuedEventId_;
+  /* Monotonic, in ns */
+  uint64_t lastPreviewTime_;
 
   pimega_t *pimega;
+  int detectorModel;
   int maxSizeX;
   int maxSizeY;
 
+  /* Correction maps of maxSizeX x maxSizeY pixels, empty when not loaded */
+  std::vector<uint8_t> pixelMask_;
+  std::vector<float> flatField_;
+  /* Maps used by the correction stage, rebuilt by the dispatch thread when
+   * correctionChanged_ is set. badPixels_ adds the disabled chips to the
+   * mask; gainMap_ is the flat field with the bad pixels set to 0. */
+  std::vector<uint8_t> badPixels_;
+  std::vector<float> gainMap_;
+  bool correctionChanged_;
+
+  /* Geometry remap used by the dispatch thread. A new table is built in
+   * nextRemap_ under the lock and swapped in by the dispatch thread when
+   * remapChanged_ is set, since remap_ is read with the lock released. */
+  pimegaRemap remap_;
+  pimegaRemap nextRemap_;
+  /* Border pixel redistribution of the model geometry, swapped with the
+   * remap */
+  pimegaEdgeCorrection edges_;
+  pimegaEdgeCorrection nextEdges_;
+  bool remapChanged_;
+
+  /* Frame accumulation, only used by the dispatch thread. accumulateReset_
+   * is set under the lock to start a new sum. summedFrames_ is the number of
+   * frames summed in the frame being processed. */
+  std::vector<uint64_t> accumulator_;
+  int numAccumulated_;
+  bool accumulateReset_;
+  int summedFrames_;
+
+  /* Frames and bytes sent to the plugins, under the lock */
+  uint64_t framesPublished_;
+  uint64_t bytesPublished_;
+  uint64_t lastFramesPublished_;
+  uint64_t lastBytesPublished_;
+  uint64_t lastTimingNs_;
+
   int arrayCallbacks;
   size_t dims[2];
   int itemp;
@@ -429,6 +730,35 @@ class pimegaDetector : public ADDriver {
   void panic(const char *msg);
   void connect(const char *address[4], unsigned short port,
           unsigned short backend_port, unsigned short vis_frame_port);
+  void connectFrameReceiver(const char *address, const std::string &topic, size_t frameSize);
+  void connectModuleAssembler(const char *address, const std::string &topic, size_t frameSize);
+  void updatePreview(int mode, int trigger);
+  void waitBackendStatus(double timeout);
+  double expectedRunTime(int numFrames);
+  void publishFrameTiming(void);
+  void publishPollRates(void);
+  void publishModuleMetrics(void);
+  NDArray *takePreviewFrame(double *delay);
+  NDArray *processFrame(NDArray *pIn);
+  int counterBits(void);
+  int frameBits(int binX, int binY);
+  bool accumulateFrame(NDArray *pIn, int numAccumulate);
+  asynStatus loadPixelMap(const char *file, void *pMap, size_t pixelSize);
+  asynStatus checkFlatField(const float *pGain, size_t numPixels);
+  void updateCorrection(int maskEnable, int flatEnable);
+  void correctFrame(NDArray *pIn, int minY, int sizeY);
+  void computeFrameStats(NDArray *pIn, int minX, int minY, int sizeX, int sizeY,
+                         pimegaFrameStats *stats);
+  void publishFrameStats(const pimegaFrameStats *stats, NDArray *pArray);
+  NDDataType_t outputDataType(int binX, int binY);
+  NDArray *allocFrame(NDArray *pIn, NDDataType_t dataType, size_t dataSize);
+  NDArray *narrowFrame(NDArray *pIn, NDDataType_t dataType);
+  NDArray *packFrame(NDArray *pIn, int bits);
+  asynStatus updateRemap(int mode, const char *file, int chipGap, int moduleGap);
+  NDArray *remapFrame(NDArray *pIn);
+  void correctEdges(NDArray *pIn);
+  NDArray *sparseFrame(NDArray *pIn, double threshold);
+  NDArray *compressFrame(NDArray *pIn, int encoding);
   void createParameters(void);
   void setParameter(int index, const char *value);
   void setParameter(int index, int value);
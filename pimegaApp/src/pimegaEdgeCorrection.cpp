@@ -0,0 +1,119 @@
+/* pimegaEdgeCorrection.cpp
+ *
+ * Border pixel redistribution. The weight matrix only has entries for the
+ * border pixels and their gap pixels, so it is kept as runs of border pixels
+ * that share their weights. The runs along a chip row are contiguous and
+ * vectorize; the corners are split in two passes, first down the gap rows
+ * and then across the gap columns, which gives them a square fan. Like the
+ * frame kernels this file asks for full optimization itself.
+ */
+
+#pragma GCC optimize("O3")
+
+#include "pimegaEdgeCorrection.h"
+
+static pimegaEdgeSpan edgeSpan(uint32_t src, int32_t srcStep, uint32_t length, int32_t fanStep,
+                               int fanOut) {
+  pimegaEdgeSpan span;
+
+  span.src = src;
+  span.srcStep = srcStep;
+  span.length = length;
+  span.fanStep = fanStep;
+  span.fanOut = fanOut;
+  /* Rounded up, so counts that divide evenly are split exactly. With fans of
+   * up to PIMEGA_EDGE_MAX_FAN the shares still never add up to more than the
+   * counts. */
+  for (int k = 0; k < PIMEGA_EDGE_MAX_FAN; k++)
+    span.weight[k] = k < fanOut ? (PIMEGA_EDGE_WEIGHT_ONE + fanOut - 1) / fanOut : 0;
+  return span;
+}
+
+int pimegaEdgeCorrection::build(const pimegaGeometry &geometry, int chipGap, int moduleGap,
+                                std::string &error) {
+  int moduleX = geometry.chipsX * PIMEGA_CHIP_SIZE + (geometry.chipsX - 1) * chipGap;
+  int moduleY = geometry.chipsY * PIMEGA_CHIP_SIZE + (geometry.chipsY - 1) * chipGap;
+  int32_t width = geometry.modulesX * (moduleX + moduleGap) - moduleGap;
+  int fanOut = 1 + chipGap / 2;
+
+  clear();
+  if (fanOut < 2) {
+    error = "The chip gap has no room for the border pixels";
+    return -1;
+  }
+  if (fanOut > PIMEGA_EDGE_MAX_FAN) fanOut = PIMEGA_EDGE_MAX_FAN;
+
+  for (int my = 0; my < geometry.modulesY; my++) {
+    for (int cy = 0; cy < geometry.chipsY; cy++) {
+      std::vector<pimegaEdgeSpan> horizontal, vertical;
+      int y0 = my * (moduleY + moduleGap) + cy * (PIMEGA_CHIP_SIZE + chipGap);
+      bool top = cy > 0, bottom = cy < geometry.chipsY - 1;
+      /* The vertical borders also cover the gap rows the corners went to */
+      int firstRow = top ? y0 - (fanOut - 1) : y0;
+      int lastRow = y0 + PIMEGA_CHIP_SIZE - 1 + (bottom ? fanOut - 1 : 0);
+
+      for (int mx = 0; mx < geometry.modulesX; mx++) {
+        for (int cx = 0; cx < geometry.chipsX; cx++) {
+          int x0 = mx * (moduleX + moduleGap) + cx * (PIMEGA_CHIP_SIZE + chipGap);
+          int x1 = x0 + PIMEGA_CHIP_SIZE - 1;
+          int y1 = y0 + PIMEGA_CHIP_SIZE - 1;
+
+          if (top)
+            horizontal.push_back(
+                edgeSpan(y0 * width + x0, 1, PIMEGA_CHIP_SIZE, -width, fanOut));
+          if (bottom)
+            horizontal.push_back(
+                edgeSpan(y1 * width + x0, 1, PIMEGA_CHIP_SIZE, width, fanOut));
+          if (cx > 0)
+            vertical.push_back(edgeSpan(firstRow * width + x0, width, lastRow - firstRow + 1,
+                                        -1, fanOut));
+          if (cx < geometry.chipsX - 1)
+            vertical.push_back(edgeSpan(firstRow * width + x1, width, lastRow - firstRow + 1,
+                                        1, fanOut));
+        }
+      }
+      horizontal.insert(horizontal.end(), vertical.begin(), vertical.end());
+      rows_.push_back(horizontal);
+    }
+  }
+  return 0;
+}
+
+size_t pimegaEdgeCorrection::getNumSpans(void) const {
+  size_t numSpans = 0;
+  for (size_t i = 0; i < rows_.size(); i++) numSpans += rows_[i].size();
+  return numSpans;
+}
+
+void pimegaEdgeCorrection::apply(uint32_t *frame, int chipRow) const {
+  const std::vector<pimegaEdgeSpan> &spans = rows_[chipRow];
+
+  for (size_t s = 0; s < spans.size(); s++) {
+    const pimegaEdgeSpan &span = spans[s];
+    uint32_t *p = frame + span.src;
+
+    if (span.srcStep == 1) {
+      /* Contiguous border pixels: one vector pass per fan pixel */
+      for (int k = 1; k < span.fanOut; k++) {
+        uint32_t *q = p + (ptrdiff_t)k * span.fanStep;
+        uint64_t w = span.weight[k];
+        for (uint32_t i = 0; i < span.length; i++) q[i] = (uint32_t)((p[i] * w) >> 16);
+      }
+      for (int k = 1; k < span.fanOut; k++) {
+        const uint32_t *q = p + (ptrdiff_t)k * span.fanStep;
+        for (uint32_t i = 0; i < span.length; i++) p[i] -= q[i];
+      }
+    } else {
+      for (uint32_t i = 0; i < span.length; i++, p += span.srcStep) {
+        uint64_t counts = *p;
+        uint32_t rest = *p;
+        for (int k = 1; k < span.fanOut; k++) {
+          uint32_t share = (uint32_t)((counts * span.weight[k]) >> 16);
+          p[(ptrdiff_t)k * span.fanStep] = share;
+          rest -= share;
+        }
+        *p = rest;
+      }
+    }
+  }
+}
@@ -0,0 +1,63 @@
+/*
+ * pimegaEdgeCorrection.h
+ *
+ * Redistribution of the counts of the large Medipix pixels along the chip
+ * borders. Once the geometry is corrected, every border pixel is followed by
+ * the gap pixels it physically covers; its counts are split over them so the
+ * borders do not show as bright lines.
+ */
+
+#ifndef PIMEGA_EDGE_CORRECTION_H
+#define PIMEGA_EDGE_CORRECTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "pimegaGeometry.h"
+
+/* Most pixels one border pixel is split over along one direction */
+#define PIMEGA_EDGE_MAX_FAN 8
+
+/* Weights are fixed point with 16 fraction bits */
+#define PIMEGA_EDGE_WEIGHT_ONE 65536
+
+/* A run of length border pixels from src on, srcStep apart. Pixel k of the
+ * fan of each one is fanStep * k further, and receives weight[k] of its
+ * counts. The border pixel itself, k = 0, keeps what the others did not get,
+ * so counts are conserved. */
+typedef struct pimegaEdgeSpan {
+  uint32_t src;
+  int32_t srcStep;
+  uint32_t length;
+  int32_t fanStep;
+  int fanOut;
+  uint32_t weight[PIMEGA_EDGE_MAX_FAN];
+} pimegaEdgeSpan;
+
+class pimegaEdgeCorrection {
+ public:
+  /* For frames remapped with pimegaRemap::buildFromGeometry and the same
+   * gaps. Each border pixel is split over itself and half of the chip gap
+   * next to it. */
+  int build(const pimegaGeometry &geometry, int chipGap, int moduleGap, std::string &error);
+  void clear(void) { rows_.clear(); }
+
+  bool valid(void) const { return !rows_.empty(); }
+  size_t getNumSpans(void) const;
+
+  /* The spans of each row of chips only touch the pixels of that row and of
+   * half of the gaps around it, so the rows can be corrected in parallel */
+  int getNumChipRows(void) const { return (int)rows_.size(); }
+  void apply(uint32_t *frame, int chipRow) const;
+
+ private:
+  /* Per chip row: first the spans of the horizontal borders, then those of
+   * the vertical ones, which also spread the corners the first ones pushed
+   * into the gap rows */
+  std::vector<std::vector<pimegaEdgeSpan> > rows_;
+};
+
+#endif
@@ -0,0 +1,169 @@
+/* pimegaFrameCodec.cpp
+ *
+ * bslz4 and Blosc compression of frames. Like the frame kernels this file
+ * asks for full optimization itself.
+ */
+
+#pragma GCC optimize("O3")
+
+#include "pimegaFrameCodec.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#ifdef HAVE_BITSHUFFLE
+#include <bitshuffle.h>
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_BLOSC
+#include <blosc.h>
+#endif
+
+/* Bytes in a bslz4 block, the default of the bitshuffle library. A block
+ * fits in the L1 cache while it is shuffled and compressed. */
+#define BSLZ4_BLOCK_BYTES 8192
+/* Size of the bslz4 header */
+#define BSLZ4_HEADER_SIZE 12
+/* bitshuffle works on groups of 8 elements, the ones left over are stored
+ * uncompressed at the end */
+#define BSLZ4_ELEMENT_GROUP 8
+
+bool pimegaBSLZ4Available(void) {
+#ifdef HAVE_BITSHUFFLE
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool pimegaBloscAvailable(void) {
+#ifdef HAVE_BLOSC
+  return true;
+#else
+  return false;
+#endif
+}
+
+#ifdef HAVE_BITSHUFFLE
+static void writeUint32BE(uint8_t *p, uint32_t value) {
+  for (int i = 3; i >= 0; i--, value >>= 8) p[i] = (uint8_t)value;
+}
+
+static void writeUint64BE(uint8_t *p, uint64_t value) {
+  for (int i = 7; i >= 0; i--, value >>= 8) p[i] = (uint8_t)value;
+}
+
+static size_t bslz4BlockElements(size_t elemSize) {
+  return BSLZ4_BLOCK_BYTES / elemSize / BSLZ4_ELEMENT_GROUP * BSLZ4_ELEMENT_GROUP;
+}
+
+/* Room taken by a compressed block and its size */
+static size_t bslz4BlockBound(size_t elemSize) {
+  return 4 + LZ4_compressBound((int)(bslz4BlockElements(elemSize) * elemSize));
+}
+#endif
+
+size_t pimegaBSLZ4Bound(size_t n, size_t elemSize) {
+#ifdef HAVE_BITSHUFFLE
+  size_t blockElems = bslz4BlockElements(elemSize);
+  size_t numBlocks = (n + blockElems - 1) / blockElems;
+
+  return BSLZ4_HEADER_SIZE + numBlocks * bslz4BlockBound(elemSize) +
+         BSLZ4_ELEMENT_GROUP * elemSize;
+#else
+  return n * elemSize;
+#endif
+}
+
+size_t pimegaBloscBound(size_t n, size_t elemSize) {
+#ifdef HAVE_BLOSC
+  return n * elemSize + BLOSC_MAX_OVERHEAD;
+#else
+  return n * elemSize;
+#endif
+}
+
+size_t pimegaCompressBSLZ4(const void *src, size_t n, size_t elemSize, void *dst,
+                           pimegaWorkerPool *workers) {
+#ifdef HAVE_BITSHUFFLE
+  const char *in = (const char *)src;
+  uint8_t *out = (uint8_t *)dst;
+  size_t blockElems = bslz4BlockElements(elemSize);
+  size_t blockBound = bslz4BlockBound(elemSize);
+  size_t numFull = n / blockElems;
+  size_t lastElems = n % blockElems / BSLZ4_ELEMENT_GROUP * BSLZ4_ELEMENT_GROUP;
+  size_t numBlocks = numFull + (lastElems ? 1 : 0);
+  size_t rawElems = n - numFull * blockElems - lastElems;
+  int numTasks = (int)std::min(numBlocks, (size_t)(4 * workers->getConcurrency()));
+  std::vector<size_t> taskSize(numTasks);
+  size_t pos = BSLZ4_HEADER_SIZE;
+
+  writeUint64BE(out, n * elemSize);
+  writeUint32BE(out + 8, (uint32_t)(blockElems * elemSize));
+
+  /* Each task writes its blocks where they would be if all of them took the
+   * bound, then the tasks are moved together */
+  workers->run(numTasks, [&](int task) {
+    size_t first = numBlocks * task / numTasks;
+    size_t last = numBlocks * (task + 1) / numTasks;
+    uint8_t *pOut = out + BSLZ4_HEADER_SIZE + first * blockBound;
+    char shuffled[BSLZ4_BLOCK_BYTES];
+    size_t size = 0;
+
+    for (size_t block = first; block < last; block++) {
+      size_t elems = block < numFull ? blockElems : lastElems;
+      int bytes = (int)(elems * elemSize);
+      int compressed;
+
+      if (bshuf_trans_bit_elem(in + block * blockElems * elemSize, shuffled, elems, elemSize) < 0) {
+        size = 0;
+        break;
+      }
+      compressed = LZ4_compress_default(shuffled, (char *)pOut + size + 4, bytes,
+                                        LZ4_compressBound(bytes));
+      if (compressed <= 0) {
+        size = 0;
+        break;
+      }
+      writeUint32BE(pOut + size, (uint32_t)compressed);
+      size += 4 + compressed;
+    }
+    taskSize[task] = size;
+  });
+
+  for (int task = 0; task < numTasks; task++) {
+    size_t start = BSLZ4_HEADER_SIZE + numBlocks * task / numTasks * blockBound;
+    if (taskSize[task] == 0) return 0;
+    if (start != pos) memmove(out + pos, out + start, taskSize[task]);
+    pos += taskSize[task];
+  }
+  memcpy(out + pos, in + (n - rawElems) * elemSize, rawElems * elemSize);
+  return pos + rawElems * elemSize;
+#else
+  (void)src, (void)n, (void)elemSize, (void)dst, (void)workers;
+  return 0;
+#endif
+}
+
+size_t pimegaCompressBlosc(const void *src, size_t n, size_t elemSize, void *dst, int level,
+                           int shuffle, int compressor, int numThreads) {
+#ifdef HAVE_BLOSC
+  /* Indexed by pimega_blosc_compressor_t */
+  static const char *compressors[] = {"blosclz", "lz4", "lz4hc", "snappy", "zlib", "zstd"};
+  int size;
+
+  if (compressor < 0 || compressor > PIMEGA_BLOSC_ZSTD) return 0;
+  size = blosc_compress_ctx(level, shuffle, elemSize, n * elemSize, src, dst,
+                            pimegaBloscBound(n, elemSize), compressors[compressor], 0,
+                            numThreads);
+  return size > 0 ? (size_t)size : 0;
+#else
+  (void)src, (void)n, (void)elemSize, (void)dst, (void)level, (void)shuffle, (void)compressor;
+  (void)numThreads;
+  return 0;
+#endif
+}
@@ -0,0 +1,51 @@
+/*
+ * pimegaFrameCodec.h
+ *
+ * Compression of visualizer frames into the codecs of the areaDetector
+ * NDArray codec field, so the HDF5 plugin can write the chunks directly.
+ * Each codec is only built when its library is, see the Makefile.
+ */
+
+#ifndef PIMEGA_FRAME_CODEC_H
+#define PIMEGA_FRAME_CODEC_H
+
+#include <stddef.h>
+
+#include "pimegaWorkerPool.h"
+
+/* Codec names, as used by NDPluginCodec and NDFileHDF5 */
+#define PIMEGA_CODEC_BSLZ4 "bslz4"
+#define PIMEGA_CODEC_BLOSC "blosc"
+
+/* Blosc compressors, in the order of the BloscCompressor records */
+typedef enum pimega_blosc_compressor_t {
+  PIMEGA_BLOSC_BLOSCLZ = 0,
+  PIMEGA_BLOSC_LZ4 = 1,
+  PIMEGA_BLOSC_LZ4HC = 2,
+  PIMEGA_BLOSC_SNAPPY = 3,
+  PIMEGA_BLOSC_ZLIB = 4,
+  PIMEGA_BLOSC_ZSTD = 5
+} pimega_blosc_compressor_t;
+
+bool pimegaBSLZ4Available(void);
+bool pimegaBloscAvailable(void);
+
+/* Largest compressed size of n elements of elemSize bytes */
+size_t pimegaBSLZ4Bound(size_t n, size_t elemSize);
+size_t pimegaBloscBound(size_t n, size_t elemSize);
+
+/* Compresses n elements of elemSize bytes to dst, which holds the bound
+ * above. Returns the compressed size, or 0 on failure.
+ *
+ * The bslz4 output is the chunk format of the HDF5 bitshuffle filter: the
+ * big endian uncompressed size and block size, then every block bit
+ * shuffled and LZ4 compressed. Blocks are split over the workers. */
+size_t pimegaCompressBSLZ4(const void *src, size_t n, size_t elemSize, void *dst,
+                           pimegaWorkerPool *workers);
+
+/* Blosc splits the frame in blocks over its own numThreads threads. shuffle
+ * is 0 for none, 1 for byte and 2 for bit shuffle. */
+size_t pimegaCompressBlosc(const void *src, size_t n, size_t elemSize, void *dst, int level,
+                           int shuffle, int compressor, int numThreads);
+
+#endif
@@ -0,0 +1,837 @@
+/* pimegaFrameOps.cpp
+ *
+ * Frame kernels. The rest of the driver is built with -O0, so this file asks
+ * for full optimization itself. The SIMD versions are compiled with the
+ * target attribute and selected at load time from what the CPU supports.
+ */
+
+#pragma GCC optimize("O3")
+
+#include "pimegaFrameOps.h"
+
+#include <string.h>
+
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/* dst[i] = min(dst[i] + src[i], UINT32_MAX). Adding min(b, ~a) to a never
+ * wraps and gives UINT32_MAX exactly when a + b would. */
+typedef void (*satAddRowFunc)(uint32_t *dst, const uint32_t *src, size_t n);
+
+static inline uint32_t satAdd(uint32_t a, uint32_t b) {
+  uint32_t room = ~a;
+  return a + (b < room ? b : room);
+}
+
+static void satAddRowScalar(uint32_t *dst, const uint32_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++) dst[i] = satAdd(dst[i], src[i]);
+}
+
+/* out[i] = satAdd(in[2 * i], in[2 * i + 1]) for n outputs, the horizontal
+ * step of binning. out may be in: every output is written after the inputs
+ * it covers are read. */
+typedef void (*pairSumFunc)(const uint32_t *in, size_t n, uint32_t *out);
+
+static void pairSumScalar(const uint32_t *in, size_t n, uint32_t *out) {
+  for (size_t i = 0; i < n; i++) out[i] = satAdd(in[2 * i], in[2 * i + 1]);
+}
+
+/* Narrowing to 16 and 8 bits clamps to the largest value of the type */
+typedef void (*narrow16Func)(const uint32_t *src, size_t n, uint16_t *dst);
+typedef void (*narrow8Func)(const uint32_t *src, size_t n, uint8_t *dst);
+
+static void narrow16Scalar(const uint32_t *src, size_t n, uint16_t *dst) {
+  for (size_t i = 0; i < n; i++) dst[i] = src[i] < UINT16_MAX ? src[i] : UINT16_MAX;
+}
+
+static void narrow8Scalar(const uint32_t *src, size_t n, uint8_t *dst) {
+  for (size_t i = 0; i < n; i++) dst[i] = src[i] < UINT8_MAX ? src[i] : UINT8_MAX;
+}
+
+typedef void (*packFunc)(const uint32_t *src, size_t n, uint8_t *dst);
+typedef void (*unpackFunc)(const uint8_t *src, size_t n, uint8_t *dst);
+
+static void pack1Scalar(const uint32_t *src, size_t n, uint8_t *dst) {
+  for (size_t i = 0; i < n; i += 8) {
+    uint8_t byte = 0;
+    for (size_t j = 0; j < 8 && i + j < n; j++) byte |= (src[i + j] != 0) << j;
+    dst[i / 8] = byte;
+  }
+}
+
+static void unpack1Scalar(const uint8_t *src, size_t n, uint8_t *dst) {
+  for (size_t i = 0; i < n; i++) dst[i] = (src[i / 8] >> (i % 8)) & 1;
+}
+
+static void pack6Scalar(const uint32_t *src, size_t n, uint8_t *dst) {
+  for (size_t i = 0; i < n; i += 4) {
+    uint32_t word = 0;
+    size_t count = n - i < 4 ? n - i : 4;
+    for (size_t j = 0; j < count; j++) {
+      uint32_t pixel = src[i + j] < 63 ? src[i + j] : 63;
+      word |= pixel << (6 * j);
+    }
+    /* A last partial group only takes the bytes its pixels need */
+    for (size_t b = 0; b < (count * 6 + 7) / 8; b++) dst[i / 4 * 3 + b] = word >> (8 * b);
+  }
+}
+
+static void unpack6Scalar(const uint8_t *src, size_t n, uint8_t *dst) {
+  for (size_t i = 0; i < n; i++) {
+    const uint8_t *group = src + i / 4 * 3;
+    size_t bit = 6 * (i % 4);
+    uint32_t bits = group[bit / 8];
+    if (bit % 8 > 2) bits |= group[bit / 8 + 1] << 8;
+    dst[i] = (bits >> (bit % 8)) & 63;
+  }
+}
+
+typedef void (*maskRowFunc)(uint32_t *data, const uint8_t *bad, size_t n);
+typedef void (*gainRowFunc)(uint32_t *data, const float *gain, size_t n);
+
+static void maskRowScalar(uint32_t *data, const uint8_t *bad, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    if (bad[i]) data[i] = 0;
+}
+
+/* The SIMD versions work in single precision, so this does too */
+static void gainRowScalar(uint32_t *data, const float *gain, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    float value = (float)data[i] * gain[i] + 0.5f;
+    if (value <= 0)
+      data[i] = 0;
+    else if (value >= 4294967040.0f)
+      data[i] = UINT32_MAX;
+    else
+      data[i] = (uint32_t)value;
+  }
+}
+
+typedef void (*statsRowFunc)(const uint32_t *src, size_t n, uint32_t saturation,
+                             pimegaFrameStats *stats);
+
+static void statsRowScalar(const uint32_t *src, size_t n, uint32_t saturation,
+                           pimegaFrameStats *stats) {
+  for (size_t i = 0; i < n; i++) {
+    uint32_t v = src[i];
+    stats->total += v;
+    if (v < stats->min) stats->min = v;
+    if (v > stats->max) stats->max = v;
+    stats->numZeros += v == 0;
+    stats->numSaturated += v >= saturation;
+  }
+  stats->numPixels += n;
+}
+
+/* acc[i] += src[i] with 64 bit sums */
+typedef void (*accumulateRowFunc)(uint64_t *acc, const uint32_t *src, size_t n);
+
+static void accumulateRowScalar(uint64_t *acc, const uint32_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++) acc[i] += src[i];
+}
+
+/* Sparse frames: counting the pixels with counts, then listing them */
+typedef size_t (*countNonZeroFunc)(const uint32_t *src, size_t n);
+typedef size_t (*sparseFunc)(const uint32_t *src, size_t n, uint32_t index, uint32_t *dst);
+
+static size_t countNonZeroScalar(const uint32_t *src, size_t n) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) count += src[i] != 0;
+  return count;
+}
+
+static size_t sparseScalar(const uint32_t *src, size_t n, uint32_t index, uint32_t *dst) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (!src[i]) continue;
+    dst[2 * count] = index + (uint32_t)i;
+    dst[2 * count + 1] = src[i];
+    count++;
+  }
+  return count;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.1"))) static void satAddRowSSE41(uint32_t *dst, const uint32_t *src,
+                                                             size_t n) {
+  const __m128i ones = _mm_set1_epi32(-1);
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+    b = _mm_min_epu32(b, _mm_xor_si128(a, ones));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi32(a, b));
+  }
+  satAddRowScalar(dst + i, src + i, n - i);
+}
+
+/* shuffle_ps splits the even and odd pixels of two vectors */
+__attribute__((target("sse4.1"))) static void pairSumSSE41(const uint32_t *in, size_t n,
+                                                           uint32_t *out) {
+  const __m128i ones = _mm_set1_epi32(-1);
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m128 a = _mm_loadu_ps((const float *)(in + 2 * i));
+    __m128 b = _mm_loadu_ps((const float *)(in + 2 * i + 4));
+    __m128i even = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i odd = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    odd = _mm_min_epu32(odd, _mm_xor_si128(even, ones));
+    _mm_storeu_si128((__m128i *)(out + i), _mm_add_epi32(even, odd));
+  }
+  pairSumScalar(in + 2 * i, n - i, out + i);
+}
+
+/* packus works on signed input, so values are clamped unsigned first */
+__attribute__((target("sse4.1"))) static void narrow16SSE41(const uint32_t *src, size_t n,
+                                                            uint16_t *dst) {
+  const __m128i max = _mm_set1_epi32(UINT16_MAX);
+  size_t i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m128i a = _mm_min_epu32(_mm_loadu_si128((const __m128i *)(src + i)), max);
+    __m128i b = _mm_min_epu32(_mm_loadu_si128((const __m128i *)(src + i + 4)), max);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi32(a, b));
+  }
+  narrow16Scalar(src + i, n - i, dst + i);
+}
+
+__attribute__((target("sse4.1"))) static void narrow8SSE41(const uint32_t *src, size_t n,
+                                                           uint8_t *dst) {
+  const __m128i max = _mm_set1_epi32(UINT8_MAX);
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_min_epu32(_mm_loadu_si128((const __m128i *)(src + i)), max);
+    __m128i b = _mm_min_epu32(_mm_loadu_si128((const __m128i *)(src + i + 4)), max);
+    __m128i c = _mm_min_epu32(_mm_loadu_si128((const __m128i *)(src + i + 8)), max);
+    __m128i d = _mm_min_epu32(_mm_loadu_si128((const __m128i *)(src + i + 12)), max);
+    __m128i ab = _mm_packus_epi32(a, b);
+    __m128i cd = _mm_packus_epi32(c, d);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(ab, cd));
+  }
+  narrow8Scalar(src + i, n - i, dst + i);
+}
+
+__attribute__((target("sse4.1"))) static void maskRowSSE41(uint32_t *data, const uint8_t *bad,
+                                                           size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    uint32_t flags;
+    memcpy(&flags, bad + i, sizeof(flags));
+    __m128i keep = _mm_cmpeq_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(flags)), zero);
+    __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+    _mm_storeu_si128((__m128i *)(data + i), _mm_and_si128(v, keep));
+  }
+  maskRowScalar(data + i, bad + i, n - i);
+}
+
+/* There is no unsigned conversion before AVX-512: the pixel is converted as
+ * two 16 bit halves, and results of 2^31 and up are brought into the signed
+ * range before truncating and have the top bit put back after */
+__attribute__((target("sse4.1"))) static void gainRowSSE41(uint32_t *data, const float *gain,
+                                                           size_t n) {
+  const __m128i low = _mm_set1_epi32(0xFFFF);
+  const __m128i topBit = _mm_set1_epi32((int)0x80000000);
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 scale = _mm_set1_ps(65536.0f);
+  const __m128 top = _mm_set1_ps(2147483648.0f);
+  const __m128 max = _mm_set1_ps(4294967040.0f);
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+    __m128 f = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(v, 16)), scale),
+                          _mm_cvtepi32_ps(_mm_and_si128(v, low)));
+    f = _mm_add_ps(_mm_mul_ps(f, _mm_loadu_ps(gain + i)), half);
+    f = _mm_max_ps(_mm_min_ps(f, max), _mm_setzero_ps());
+    __m128 saturated = _mm_cmpge_ps(f, max);
+    __m128 big = _mm_cmpge_ps(f, top);
+    f = _mm_sub_ps(f, _mm_and_ps(big, top));
+    __m128i r = _mm_xor_si128(_mm_cvttps_epi32(f), _mm_and_si128(_mm_castps_si128(big), topBit));
+    r = _mm_or_si128(r, _mm_castps_si128(saturated));
+    _mm_storeu_si128((__m128i *)(data + i), r);
+  }
+  gainRowScalar(data + i, gain + i, n - i);
+}
+
+/* The sum is kept in 64 bit lanes. The zero and saturated masks are -1 per
+ * hit, so subtracting them counts the hits in each 32 bit lane. */
+__attribute__((target("sse4.1"))) static void statsRowSSE41(const uint32_t *src, size_t n,
+                                                            uint32_t saturation,
+                                                            pimegaFrameStats *stats) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i sat = _mm_set1_epi32(saturation);
+  __m128i sum = zero, minv = _mm_set1_epi32(-1), maxv = zero, zeros = zero, sats = zero;
+  uint64_t lanes64[2];
+  uint32_t lanes[4];
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    sum = _mm_add_epi64(sum, _mm_cvtepu32_epi64(v));
+    sum = _mm_add_epi64(sum, _mm_cvtepu32_epi64(_mm_srli_si128(v, 8)));
+    minv = _mm_min_epu32(minv, v);
+    maxv = _mm_max_epu32(maxv, v);
+    zeros = _mm_sub_epi32(zeros, _mm_cmpeq_epi32(v, zero));
+    sats = _mm_sub_epi32(sats, _mm_cmpeq_epi32(_mm_max_epu32(v, sat), v));
+  }
+
+  _mm_storeu_si128((__m128i *)lanes64, sum);
+  stats->total += lanes64[0] + lanes64[1];
+  _mm_storeu_si128((__m128i *)lanes, minv);
+  for (int j = 0; j < 4; j++) stats->min = lanes[j] < stats->min ? lanes[j] : stats->min;
+  _mm_storeu_si128((__m128i *)lanes, maxv);
+  for (int j = 0; j < 4; j++) stats->max = lanes[j] > stats->max ? lanes[j] : stats->max;
+  _mm_storeu_si128((__m128i *)lanes, zeros);
+  for (int j = 0; j < 4; j++) stats->numZeros += lanes[j];
+  _mm_storeu_si128((__m128i *)lanes, sats);
+  for (int j = 0; j < 4; j++) stats->numSaturated += lanes[j];
+  stats->numPixels += i;
+  statsRowScalar(src + i, n - i, saturation, stats);
+}
+
+__attribute__((target("sse4.1"))) static void accumulateRowSSE41(uint64_t *acc,
+                                                                const uint32_t *src, size_t n) {
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i a = _mm_loadu_si128((const __m128i *)(acc + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(acc + i + 2));
+    _mm_storeu_si128((__m128i *)(acc + i), _mm_add_epi64(a, _mm_cvtepu32_epi64(v)));
+    _mm_storeu_si128((__m128i *)(acc + i + 2),
+                     _mm_add_epi64(b, _mm_cvtepu32_epi64(_mm_srli_si128(v, 8))));
+  }
+  accumulateRowScalar(acc + i, src + i, n - i);
+}
+
+/* The zero masks are -1 per zero pixel, so subtracting them counts the zeros
+ * in each lane */
+__attribute__((target("sse4.1"))) static size_t countNonZeroSSE41(const uint32_t *src, size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i zeros = zero;
+  uint32_t lanes[4];
+  size_t i = 0, count = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    zeros = _mm_sub_epi32(zeros, _mm_cmpeq_epi32(v, zero));
+  }
+  _mm_storeu_si128((__m128i *)lanes, zeros);
+  count = i;
+  for (int j = 0; j < 4; j++) count -= lanes[j];
+  return count + countNonZeroScalar(src + i, n - i);
+}
+
+/* Groups of pixels without counts are skipped with one compare, the others
+ * are walked through the bits of the non zero mask */
+__attribute__((target("sse4.1"))) static size_t sparseSSE41(const uint32_t *src, size_t n,
+                                                            uint32_t index, uint32_t *dst) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0, count = 0;
+
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    unsigned mask = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero))) & 0xF;
+    for (; mask; mask &= mask - 1) {
+      unsigned j = __builtin_ctz(mask);
+      dst[2 * count] = index + (uint32_t)(i + j);
+      dst[2 * count + 1] = src[i + j];
+      count++;
+    }
+  }
+  return count + sparseScalar(src + i, n - i, index + (uint32_t)i, dst + 2 * count);
+}
+
+/* 16 pixels at a time: compare with zero, pack the masks down to bytes and
+ * collect their sign bits */
+__attribute__((target("sse4.1"))) static void pack1SSE41(const uint32_t *src, size_t n,
+                                                         uint8_t *dst) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(src + i)), zero);
+    __m128i b = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(src + i + 4)), zero);
+    __m128i c = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(src + i + 8)), zero);
+    __m128i d = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(src + i + 12)), zero);
+    __m128i bytes = _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+    uint16_t bits = ~_mm_movemask_epi8(bytes);
+    memcpy(dst + i / 8, &bits, sizeof(bits));
+  }
+  pack1Scalar(src + i, n - i, dst + i / 8);
+}
+
+/* Each byte of the bitmap is spread over 8 bytes and tested against its bit */
+__attribute__((target("sse4.1"))) static void unpack1SSE41(const uint8_t *src, size_t n,
+                                                           uint8_t *dst) {
+  const __m128i spread = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1);
+  const __m128i select =
+      _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+  const __m128i one = _mm_set1_epi8(1);
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    uint16_t bits;
+    memcpy(&bits, src + i / 8, sizeof(bits));
+    __m128i v = _mm_shuffle_epi8(_mm_cvtsi32_si128(bits), spread);
+    v = _mm_cmpeq_epi8(_mm_and_si128(v, select), select);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_and_si128(v, one));
+  }
+  unpack1Scalar(src + i / 8, n - i, dst + i);
+}
+
+/* 16 pixels at a time: each pixel is moved to its bit offset with a multiply,
+ * two horizontal adds merge each group of 4 into a word (the fields do not
+ * overlap, so adding is the same as or-ing) and a shuffle keeps the low 3
+ * bytes of every word */
+__attribute__((target("sse4.1"))) static void pack6SSE41(const uint32_t *src, size_t n,
+                                                         uint8_t *dst) {
+  const __m128i max = _mm_set1_epi32(63);
+  const __m128i shift = _mm_setr_epi32(1, 1 << 6, 1 << 12, 1 << 18);
+  const __m128i bytes = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_mullo_epi32(_mm_min_epu32(_mm_loadu_si128((const __m128i *)(src + i)), max),
+                                shift);
+    __m128i b = _mm_mullo_epi32(
+        _mm_min_epu32(_mm_loadu_si128((const __m128i *)(src + i + 4)), max), shift);
+    __m128i c = _mm_mullo_epi32(
+        _mm_min_epu32(_mm_loadu_si128((const __m128i *)(src + i + 8)), max), shift);
+    __m128i d = _mm_mullo_epi32(
+        _mm_min_epu32(_mm_loadu_si128((const __m128i *)(src + i + 12)), max), shift);
+    __m128i words = _mm_hadd_epi32(_mm_hadd_epi32(a, b), _mm_hadd_epi32(c, d));
+    __m128i packed = _mm_shuffle_epi8(words, bytes);
+    uint32_t tail = _mm_extract_epi32(packed, 2);
+    _mm_storel_epi64((__m128i *)(dst + i / 4 * 3), packed);
+    memcpy(dst + i / 4 * 3 + 8, &tail, sizeof(tail));
+  }
+  pack6Scalar(src + i, n - i, dst + i / 4 * 3);
+}
+
+/* 4 pixels at a time: the 3 byte group is widened to a word, broadcast, and
+ * each pixel is shifted to the top of its lane and back down */
+__attribute__((target("sse4.1"))) static void unpack6SSE41(const uint8_t *src, size_t n,
+                                                           uint8_t *dst) {
+  const __m128i shift = _mm_setr_epi32(1 << 26, 1 << 20, 1 << 14, 1 << 8);
+  const __m128i bytes = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  size_t i = 0;
+
+  /* The 4 byte load reads one byte past the group, so the last group is left
+   * to the scalar code */
+  for (; i + 8 <= n; i += 4) {
+    uint32_t word;
+    memcpy(&word, src + i / 4 * 3, sizeof(word));
+    __m128i v = _mm_mullo_epi32(_mm_set1_epi32(word & 0xFFFFFF), shift);
+    v = _mm_shuffle_epi8(_mm_srli_epi32(v, 26), bytes);
+    uint32_t pixels = _mm_cvtsi128_si32(v);
+    memcpy(dst + i, &pixels, sizeof(pixels));
+  }
+  unpack6Scalar(src + i / 4 * 3, n - i, dst + i);
+}
+
+__attribute__((target("avx2"))) static void satAddRowAVX2(uint32_t *dst, const uint32_t *src,
+                                                          size_t n) {
+  const __m256i ones = _mm256_set1_epi32(-1);
+  size_t i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+    b = _mm256_min_epu32(b, _mm256_xor_si256(a, ones));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi32(a, b));
+  }
+  satAddRowScalar(dst + i, src + i, n - i);
+}
+
+/* shuffle_ps works per 128 bit lane, so the sums come out with the middle
+ * 64 bit halves swapped and the permute puts them back */
+__attribute__((target("avx2"))) static void pairSumAVX2(const uint32_t *in, size_t n,
+                                                        uint32_t *out) {
+  const __m256i ones = _mm256_set1_epi32(-1);
+  size_t i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m256 a = _mm256_loadu_ps((const float *)(in + 2 * i));
+    __m256 b = _mm256_loadu_ps((const float *)(in + 2 * i + 8));
+    __m256i even = _mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+    __m256i odd = _mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    odd = _mm256_min_epu32(odd, _mm256_xor_si256(even, ones));
+    __m256i sum = _mm256_add_epi32(even, odd);
+    _mm256_storeu_si256((__m256i *)(out + i),
+                        _mm256_permute4x64_epi64(sum, _MM_SHUFFLE(3, 1, 2, 0)));
+  }
+  pairSumScalar(in + 2 * i, n - i, out + i);
+}
+
+/* The AVX2 packs work per 128 bit lane, the permute puts the lanes back in
+ * order */
+__attribute__((target("avx2"))) static void narrow16AVX2(const uint32_t *src, size_t n,
+                                                         uint16_t *dst) {
+  const __m256i max = _mm256_set1_epi32(UINT16_MAX);
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m256i a = _mm256_min_epu32(_mm256_loadu_si256((const __m256i *)(src + i)), max);
+    __m256i b = _mm256_min_epu32(_mm256_loadu_si256((const __m256i *)(src + i + 8)), max);
+    __m256i ab = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xD8);
+    _mm256_storeu_si256((__m256i *)(dst + i), ab);
+  }
+  narrow16Scalar(src + i, n - i, dst + i);
+}
+
+__attribute__((target("avx2"))) static void narrow8AVX2(const uint32_t *src, size_t n,
+                                                        uint8_t *dst) {
+  const __m256i max = _mm256_set1_epi32(UINT8_MAX);
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  size_t i = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_min_epu32(_mm256_loadu_si256((const __m256i *)(src + i)), max);
+    __m256i b = _mm256_min_epu32(_mm256_loadu_si256((const __m256i *)(src + i + 8)), max);
+    __m256i c = _mm256_min_epu32(_mm256_loadu_si256((const __m256i *)(src + i + 16)), max);
+    __m256i d = _mm256_min_epu32(_mm256_loadu_si256((const __m256i *)(src + i + 24)), max);
+    __m256i abcd = _mm256_packus_epi16(_mm256_packus_epi32(a, b), _mm256_packus_epi32(c, d));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permutevar8x32_epi32(abcd, order));
+  }
+  narrow8Scalar(src + i, n - i, dst + i);
+}
+
+__attribute__((target("avx2"))) static void maskRowAVX2(uint32_t *data, const uint8_t *bad,
+                                                        size_t n) {
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m128i flags = _mm_loadl_epi64((const __m128i *)(bad + i));
+    __m256i keep = _mm256_cmpeq_epi32(_mm256_cvtepu8_epi32(flags), zero);
+    __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+    _mm256_storeu_si256((__m256i *)(data + i), _mm256_and_si256(v, keep));
+  }
+  maskRowScalar(data + i, bad + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void gainRowAVX2(uint32_t *data, const float *gain,
+                                                        size_t n) {
+  const __m256i low = _mm256_set1_epi32(0xFFFF);
+  const __m256i topBit = _mm256_set1_epi32((int)0x80000000);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 scale = _mm256_set1_ps(65536.0f);
+  const __m256 top = _mm256_set1_ps(2147483648.0f);
+  const __m256 max = _mm256_set1_ps(4294967040.0f);
+  size_t i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+    __m256 f = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(v, 16)), scale),
+                             _mm256_cvtepi32_ps(_mm256_and_si256(v, low)));
+    f = _mm256_add_ps(_mm256_mul_ps(f, _mm256_loadu_ps(gain + i)), half);
+    f = _mm256_max_ps(_mm256_min_ps(f, max), _mm256_setzero_ps());
+    __m256 saturated = _mm256_cmp_ps(f, max, _CMP_GE_OQ);
+    __m256 big = _mm256_cmp_ps(f, top, _CMP_GE_OQ);
+    f = _mm256_sub_ps(f, _mm256_and_ps(big, top));
+    __m256i r = _mm256_xor_si256(_mm256_cvttps_epi32(f),
+                                 _mm256_and_si256(_mm256_castps_si256(big), topBit));
+    r = _mm256_or_si256(r, _mm256_castps_si256(saturated));
+    _mm256_storeu_si256((__m256i *)(data + i), r);
+  }
+  gainRowScalar(data + i, gain + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void statsRowAVX2(const uint32_t *src, size_t n,
+                                                         uint32_t saturation,
+                                                         pimegaFrameStats *stats) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i sat = _mm256_set1_epi32(saturation);
+  __m256i sum = zero, minv = _mm256_set1_epi32(-1), maxv = zero, zeros = zero, sats = zero;
+  uint64_t lanes64[4];
+  uint32_t lanes[8];
+  size_t i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(v)));
+    sum = _mm256_add_epi64(sum, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(v, 1)));
+    minv = _mm256_min_epu32(minv, v);
+    maxv = _mm256_max_epu32(maxv, v);
+    zeros = _mm256_sub_epi32(zeros, _mm256_cmpeq_epi32(v, zero));
+    sats = _mm256_sub_epi32(sats, _mm256_cmpeq_epi32(_mm256_max_epu32(v, sat), v));
+  }
+
+  _mm256_storeu_si256((__m256i *)lanes64, sum);
+  stats->total += lanes64[0] + lanes64[1] + lanes64[2] + lanes64[3];
+  _mm256_storeu_si256((__m256i *)lanes, minv);
+  for (int j = 0; j < 8; j++) stats->min = lanes[j] < stats->min ? lanes[j] : stats->min;
+  _mm256_storeu_si256((__m256i *)lanes, maxv);
+  for (int j = 0; j < 8; j++) stats->max = lanes[j] > stats->max ? lanes[j] : stats->max;
+  _mm256_storeu_si256((__m256i *)lanes, zeros);
+  for (int j = 0; j < 8; j++) stats->numZeros += lanes[j];
+  _mm256_storeu_si256((__m256i *)lanes, sats);
+  for (int j = 0; j < 8; j++) stats->numSaturated += lanes[j];
+  stats->numPixels += i;
+  statsRowScalar(src + i, n - i, saturation, stats);
+}
+
+__attribute__((target("avx2"))) static void accumulateRowAVX2(uint64_t *acc, const uint32_t *src,
+                                                              size_t n) {
+  size_t i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i a = _mm256_loadu_si256((const __m256i *)(acc + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(acc + i + 4));
+    a = _mm256_add_epi64(a, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(v)));
+    b = _mm256_add_epi64(b, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(v, 1)));
+    _mm256_storeu_si256((__m256i *)(acc + i), a);
+    _mm256_storeu_si256((__m256i *)(acc + i + 4), b);
+  }
+  accumulateRowScalar(acc + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static size_t countNonZeroAVX2(const uint32_t *src, size_t n) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i zeros = zero;
+  uint32_t lanes[8];
+  size_t i = 0, count = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    zeros = _mm256_sub_epi32(zeros, _mm256_cmpeq_epi32(v, zero));
+  }
+  _mm256_storeu_si256((__m256i *)lanes, zeros);
+  count = i;
+  for (int j = 0; j < 8; j++) count -= lanes[j];
+  return count + countNonZeroScalar(src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static size_t sparseAVX2(const uint32_t *src, size_t n,
+                                                         uint32_t index, uint32_t *dst) {
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = 0, count = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    unsigned mask = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero))) & 0xFF;
+    for (; mask; mask &= mask - 1) {
+      unsigned j = __builtin_ctz(mask);
+      dst[2 * count] = index + (uint32_t)(i + j);
+      dst[2 * count + 1] = src[i + j];
+      count++;
+    }
+  }
+  return count + sparseScalar(src + i, n - i, index + (uint32_t)i, dst + 2 * count);
+}
+
+__attribute__((target("avx2"))) static void pack1AVX2(const uint32_t *src, size_t n,
+                                                      uint8_t *dst) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  size_t i = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i a = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(src + i)), zero);
+    __m256i b = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(src + i + 8)), zero);
+    __m256i c = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(src + i + 16)), zero);
+    __m256i d = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(src + i + 24)), zero);
+    __m256i bytes = _mm256_packs_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+    uint32_t bits = ~_mm256_movemask_epi8(_mm256_permutevar8x32_epi32(bytes, order));
+    memcpy(dst + i / 8, &bits, sizeof(bits));
+  }
+  pack1Scalar(src + i, n - i, dst + i / 8);
+}
+
+__attribute__((target("avx2"))) static void unpack1AVX2(const uint8_t *src, size_t n,
+                                                        uint8_t *dst) {
+  const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2,
+                                          2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+  const __m256i select = _mm256_set1_epi64x(0x8040201008040201LL);
+  const __m256i one = _mm256_set1_epi8(1);
+  size_t i = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    uint32_t bits;
+    memcpy(&bits, src + i / 8, sizeof(bits));
+    /* vpshufb does not cross lanes, so each lane gets its own copy */
+    __m256i v = _mm256_shuffle_epi8(_mm256_set1_epi32(bits), spread);
+    v = _mm256_cmpeq_epi8(_mm256_and_si256(v, select), select);
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_and_si256(v, one));
+  }
+  unpack1Scalar(src + i / 8, n - i, dst + i);
+}
+#endif
+
+struct frameKernels {
+  const char *isa;
+  satAddRowFunc satAddRow;
+  pairSumFunc pairSum;
+  narrow16Func narrow16;
+  narrow8Func narrow8;
+  packFunc pack1;
+  unpackFunc unpack1;
+  packFunc pack6;
+  unpackFunc unpack6;
+  statsRowFunc statsRow;
+  maskRowFunc maskRow;
+  gainRowFunc gainRow;
+  countNonZeroFunc countNonZero;
+  sparseFunc sparse;
+  accumulateRowFunc accumulateRow;
+};
+
+static frameKernels selectKernels(void) {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    frameKernels avx2 = {"avx2",    satAddRowAVX2, pairSumAVX2, narrow16AVX2, narrow8AVX2,
+                         pack1AVX2, unpack1AVX2,   pack6SSE41,   unpack6SSE41,
+                         statsRowAVX2,  maskRowAVX2,  gainRowAVX2,
+                         countNonZeroAVX2, sparseAVX2, accumulateRowAVX2};
+    return avx2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    frameKernels sse41 = {"sse4.1",   satAddRowSSE41, pairSumSSE41, narrow16SSE41, narrow8SSE41,
+                          pack1SSE41, unpack1SSE41,   pack6SSE41,    unpack6SSE41,
+                          statsRowSSE41,  maskRowSSE41,  gainRowSSE41,
+                          countNonZeroSSE41, sparseSSE41, accumulateRowSSE41};
+    return sse41;
+  }
+#endif
+  frameKernels scalar = {"scalar",    satAddRowScalar, pairSumScalar, narrow16Scalar, narrow8Scalar,
+                         pack1Scalar, unpack1Scalar,   pack6Scalar,    unpack6Scalar,
+                         statsRowScalar,  maskRowScalar,  gainRowScalar,
+                         countNonZeroScalar, sparseScalar, accumulateRowScalar};
+  return scalar;
+}
+
+static const frameKernels kernels = selectKernels();
+
+const char *pimegaFrameOpsISA(void) { return kernels.isa; }
+
+/* Rows are first summed vertically into acc, which walks memory linearly,
+ * then each run of binX columns is reduced. Power of two binX up to 8 is
+ * reduced by halving the row with the SIMD pair sums, in place in acc; other
+ * binX go column by column. */
+void pimegaBinFrame(const uint32_t *src, size_t srcStride, size_t width, size_t height, int binX,
+                    int binY, uint32_t *dst) {
+  size_t outWidth = width / binX;
+  size_t outHeight = height / binY;
+  bool pairs = binX == 2 || binX == 4 || binX == 8;
+  std::vector<uint32_t> acc(binY > 1 || pairs ? width : 0);
+  const uint32_t *row;
+
+  for (size_t y = 0; y < outHeight; y++) {
+    const uint32_t *in = src + y * binY * srcStride;
+    if (binY > 1) {
+      memcpy(acc.data(), in, width * sizeof(uint32_t));
+      for (int j = 1; j < binY; j++) kernels.satAddRow(acc.data(), in + j * srcStride, width);
+      row = acc.data();
+    } else {
+      row = in;
+    }
+
+    uint32_t *out = dst + y * outWidth;
+    if (binX == 1) {
+      memcpy(out, row, outWidth * sizeof(uint32_t));
+      continue;
+    }
+    if (pairs) {
+      size_t n = outWidth * binX / 2;
+      for (int step = binX; step > 2; step /= 2) {
+        kernels.pairSum(row, n, acc.data());
+        row = acc.data();
+        n /= 2;
+      }
+      kernels.pairSum(row, n, out);
+      continue;
+    }
+    for (size_t x = 0; x < outWidth; x++) {
+      const uint32_t *block = row + x * binX;
+      uint32_t sum = block[0];
+      for (int i = 1; i < binX; i++) sum = satAdd(sum, block[i]);
+      out[x] = sum;
+    }
+  }
+}
+
+void pimegaNarrowFrame16(const uint32_t *src, size_t n, uint16_t *dst) {
+  kernels.narrow16(src, n, dst);
+}
+
+void pimegaNarrowFrame8(const uint32_t *src, size_t n, uint8_t *dst) {
+  kernels.narrow8(src, n, dst);
+}
+
+size_t pimegaPackedSize(int bits, size_t n) { return (n * bits + 7) / 8; }
+
+void pimegaPackFrame1(const uint32_t *src, size_t n, uint8_t *dst) { kernels.pack1(src, n, dst); }
+
+void pimegaPackFrame6(const uint32_t *src, size_t n, uint8_t *dst) { kernels.pack6(src, n, dst); }
+
+void pimegaUnpackFrame1(const uint8_t *src, size_t n, uint8_t *dst) {
+  kernels.unpack1(src, n, dst);
+}
+
+void pimegaUnpackFrame6(const uint8_t *src, size_t n, uint8_t *dst) {
+  kernels.unpack6(src, n, dst);
+}
+
+void pimegaFrameStatsInit(pimegaFrameStats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  stats->min = UINT32_MAX;
+}
+
+void pimegaFrameStatsMerge(pimegaFrameStats *dst, const pimegaFrameStats *src) {
+  dst->total += src->total;
+  if (src->min < dst->min) dst->min = src->min;
+  if (src->max > dst->max) dst->max = src->max;
+  dst->numSaturated += src->numSaturated;
+  dst->numZeros += src->numZeros;
+  dst->numPixels += src->numPixels;
+}
+
+void pimegaFrameStatsAdd(const uint32_t *src, size_t srcStride, size_t width, size_t height,
+                         uint32_t saturation, pimegaFrameStats *stats) {
+  for (size_t y = 0; y < height; y++)
+    kernels.statsRow(src + y * srcStride, width, saturation, stats);
+}
+
+void pimegaMaskFrame(uint32_t *data, size_t stride, const uint8_t *bad, size_t width,
+                     size_t height) {
+  for (size_t y = 0; y < height; y++) kernels.maskRow(data + y * stride, bad + y * stride, width);
+}
+
+void pimegaGainFrame(uint32_t *data, size_t stride, const float *gain, size_t width,
+                     size_t height) {
+  for (size_t y = 0; y < height; y++) kernels.gainRow(data + y * stride, gain + y * stride, width);
+}
+
+size_t pimegaCountNonZero(const uint32_t *src, size_t n) { return kernels.countNonZero(src, n); }
+
+size_t pimegaSparseFrame(const uint32_t *src, size_t n, uint32_t index, uint32_t *dst) {
+  return kernels.sparse(src, n, index, dst);
+}
+
+void pimegaAccumulateFrame(uint64_t *acc, const uint32_t *src, size_t n) {
+  kernels.accumulateRow(acc, src, n);
+}
+
+/* Runs once every N frames, so it is left to the compiler */
+void pimegaFinishAccumulation(uint64_t *acc, size_t n, uint32_t divisor, uint32_t *dst) {
+  uint64_t half;
+
+  if (divisor < 1) divisor = 1;
+  half = divisor / 2;
+  for (size_t i = 0; i < n; i++) {
+    uint64_t value = (acc[i] + half) / divisor;
+    dst[i] = value < UINT32_MAX ? (uint32_t)value : UINT32_MAX;
+    acc[i] = 0;
+  }
+}
@@ -0,0 +1,83 @@
+/*
+ * pimegaFrameOps.h
+ *
+ * Pixel kernels applied to visualizer frames before they are sent to the
+ * plugins. The kernels pick an AVX2, SSE4.1 or scalar implementation at
+ * load time.
+ */
+
+#ifndef PIMEGA_FRAME_OPS_H
+#define PIMEGA_FRAME_OPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Name of the instruction set used by the kernels */
+const char *pimegaFrameOpsISA(void);
+
+/* Sums each binX x binY block of the width x height image at src into one
+ * pixel of dst, saturating at UINT32_MAX. srcStride is the number of pixels
+ * between two src rows. dst is (width / binX) x (height / binY) pixels; the
+ * columns and rows that do not fill a whole block are left out. */
+void pimegaBinFrame(const uint32_t *src, size_t srcStride, size_t width, size_t height, int binX,
+                    int binY, uint32_t *dst);
+
+/* Copy n pixels into a narrower type, clamping to the largest value the
+ * type holds */
+void pimegaNarrowFrame16(const uint32_t *src, size_t n, uint16_t *dst);
+void pimegaNarrowFrame8(const uint32_t *src, size_t n, uint8_t *dst);
+
+/* Pixel corrections, applied in place on the width x height image at data.
+ * The maps have the same stride as the image. pimegaMaskFrame zeros the
+ * pixels whose bad entry is not 0. pimegaGainFrame multiplies every pixel by
+ * its gain, rounding and clamping to the uint32 range. */
+void pimegaMaskFrame(uint32_t *data, size_t stride, const uint8_t *bad, size_t width,
+                     size_t height);
+void pimegaGainFrame(uint32_t *data, size_t stride, const float *gain, size_t width,
+                     size_t height);
+
+/* Statistics of the pixels of a frame */
+typedef struct pimegaFrameStats {
+  uint64_t total;
+  uint32_t min;
+  uint32_t max;
+  uint64_t numSaturated;
+  uint64_t numZeros;
+  uint64_t numPixels;
+} pimegaFrameStats;
+
+void pimegaFrameStatsInit(pimegaFrameStats *stats);
+void pimegaFrameStatsMerge(pimegaFrameStats *dst, const pimegaFrameStats *src);
+/* Adds the pixels of the width x height image at src to stats in one pass.
+ * Pixels at or above saturation are counted as saturated. */
+void pimegaFrameStatsAdd(const uint32_t *src, size_t srcStride, size_t width, size_t height,
+                         uint32_t saturation, pimegaFrameStats *stats);
+
+/* Frame accumulation. pimegaAccumulateFrame adds n pixels to 64 bit sums.
+ * pimegaFinishAccumulation writes the sums divided by divisor, rounded and
+ * clamped to UINT32_MAX, to dst and clears them for the next frames. */
+void pimegaAccumulateFrame(uint64_t *acc, const uint32_t *src, size_t n);
+void pimegaFinishAccumulation(uint64_t *acc, size_t n, uint32_t divisor, uint32_t *dst);
+
+/* Sparse frames list the pixels with counts as (index, count) pairs of
+ * uint32, the index being the position of the pixel in the frame row by row.
+ * pimegaSparseFrame writes the pairs of the n pixels at src, numbered from
+ * index on, to dst and returns how many there are. */
+size_t pimegaCountNonZero(const uint32_t *src, size_t n);
+size_t pimegaSparseFrame(const uint32_t *src, size_t n, uint32_t index, uint32_t *dst);
+
+/* Packed frames. With 1 bit, pixel i is bit (i % 8) of byte i / 8 and any
+ * non zero count packs to 1. With 6 bits, each group of 4 pixels is stored in
+ * 3 bytes as the little endian word p0 | p1 << 6 | p2 << 12 | p3 << 18 and
+ * counts are clamped to 63. */
+#define PIMEGA_PACKED_CODEC_1BIT "pimega_bitmap"
+#define PIMEGA_PACKED_CODEC_6BIT "pimega_pack6"
+
+/* Number of bytes taken by n pixels packed with bits per pixel */
+size_t pimegaPackedSize(int bits, size_t n);
+void pimegaPackFrame1(const uint32_t *src, size_t n, uint8_t *dst);
+void pimegaPackFrame6(const uint32_t *src, size_t n, uint8_t *dst);
+void pimegaUnpackFrame1(const uint8_t *src, size_t n, uint8_t *dst);
+void pimegaUnpackFrame6(const uint8_t *src, size_t n, uint8_t *dst);
+
+#endif
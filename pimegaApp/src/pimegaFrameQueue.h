@@ -0,0 +1,81 @@
+/*
+ * pimegaFrameQueue.h
+ *
+ * Bounded single producer / single consumer queue of NDArray pointers used
+ * between the frame receive thread and the dispatch thread.
+ */
+
+#ifndef PIMEGA_FRAME_QUEUE_H
+#define PIMEGA_FRAME_QUEUE_H
+
+#include <atomic>
+#include <vector>
+
+#include "ADDriver.h"
+
+typedef enum pimega_frame_queue_policy_t {
+  /* Full queue: the oldest queued frame is released to make room */
+  PIMEGA_FRAME_QUEUE_DROP_OLDEST = 0,
+  /* Full queue: the incoming frame is released */
+  PIMEGA_FRAME_QUEUE_DROP_NEWEST = 1,
+  /* Full queue: the receive thread waits for the dispatch thread */
+  PIMEGA_FRAME_QUEUE_BLOCK = 2
+} pimega_frame_queue_policy_t;
+
+#define DEFAULT_FRAME_QUEUE_SIZE 16
+
+/* Only the producer moves tail_. head_ is moved with a CAS because besides the
+ * consumer the producer also pops when it drops the oldest frame, and may then
+ * write the slot a consumer is reading; the slots are atomic for that. The
+ * slot count is a power of two, the queue holds capacity frames. */
+class pimegaFrameQueue {
+ public:
+  explicit pimegaFrameQueue(size_t capacity)
+      : capacity_(capacity > 0 ? capacity : 1),
+        slots_(slotCount(capacity_)),
+        mask_(slots_.size() - 1),
+        head_(0),
+        tail_(0) {}
+
+  size_t capacity(void) const { return capacity_; }
+
+  size_t size(void) const {
+    return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+  }
+
+  /** Producer only. Returns false if the queue is full. */
+  bool push(NDArray *pArray) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) >= capacity_) return false;
+    slots_[tail & mask_].store(pArray, std::memory_order_relaxed);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /** Returns NULL if the queue is empty. */
+  NDArray *pop(void) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    while (head != tail_.load(std::memory_order_acquire)) {
+      NDArray *pArray = slots_[head & mask_].load(std::memory_order_relaxed);
+      if (head_.compare_exchange_weak(head, head + 1, std::memory_order_acq_rel,
+                                      std::memory_order_relaxed))
+        return pArray;
+    }
+    return NULL;
+  }
+
+ private:
+  static size_t slotCount(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    return size;
+  }
+
+  size_t capacity_;
+  std::vector<std::atomic<NDArray *> > slots_;
+  size_t mask_;
+  std::atomic<size_t> head_;
+  std::atomic<size_t> tail_;
+};
+
+#endif
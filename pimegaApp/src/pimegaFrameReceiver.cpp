@@ -0,0 +1,312 @@
+/* pimegaFrameReceiver.cpp
+ *
+ * Visualizer frame receiver. The backend publishes each frame as a two part
+ * ZMQ message: the topic followed by the raw frame.
+ *
+ * Depending on the transport the frame ends up either in the ZMQ message
+ * memory itself (zero-copy) or in a ring of NDArrays that is allocated and
+ * touched once at start, so nothing is allocated while a run is going.
+ *
+ * The shared memory transport skips ZMQ altogether: the backend writes the
+ * frames into a ring in a segment the receiver created, and the receiver
+ * copies each one into a pool NDArray.
+ */
+
+#include "pimegaFrameReceiver.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <zmq.h>
+
+#include "pimegaThreadPlacement.h"
+
+static const char *receiverName = "pimegaFrameReceiver";
+
+/* Receive timeout, so the thread notices stop() */
+#define RECEIVE_TIMEOUT_MS 100
+
+static void receiveTaskC(void *drvPvt) {
+  pimegaFrameReceiver *pPvt = (pimegaFrameReceiver *)drvPvt;
+  pPvt->receiveTask();
+}
+
+static void releaseZmqMessage(void * /* pData */, void *releasePvt) {
+  zmq_msg_t *msg = (zmq_msg_t *)releasePvt;
+  zmq_msg_close(msg);
+  delete msg;
+}
+
+pimegaFrameReceiver::pimegaFrameReceiver(const char *address, const std::string &topic,
+                                         int transport, int sizeX, int sizeY,
+                                         NDDataType_t dataType, size_t frameSize,
+                                         pimegaNDArrayPool *pool, FrameCallback callback)
+    : address_(address),
+      topic_(topic),
+      transport_(transport),
+      dataType_(dataType),
+      frameSize_(frameSize),
+      pool_(pool),
+      callback_(callback),
+      timing_(NULL),
+      context_(NULL),
+      socket_(NULL),
+      running_(false),
+      numReceived_(0),
+      numErrors_(0),
+      ringNext_(0),
+      numRingFull_(0),
+      shmemWritten_(0),
+      shmemRead_(0),
+      numOverruns_(0) {
+  dims_[0] = sizeX;
+  dims_[1] = sizeY;
+  exitedEventId_ = epicsEventMustCreate(epicsEventEmpty);
+}
+
+pimegaFrameReceiver::~pimegaFrameReceiver() {
+  stop();
+  freeRing();
+  epicsEventDestroy(exitedEventId_);
+}
+
+/** Allocates the NDArrays used by PIMEGA_FRAME_TRANSPORT_RING. The buffers are
+ * written once here so their pages are already mapped when frames arrive. */
+int pimegaFrameReceiver::allocRing(int numBuffers) {
+  NDArray *pArray;
+
+  freeRing();
+  for (int i = 0; i < numBuffers; i++) {
+    pArray = pool_->allocFrame(2, dims_, dataType_, frameSize_);
+    if (!pArray) {
+      printf("%s: unable to allocate ring buffer %d of %d\n", receiverName, i + 1, numBuffers);
+      freeRing();
+      return -1;
+    }
+    memset(pArray->pData, 0, pArray->dataSize);
+    ring_.push_back(pArray);
+  }
+  ringNext_ = 0;
+  return 0;
+}
+
+/** Creates the shared memory segment used by PIMEGA_FRAME_TRANSPORT_SHMEM.
+ * The backend opens it by name once it is there. */
+int pimegaFrameReceiver::createShmem(int numSlots) {
+  shmemWritten_ = shmemRead_ = 0;
+  return shmem_.create(address_.c_str(), frameSize_, numSlots);
+}
+
+void pimegaFrameReceiver::freeRing(void) {
+  for (size_t i = 0; i < ring_.size(); i++) ring_[i]->release();
+  ring_.clear();
+}
+
+int pimegaFrameReceiver::connectSocket(void) {
+  int timeout = RECEIVE_TIMEOUT_MS;
+
+  context_ = zmq_ctx_new();
+  socket_ = zmq_socket(context_, ZMQ_SUB);
+  if (!socket_) {
+    printf("%s: zmq_socket failed: %s\n", receiverName, zmq_strerror(zmq_errno()));
+    return -1;
+  }
+  zmq_setsockopt(socket_, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+  zmq_setsockopt(socket_, ZMQ_SUBSCRIBE, topic_.c_str(), topic_.size());
+  if (zmq_connect(socket_, address_.c_str()) != 0) {
+    printf("%s: unable to connect to %s: %s\n", receiverName, address_.c_str(),
+           zmq_strerror(zmq_errno()));
+    return -1;
+  }
+  return 0;
+}
+
+int pimegaFrameReceiver::start(void) {
+  if (transport_ != PIMEGA_FRAME_TRANSPORT_SHMEM && connectSocket() != 0) return -1;
+
+  running_ = true;
+  if (epicsThreadCreate("pimegaFrameRx", epicsThreadPriorityHigh,
+                        epicsThreadGetStackSize(epicsThreadStackMedium),
+                        (EPICSTHREADFUNC)receiveTaskC, this) == NULL) {
+    running_ = false;
+    printf("%s: epicsThreadCreate failure for receive task\n", receiverName);
+    return -1;
+  }
+  return 0;
+}
+
+void pimegaFrameReceiver::stop(void) {
+  if (running_) {
+    running_ = false;
+    epicsEventWait(exitedEventId_);
+  }
+  if (socket_) zmq_close(socket_);
+  if (context_) zmq_ctx_term(context_);
+  socket_ = context_ = NULL;
+}
+
+void pimegaFrameReceiver::receiveTask(void) {
+  NDArray *pArray;
+  double arrival;
+
+  pimegaApplyPlacement(PIMEGA_THREAD_RECEIVE);
+  while (running_) {
+    if (transport_ == PIMEGA_FRAME_TRANSPORT_SHMEM) {
+      if (!waitShmem()) continue;
+    } else if (!receiveTopic()) {
+      continue;
+    }
+
+    arrival = pimegaArrivalTime();
+    if (transport_ == PIMEGA_FRAME_TRANSPORT_RING)
+      pArray = receiveIntoRing();
+    else if (transport_ == PIMEGA_FRAME_TRANSPORT_SHMEM)
+      pArray = receiveFromShmem();
+    else
+      pArray = receiveZeroCopy();
+    if (!pArray) continue;
+    pArray->timeStamp = arrival;
+    numReceived_++;
+    callback_(pArray);
+  }
+  pimegaLeavePlacement();
+  epicsEventSignal(exitedEventId_);
+}
+
+/** Waits for the topic part of the next message. Returns false on timeout or
+ * when the message has no frame attached. */
+bool pimegaFrameReceiver::receiveTopic(void) {
+  char topic[256];
+  int more = 0;
+  size_t moreSize = sizeof(more);
+
+  if (zmq_recv(socket_, topic, sizeof(topic), 0) < 0) return false;
+  zmq_getsockopt(socket_, ZMQ_RCVMORE, &more, &moreSize);
+  if (!more) {
+    numErrors_++;
+    return false;
+  }
+  return true;
+}
+
+/** Receives the frame part into a heap allocated zmq_msg_t and wraps its
+ * memory in an NDArray. The message is closed by releaseZmqMessage once the
+ * last plugin releases the NDArray. */
+NDArray *pimegaFrameReceiver::receiveZeroCopy(void) {
+  NDArray *pArray;
+  zmq_msg_t *msg = new zmq_msg_t;
+  uint64_t start = pimegaTimeNs(), received;
+
+  zmq_msg_init(msg);
+  if (zmq_msg_recv(msg, socket_, 0) < 0) {
+    numErrors_++;
+    releaseZmqMessage(NULL, msg);
+    return NULL;
+  }
+  if (zmq_msg_size(msg) != frameSize_) {
+    printf("%s: unexpected frame size %lu, expected %lu\n", receiverName,
+           (unsigned long)zmq_msg_size(msg), (unsigned long)frameSize_);
+    numErrors_++;
+    releaseZmqMessage(NULL, msg);
+    return NULL;
+  }
+  received = pimegaTimeNs();
+
+  pArray = pool_->wrap(2, dims_, dataType_, zmq_msg_data(msg), frameSize_, releaseZmqMessage, msg);
+  if (!pArray) {
+    numErrors_++;
+    releaseZmqMessage(NULL, msg);
+    return NULL;
+  }
+  if (timing_) {
+    timing_[PIMEGA_STAGE_RECEIVE].add(received - start);
+    timing_[PIMEGA_STAGE_ALLOC].add(pimegaTimeNs() - received);
+  }
+  return pArray;
+}
+
+/** Receives the frame part straight into the next ring NDArray no plugin is
+ * holding. If every slot is still in use the frame is discarded. */
+NDArray *pimegaFrameReceiver::receiveIntoRing(void) {
+  NDArray *pArray = NULL;
+  char discard[1];
+  int size;
+  uint64_t start = pimegaTimeNs(), found;
+
+  for (size_t i = 0; i < ring_.size(); i++) {
+    NDArray *pSlot = ring_[(ringNext_ + i) % ring_.size()];
+    if (pSlot->getReferenceCount() == 1) {
+      pArray = pSlot;
+      ringNext_ = (ringNext_ + i + 1) % ring_.size();
+      break;
+    }
+  }
+  if (!pArray) {
+    zmq_recv(socket_, discard, sizeof(discard), 0);
+    numRingFull_++;
+    return NULL;
+  }
+  found = pimegaTimeNs();
+
+  /* Slots never go back through NDArrayPool::alloc, so what the frame path
+   * added to the previous frame in the slot is cleared here */
+  pArray->pAttributeList->clear();
+  pArray->codec.clear();
+  pArray->compressedSize = 0;
+
+  size = zmq_recv(socket_, pArray->pData, frameSize_, 0);
+  if (size < 0 || (size_t)size != frameSize_) {
+    if (size >= 0)
+      printf("%s: unexpected frame size %d, expected %lu\n", receiverName, size,
+             (unsigned long)frameSize_);
+    numErrors_++;
+    return NULL;
+  }
+
+  if (timing_) {
+    timing_[PIMEGA_STAGE_ALLOC].add(found - start);
+    timing_[PIMEGA_STAGE_RECEIVE].add(pimegaTimeNs() - found);
+  }
+
+  /* The reference handed to the callback comes back through release() */
+  pArray->reserve();
+  return pArray;
+}
+
+/** Waits for the backend to publish a frame not read yet. Returns false on
+ * timeout. */
+bool pimegaFrameReceiver::waitShmem(void) {
+  shmemWritten_ = shmem_.wait(shmemRead_, RECEIVE_TIMEOUT_MS);
+  return shmemWritten_ > shmemRead_;
+}
+
+/** Copies the oldest unread frame out of the shared memory ring. Frames the
+ * backend has already written over are skipped and counted as overruns. */
+NDArray *pimegaFrameReceiver::receiveFromShmem(void) {
+  NDArray *pArray;
+  uint64_t numSlots = shmem_.getNumSlots(), start, allocated;
+
+  if (shmemWritten_ - shmemRead_ > numSlots - 1) {
+    numOverruns_ += shmemWritten_ - shmemRead_ - (numSlots - 1);
+    shmemRead_ = shmemWritten_ - (numSlots - 1);
+  }
+  shmemRead_++;
+
+  start = pimegaTimeNs();
+  pArray = pool_->allocFrame(2, dims_, dataType_, frameSize_);
+  if (!pArray) {
+    numErrors_++;
+    return NULL;
+  }
+  allocated = pimegaTimeNs();
+  if (!shmem_.read(shmemRead_, pArray->pData)) {
+    numOverruns_++;
+    pArray->release();
+    return NULL;
+  }
+
+  if (timing_) {
+    timing_[PIMEGA_STAGE_ALLOC].add(allocated - start);
+    timing_[PIMEGA_STAGE_COPY].add(pimegaTimeNs() - allocated);
+  }
+  return pArray;
+}
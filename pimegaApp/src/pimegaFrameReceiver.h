@@ -0,0 +1,104 @@
+/*
+ * pimegaFrameReceiver.h
+ *
+ * Receives visualizer frames published by the backend and hands them to the
+ * driver as NDArrays.
+ */
+
+#ifndef PIMEGA_FRAME_RECEIVER_H
+#define PIMEGA_FRAME_RECEIVER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <epicsEvent.h>
+#include <epicsThread.h>
+
+#include "ADDriver.h"
+#include "pimegaFrameShmem.h"
+#include "pimegaFrameTiming.h"
+#include "pimegaNDArrayPool.h"
+
+typedef enum pimega_frame_transport_t {
+  /* Frames are received by ZmqMessageConsumer and copied into pool NDArrays */
+  PIMEGA_FRAME_TRANSPORT_COPY = 0,
+  /* The ZMQ message memory is handed to the NDArray directly */
+  PIMEGA_FRAME_TRANSPORT_ZERO_COPY = 1,
+  /* Frames are received straight into a ring of NDArrays allocated at start */
+  PIMEGA_FRAME_TRANSPORT_RING = 2,
+  /* Frames are copied out of a shared memory ring the backend writes to */
+  PIMEGA_FRAME_TRANSPORT_SHMEM = 3,
+  /* Every module is received on its own topic and assembled in the IOC, see
+   * pimegaModuleAssembler */
+  PIMEGA_FRAME_TRANSPORT_MODULES = 4
+} pimega_frame_transport_t;
+
+#define DEFAULT_FRAME_RING_SIZE 8
+
+class pimegaFrameReceiver {
+ public:
+  /* Called on the receive thread for every frame. The callee owns the
+   * reference to the NDArray. */
+  typedef std::function<void(NDArray *)> FrameCallback;
+
+  pimegaFrameReceiver(const char *address, const std::string &topic, int transport, int sizeX,
+                      int sizeY, NDDataType_t dataType, size_t frameSize, pimegaNDArrayPool *pool,
+                      FrameCallback callback);
+  ~pimegaFrameReceiver();
+
+  int allocRing(int numBuffers);
+  /* PIMEGA_FRAME_TRANSPORT_SHMEM: the address is the segment name */
+  int createShmem(int numSlots);
+  /* Array of PIMEGA_NUM_STAGES timings the receive stages are added to */
+  void setTiming(pimegaStageTiming *timing) { timing_ = timing; }
+  int start(void);
+  void stop(void);
+  uint64_t getNumReceived(void) { return numReceived_; }
+  uint64_t getNumErrors(void) { return numErrors_; }
+  uint64_t getNumRingFull(void) { return numRingFull_; }
+  uint64_t getNumOverruns(void) { return numOverruns_; }
+
+  void receiveTask(void);
+
+ private:
+  int connectSocket(void);
+  bool receiveTopic(void);
+  NDArray *receiveZeroCopy(void);
+  NDArray *receiveIntoRing(void);
+  bool waitShmem(void);
+  NDArray *receiveFromShmem(void);
+  void freeRing(void);
+
+  std::string address_;
+  std::string topic_;
+  int transport_;
+  size_t dims_[2];
+  NDDataType_t dataType_;
+  size_t frameSize_;
+  pimegaNDArrayPool *pool_;
+  FrameCallback callback_;
+  pimegaStageTiming *timing_;
+
+  void *context_;
+  void *socket_;
+  volatile bool running_;
+  epicsEventId exitedEventId_;
+  uint64_t numReceived_;
+  uint64_t numErrors_;
+
+  /* PIMEGA_FRAME_TRANSPORT_RING: each NDArray keeps one reference held by the
+   * ring, so a slot is free when its reference count is back to 1 */
+  std::vector<NDArray *> ring_;
+  size_t ringNext_;
+  uint64_t numRingFull_;
+
+  /* PIMEGA_FRAME_TRANSPORT_SHMEM: frames published and read so far, and the
+   * frames the backend wrote over before they were read */
+  pimegaShmemRing shmem_;
+  uint64_t shmemWritten_;
+  uint64_t shmemRead_;
+  uint64_t numOverruns_;
+};
+
+#endif
@@ -0,0 +1,167 @@
+/* pimegaFrameShmem.cpp
+ *
+ * Shared memory frame ring. Each slot has a sequence number the producer
+ * makes odd before writing the frame and even after, so the consumer can
+ * tell a frame was overwritten while it was being copied and drop it instead
+ * of holding up the producer.
+ */
+
+#include "pimegaFrameShmem.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *shmemName = "pimegaShmemRing";
+
+/* Slots start on a cache line, and the frames right after the slot header */
+#define SHMEM_ALIGN 64
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) &&
+                  sizeof(std::atomic<uint64_t>) == sizeof(uint64_t),
+              "the shared atomics must have the layout of the plain integers");
+
+static size_t alignUp(size_t size) { return (size + SHMEM_ALIGN - 1) / SHMEM_ALIGN * SHMEM_ALIGN; }
+
+/* The futex is shared between processes, so not FUTEX_PRIVATE */
+static void futexWait(std::atomic<uint32_t> *word, uint32_t value, int timeoutMs) {
+  struct timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+  syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static void futexWake(std::atomic<uint32_t> *word) {
+  syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, 1 << 30, NULL, NULL, 0);
+}
+
+pimegaShmemRing::pimegaShmemRing() : header_(NULL), mapSize_(0), owner_(false) {
+  name_[0] = '\0';
+}
+
+pimegaShmemRing::~pimegaShmemRing() { close(); }
+
+int pimegaShmemRing::create(const char *name, size_t frameSize, int numSlots) {
+  size_t slotSize = alignUp(sizeof(pimegaShmemSlot)) + alignUp(frameSize);
+  size_t mapSize = alignUp(sizeof(pimegaShmemHeader)) + numSlots * slotSize;
+  void *p;
+  int fd;
+
+  close();
+  shm_unlink(name);
+  fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0660);
+  if (fd < 0) {
+    printf("%s: unable to create %s: %s\n", shmemName, name, strerror(errno));
+    return -1;
+  }
+  if (ftruncate(fd, mapSize) != 0) {
+    printf("%s: unable to size %s: %s\n", shmemName, name, strerror(errno));
+    ::close(fd);
+    shm_unlink(name);
+    return -1;
+  }
+  p = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    printf("%s: unable to map %s: %s\n", shmemName, name, strerror(errno));
+    shm_unlink(name);
+    return -1;
+  }
+
+  header_ = (pimegaShmemHeader *)p;
+  header_->version = PIMEGA_SHMEM_VERSION;
+  header_->frameSize = frameSize;
+  header_->slotSize = slotSize;
+  header_->numSlots = numSlots;
+  header_->notify.store(0);
+  header_->written.store(0);
+  for (int i = 0; i < numSlots; i++) slot(i + 1)->seq.store(0);
+  /* The producer checks the magic last */
+  std::atomic_thread_fence(std::memory_order_release);
+  header_->magic = PIMEGA_SHMEM_MAGIC;
+
+  mapSize_ = mapSize;
+  snprintf(name_, sizeof(name_), "%s", name);
+  owner_ = true;
+  return 0;
+}
+
+int pimegaShmemRing::open(const char *name) {
+  struct stat st;
+  void *p;
+  int fd;
+
+  close();
+  fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(pimegaShmemHeader)) {
+    ::close(fd);
+    return -1;
+  }
+  p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) return -1;
+
+  header_ = (pimegaShmemHeader *)p;
+  mapSize_ = st.st_size;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (header_->magic != PIMEGA_SHMEM_MAGIC || header_->version != PIMEGA_SHMEM_VERSION ||
+      alignUp(sizeof(pimegaShmemHeader)) + header_->numSlots * header_->slotSize > mapSize_) {
+    printf("%s: %s is not a frame ring\n", shmemName, name);
+    close();
+    return -1;
+  }
+  snprintf(name_, sizeof(name_), "%s", name);
+  owner_ = false;
+  return 0;
+}
+
+void pimegaShmemRing::close(void) {
+  if (header_) munmap(header_, mapSize_);
+  if (owner_) shm_unlink(name_);
+  header_ = NULL;
+  mapSize_ = 0;
+  owner_ = false;
+}
+
+pimegaShmemSlot *pimegaShmemRing::slot(uint64_t n) {
+  char *base = (char *)header_ + alignUp(sizeof(pimegaShmemHeader));
+  return (pimegaShmemSlot *)(base + (n - 1) % header_->numSlots * header_->slotSize);
+}
+
+void pimegaShmemRing::publish(const void *frame) {
+  uint64_t n = header_->written.load(std::memory_order_relaxed) + 1;
+  pimegaShmemSlot *pSlot = slot(n);
+
+  pSlot->seq.store(2 * n - 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy((char *)pSlot + alignUp(sizeof(pimegaShmemSlot)), frame, header_->frameSize);
+  pSlot->seq.store(2 * n, std::memory_order_release);
+  header_->written.store(n, std::memory_order_release);
+  header_->notify.fetch_add(1, std::memory_order_release);
+  futexWake(&header_->notify);
+}
+
+uint64_t pimegaShmemRing::wait(uint64_t seen, int timeoutMs) {
+  uint32_t notify = header_->notify.load(std::memory_order_acquire);
+  uint64_t written = header_->written.load(std::memory_order_acquire);
+
+  if (written > seen) return written;
+  futexWait(&header_->notify, notify, timeoutMs);
+  return header_->written.load(std::memory_order_acquire);
+}
+
+bool pimegaShmemRing::read(uint64_t n, void *dst) {
+  pimegaShmemSlot *pSlot = slot(n);
+  uint64_t seq = pSlot->seq.load(std::memory_order_acquire);
+
+  if (seq != 2 * n) return false;
+  memcpy(dst, (char *)pSlot + alignUp(sizeof(pimegaShmemSlot)), header_->frameSize);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return pSlot->seq.load(std::memory_order_relaxed) == seq;
+}
@@ -0,0 +1,79 @@
+/*
+ * pimegaFrameShmem.h
+ *
+ * Ring of visualizer frames in a POSIX shared memory segment, used when the
+ * backend runs on the same host as the IOC. The IOC creates the segment and
+ * the backend opens it and writes the frames; the futex word in the header
+ * wakes the IOC when a frame is published.
+ */
+
+#ifndef PIMEGA_FRAME_SHMEM_H
+#define PIMEGA_FRAME_SHMEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+/* "PIMF" */
+#define PIMEGA_SHMEM_MAGIC 0x50494d46
+#define PIMEGA_SHMEM_VERSION 1
+/* Prefix of the segment name, followed by the visualizer frame port */
+#define PIMEGA_SHMEM_PREFIX "/pimega_frames_"
+
+/* Header at the start of the segment, shared by both processes. The slots
+ * follow it, each one a pimegaShmemSlot and the frame. */
+typedef struct pimegaShmemHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t frameSize;
+  uint64_t slotSize;
+  uint32_t numSlots;
+  /* Futex word, bumped after every frame */
+  std::atomic<uint32_t> notify;
+  /* Number of frames published so far. Frame n is in slot (n - 1) % numSlots */
+  std::atomic<uint64_t> written;
+} pimegaShmemHeader;
+
+/* seq is odd while frame (seq + 1) / 2 is being written to the slot and even
+ * once frame seq / 2 is complete */
+typedef struct pimegaShmemSlot {
+  std::atomic<uint64_t> seq;
+} pimegaShmemSlot;
+
+class pimegaShmemRing {
+ public:
+  pimegaShmemRing();
+  ~pimegaShmemRing();
+
+  /* Consumer: creates the segment for numSlots frames of frameSize bytes,
+   * replacing a stale one of the same name. */
+  int create(const char *name, size_t frameSize, int numSlots);
+  /* Producer: maps a segment made by create() */
+  int open(const char *name);
+  /* Unmaps the segment, and removes it when it was created here */
+  void close(void);
+
+  size_t getFrameSize(void) { return header_ ? header_->frameSize : 0; }
+  int getNumSlots(void) { return header_ ? (int)header_->numSlots : 0; }
+
+  /* Producer: copies the next frame into its slot and wakes the consumer */
+  void publish(const void *frame);
+
+  /* Consumer: waits until more than seen frames were published, or
+   * timeoutMs. Returns the number of frames published. */
+  uint64_t wait(uint64_t seen, int timeoutMs);
+  /* Consumer: copies frame n to dst. Returns false when the producer wrote
+   * over the slot before or during the copy. */
+  bool read(uint64_t n, void *dst);
+
+ private:
+  pimegaShmemSlot *slot(uint64_t n);
+
+  pimegaShmemHeader *header_;
+  size_t mapSize_;
+  char name_[64];
+  bool owner_;
+};
+
+#endif
@@ -0,0 +1,58 @@
+/* pimegaFrameTiming.cpp
+ *
+ * Percentiles of the frame stage latencies. The histograms only grow; each
+ * collect() takes the difference with the counts it saw the last time.
+ */
+
+#include "pimegaFrameTiming.h"
+
+#include <string.h>
+
+pimegaStageTiming::pimegaStageTiming() : max_(0) {
+  for (int i = 0; i < PIMEGA_TIMING_BUCKETS; i++) counts_[i].store(0);
+  memset(lastCounts_, 0, sizeof(lastCounts_));
+}
+
+double pimegaStageTiming::bucketValue(int index) {
+  int octave;
+  uint64_t width;
+
+  if (index < 4) return index * 1e-9;
+  octave = index / 4 + 1;
+  width = 1ull << (octave - 2);
+  return ((4 + index % 4) * width + width / 2) * 1e-9;
+}
+
+void pimegaStageTiming::collect(pimegaStageLatency *latency, int *counts) {
+  uint64_t interval[PIMEGA_TIMING_BUCKETS];
+  uint64_t total = 0, seen = 0;
+  uint64_t max = max_.exchange(0, std::memory_order_relaxed);
+
+  for (int i = 0; i < PIMEGA_TIMING_BUCKETS; i++) {
+    uint64_t count = counts_[i].load(std::memory_order_relaxed);
+    interval[i] = count - lastCounts_[i];
+    lastCounts_[i] = count;
+    total += interval[i];
+    if (counts) counts[i] = (int)interval[i];
+  }
+
+  latency->count = total;
+  latency->p50 = latency->p99 = 0;
+  latency->max = max * 1e-9;
+  if (total == 0) return;
+
+  for (int i = 0; i < PIMEGA_TIMING_BUCKETS; i++) {
+    bool belowMedian = seen * 2 < total;
+    seen += interval[i];
+    if (belowMedian && seen * 2 >= total) latency->p50 = bucketValue(i);
+    if (seen * 100 >= total * 99) {
+      latency->p99 = bucketValue(i);
+      break;
+    }
+  }
+  /* The middle of the last bucket can be past the largest sample */
+  if (latency->max > 0) {
+    if (latency->p50 > latency->max) latency->p50 = latency->max;
+    if (latency->p99 > latency->max) latency->p99 = latency->max;
+  }
+}
@@ -0,0 +1,105 @@
+/*
+ * pimegaFrameTiming.h
+ *
+ * Latency histograms of the stages of the frame path. Every stage is timed
+ * by a single thread, which only does relaxed atomic stores, and the
+ * histograms are read once a second by the alarm task.
+ */
+
+#ifndef PIMEGA_FRAME_TIMING_H
+#define PIMEGA_FRAME_TIMING_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+
+#include <epicsTime.h>
+
+typedef enum pimega_frame_stage_t {
+  /* ZMQ receive of the frame part (zero-copy and ring transports) */
+  PIMEGA_STAGE_RECEIVE = 0,
+  /* NDArray alloc, wrap or ring slot lookup */
+  PIMEGA_STAGE_ALLOC = 1,
+  /* Copy of the frame into the NDArray (copy transport) */
+  PIMEGA_STAGE_COPY = 2,
+  /* Time spent in the frame queue */
+  PIMEGA_STAGE_QUEUE = 3,
+  /* processFrame */
+  PIMEGA_STAGE_PROCESS = 4,
+  /* getAttributes */
+  PIMEGA_STAGE_ATTRIBUTES = 5,
+  /* doCallbacksGenericPointer */
+  PIMEGA_STAGE_CALLBACKS = 6,
+  /* From the frame arriving to the end of the callbacks */
+  PIMEGA_STAGE_TOTAL = 7,
+  PIMEGA_NUM_STAGES = 8
+} pimega_frame_stage_t;
+
+/* Buckets of 4 per power of 2 of nanoseconds, up to 2^40 ns */
+#define PIMEGA_TIMING_BUCKETS 160
+
+/* Monotonic time in nanoseconds */
+static inline uint64_t pimegaTimeNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Monotonic time in seconds. Until dispatch, frames carry their arrival time
+ * in NDArray::timeStamp in this clock, which is how the latency across
+ * threads is taken without wall clock steps throwing it off. */
+static inline double pimegaArrivalTime(void) { return pimegaTimeNs() / 1e9; }
+
+/* Wall clock time in seconds, the unit of NDArray::timeStamp for the
+ * plugins. dispatchTask converts the arrival time to it. */
+static inline double pimegaWallTime(void) {
+  epicsTimeStamp now;
+  epicsTimeGetCurrent(&now);
+  return now.secPastEpoch + now.nsec / 1e9;
+}
+
+/* Stage latencies of the last interval, in seconds */
+typedef struct pimegaStageLatency {
+  uint64_t count;
+  double p50;
+  double p99;
+  double max;
+} pimegaStageLatency;
+
+class pimegaStageTiming {
+ public:
+  pimegaStageTiming();
+
+  /* Timing thread only */
+  void addSeconds(double seconds) { add(seconds > 0 ? (uint64_t)(seconds * 1e9) : 0); }
+  void add(uint64_t ns) {
+    std::atomic<uint64_t> &count = counts_[bucket(ns)];
+    count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (ns > max && !max_.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+    }
+  }
+
+  /* Reader only. Gives the latencies since the previous call; counts holds
+   * the histogram of the interval when not NULL. */
+  void collect(pimegaStageLatency *latency, int *counts);
+
+  /* Middle of a bucket, in seconds */
+  static double bucketValue(int index);
+
+ private:
+  static int bucket(uint64_t ns) {
+    int octave, index;
+    if (ns < 4) return (int)ns;
+    octave = 63 - __builtin_clzll(ns);
+    index = 4 * (octave - 1) + (int)((ns >> (octave - 2)) & 3);
+    return index < PIMEGA_TIMING_BUCKETS ? index : PIMEGA_TIMING_BUCKETS - 1;
+  }
+
+  std::atomic<uint64_t> counts_[PIMEGA_TIMING_BUCKETS];
+  std::atomic<uint64_t> max_;
+  uint64_t lastCounts_[PIMEGA_TIMING_BUCKETS];
+};
+
+#endif
@@ -0,0 +1,34 @@
+/* pimegaGeometry.cpp
+ *
+ * Module and chip layout of the visualizer frame for each detector model.
+ */
+
+#include "pimegaGeometry.h"
+
+/* Indexed by pimega_detector_model_t */
+static const pimegaGeometry geometries[] = {
+    {0, 0, 0, 0},  /* mobipix */
+    {1, 1, 2, 6},  /* pimega45D: 512 x 1536 */
+    {1, 1, 6, 6},  /* pimega135DL: 1536 x 1536 */
+    {1, 1, 6, 6},  /* pimega135D: 1536 x 1536 */
+    {2, 2, 6, 6},  /* pimega540D: 3072 x 3072 */
+    {10, 1, 6, 2}, /* pimega450D: 15360 x 512 */
+    {10, 1, 6, 2}, /* pimega450DS: 15360 x 512 */
+};
+
+int pimegaGetGeometry(int model, pimegaGeometry *geometry) {
+  if (model < 0 || model >= (int)(sizeof(geometries) / sizeof(geometries[0]))) return -1;
+  if (geometries[model].modulesX == 0) return -1;
+  *geometry = geometries[model];
+  return 0;
+}
+
+void pimegaChipOrigin(const pimegaGeometry *geometry, int module, int chip, int *x, int *y) {
+  int moduleX = module % geometry->modulesX;
+  int moduleY = module / geometry->modulesX;
+  int chipX = chip % geometry->chipsX;
+  int chipY = chip / geometry->chipsX;
+
+  *x = (moduleX * geometry->chipsX + chipX) * PIMEGA_CHIP_SIZE;
+  *y = (moduleY * geometry->chipsY + chipY) * PIMEGA_CHIP_SIZE;
+}
@@ -0,0 +1,31 @@
+/*
+ * pimegaGeometry.h
+ *
+ * Where the modules and chips of each detector model are in the visualizer
+ * frame.
+ */
+
+#ifndef PIMEGA_GEOMETRY_H
+#define PIMEGA_GEOMETRY_H
+
+/* Pixels per side of a Medipix chip */
+#define PIMEGA_CHIP_SIZE 256
+
+/* The frame is a grid of modulesX x modulesY modules. Every module is a grid
+ * of chipsX x chipsY chips, numbered row by row from its top left corner,
+ * which is the order of pimega->sensor_disabled. */
+typedef struct pimegaGeometry {
+  int modulesX;
+  int modulesY;
+  int chipsX;
+  int chipsY;
+} pimegaGeometry;
+
+/* Returns 0 and fills geometry for a pimega_detector_model_t, -1 for models
+ * without a fixed layout */
+int pimegaGetGeometry(int model, pimegaGeometry *geometry);
+
+/* Top left pixel of a chip. module and chip start at 0. */
+void pimegaChipOrigin(const pimegaGeometry *geometry, int module, int chip, int *x, int *y);
+
+#endif
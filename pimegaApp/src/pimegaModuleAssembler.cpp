@@ -0,0 +1,338 @@
+/* pimegaModuleAssembler.cpp
+ *
+ * Per module frame assembly. The tiles of a frame are matched by frame
+ * number in a small table of pending frames; the lock only covers the table,
+ * the tiles are copied without it. The thread that delivers the last expected
+ * tile publishes the frame.
+ *
+ * When every pending slot is taken and a new frame starts, the oldest pending
+ * frame is published with the tiles that never came cleared, so a module that
+ * stops sending does not hold up the others.
+ */
+
+#include "pimegaModuleAssembler.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <zmq.h>
+
+#include "pimegaThreadPlacement.h"
+
+static const char *assemblerName = "pimegaModuleAssembler";
+
+/* Receive timeout, so the threads notice stop() */
+#define RECEIVE_TIMEOUT_MS 100
+
+static void moduleTaskC(void *drvPvt) {
+  pimegaModuleAssembler::module *pModule = (pimegaModuleAssembler::module *)drvPvt;
+  pModule->assembler->moduleTask(pModule);
+}
+
+pimegaModuleAssembler::pimegaModuleAssembler(const char *address, const std::string &topic,
+                                             const pimegaGeometry &geometry,
+                                             NDDataType_t dataType, size_t frameSize,
+                                             int numPending, pimegaNDArrayPool *pool,
+                                             FrameCallback callback)
+    : address_(address),
+      topic_(topic),
+      geometry_(geometry),
+      dataType_(dataType),
+      pool_(pool),
+      callback_(callback),
+      timing_(NULL),
+      context_(NULL),
+      running_(false),
+      pending_(numPending),
+      nextOrder_(0),
+      lastDone_(0),
+      anyDone_(false),
+      numAssembled_(0),
+      numIncomplete_(0),
+      numLate_(0),
+      numErrors_(0) {
+  int numModules = geometry.modulesX * geometry.modulesY;
+
+  tileSizeX_ = geometry.chipsX * PIMEGA_CHIP_SIZE;
+  tileSizeY_ = geometry.chipsY * PIMEGA_CHIP_SIZE;
+  dims_[0] = geometry.modulesX * tileSizeX_;
+  dims_[1] = geometry.modulesY * tileSizeY_;
+  elemSize_ = frameSize / (dims_[0] * dims_[1]);
+
+  modules_.resize(numModules);
+  for (int i = 0; i < numModules; i++) {
+    modules_[i].assembler = this;
+    modules_[i].index = i;
+    modules_[i].socket = NULL;
+    pimegaChipOrigin(&geometry, i, 0, &modules_[i].x, &modules_[i].y);
+    modules_[i].exitedEventId = epicsEventMustCreate(epicsEventEmpty);
+  }
+  for (size_t i = 0; i < pending_.size(); i++) pending_[i].pArray = NULL;
+  moduleMask_ = numModules < 32 ? (1u << numModules) - 1 : ~0u;
+  lock_ = epicsMutexMustCreate();
+  publishLock_ = epicsMutexMustCreate();
+}
+
+pimegaModuleAssembler::~pimegaModuleAssembler() {
+  stop();
+  reset();
+  for (size_t i = 0; i < modules_.size(); i++) epicsEventDestroy(modules_[i].exitedEventId);
+  epicsMutexDestroy(lock_);
+  epicsMutexDestroy(publishLock_);
+}
+
+void pimegaModuleAssembler::setModuleMask(uint32_t mask) {
+  epicsMutexLock(lock_);
+  moduleMask_ = mask;
+  epicsMutexUnlock(lock_);
+}
+
+/** Releases the pending frames. A module thread still copying into one keeps
+ * its own reference until it is done. */
+void pimegaModuleAssembler::reset(void) {
+  epicsMutexLock(lock_);
+  for (size_t i = 0; i < pending_.size(); i++) {
+    if (pending_[i].pArray) pending_[i].pArray->release();
+    pending_[i].pArray = NULL;
+  }
+  anyDone_ = false;
+  lastDone_ = 0;
+  epicsMutexUnlock(lock_);
+}
+
+int pimegaModuleAssembler::start(void) {
+  int timeout = RECEIVE_TIMEOUT_MS;
+  char name[32];
+
+  context_ = zmq_ctx_new();
+  for (size_t i = 0; i < modules_.size(); i++) {
+    std::string topic = topic_ + "_m" + (i < 9 ? "0" : "") + std::to_string(i + 1);
+
+    modules_[i].socket = zmq_socket(context_, ZMQ_SUB);
+    if (!modules_[i].socket) {
+      printf("%s: zmq_socket failed: %s\n", assemblerName, zmq_strerror(zmq_errno()));
+      return -1;
+    }
+    zmq_setsockopt(modules_[i].socket, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+    zmq_setsockopt(modules_[i].socket, ZMQ_SUBSCRIBE, topic.c_str(), topic.size());
+    if (zmq_connect(modules_[i].socket, address_.c_str()) != 0) {
+      printf("%s: unable to connect to %s: %s\n", assemblerName, address_.c_str(),
+             zmq_strerror(zmq_errno()));
+      return -1;
+    }
+  }
+
+  running_ = true;
+  for (size_t i = 0; i < modules_.size(); i++) {
+    snprintf(name, sizeof(name), "pimegaModRx%d", (int)i + 1);
+    if (epicsThreadCreate(name, epicsThreadPriorityHigh,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+                          (EPICSTHREADFUNC)moduleTaskC, &modules_[i]) == NULL) {
+      printf("%s: epicsThreadCreate failure for module %d\n", assemblerName, (int)i + 1);
+      /* The threads already running are stopped by stop() */
+      for (size_t j = i; j < modules_.size(); j++) epicsEventSignal(modules_[j].exitedEventId);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void pimegaModuleAssembler::stop(void) {
+  if (running_) {
+    running_ = false;
+    for (size_t i = 0; i < modules_.size(); i++) epicsEventWait(modules_[i].exitedEventId);
+  }
+  for (size_t i = 0; i < modules_.size(); i++) {
+    if (modules_[i].socket) zmq_close(modules_[i].socket);
+    modules_[i].socket = NULL;
+  }
+  if (context_) zmq_ctx_term(context_);
+  context_ = NULL;
+}
+
+void pimegaModuleAssembler::moduleTask(module *pModule) {
+  uint32_t bit = 1u << pModule->index;
+  zmq_msg_t msg;
+  uint64_t number;
+  pendingFrame *pFrame;
+  NDArray *pArray, *pEvicted, *pDone;
+  uint32_t arrived = 0, evictedArrived = 0;
+
+  pimegaApplyPlacement(PIMEGA_THREAD_RECEIVE);
+  zmq_msg_init(&msg);
+  while (running_) {
+    if (!receiveTile(pModule, &number, &msg)) continue;
+
+    pEvicted = NULL;
+    epicsMutexLock(lock_);
+    if (!(moduleMask_ & bit)) {
+      epicsMutexUnlock(lock_);
+      continue;
+    }
+    pFrame = claim(number, &pEvicted, &evictedArrived);
+    if (pFrame) {
+      pFrame->writers++;
+      pArray = pFrame->pArray;
+      pArray->reserve();
+    }
+    epicsMutexUnlock(lock_);
+    if (pEvicted) {
+      clearMissing(pEvicted, evictedArrived);
+      publish(pEvicted);
+    }
+    if (!pFrame) continue;
+
+    copyTile(pModule, (const char *)zmq_msg_data(&msg), pArray);
+
+    /* The slot may have been evicted or reset while copying, in which case
+     * the frame no longer belongs to it */
+    pDone = NULL;
+    epicsMutexLock(lock_);
+    if (pFrame->pArray == pArray) {
+      pFrame->writers--;
+      pFrame->arrived |= bit;
+      if (pFrame->writers == 0 && (pFrame->arrived & moduleMask_) == moduleMask_) {
+        pDone = pArray;
+        arrived = pFrame->arrived;
+        pFrame->pArray = NULL;
+        if (!anyDone_ || number > lastDone_) lastDone_ = number;
+        anyDone_ = true;
+        numAssembled_++;
+      }
+    }
+    epicsMutexUnlock(lock_);
+    pArray->release();
+    if (pDone) {
+      /* Modules left out of the mask */
+      clearMissing(pDone, arrived);
+      publish(pDone);
+    }
+  }
+  zmq_msg_close(&msg);
+  pimegaLeavePlacement();
+  epicsEventSignal(pModule->exitedEventId);
+}
+
+/** Receives the next tile of a module into msg. Returns false on timeout or
+ * on a malformed message. */
+bool pimegaModuleAssembler::receiveTile(module *pModule, uint64_t *number, void *msg) {
+  char topic[256];
+  uint8_t header[8];
+  int more = 0;
+  size_t moreSize = sizeof(more);
+  size_t tileBytes = (size_t)tileSizeX_ * tileSizeY_ * elemSize_;
+  bool valid = true;
+
+  if (zmq_recv(pModule->socket, topic, sizeof(topic), 0) < 0) return false;
+  zmq_getsockopt(pModule->socket, ZMQ_RCVMORE, &more, &moreSize);
+  if (more && zmq_recv(pModule->socket, header, sizeof(header), 0) != sizeof(header))
+    valid = false;
+  zmq_getsockopt(pModule->socket, ZMQ_RCVMORE, &more, &moreSize);
+  if (!more) valid = false;
+  if (valid && (zmq_msg_recv((zmq_msg_t *)msg, pModule->socket, 0) < 0 ||
+                zmq_msg_size((zmq_msg_t *)msg) != tileBytes))
+    valid = false;
+
+  /* Drop what is left of a malformed message */
+  zmq_getsockopt(pModule->socket, ZMQ_RCVMORE, &more, &moreSize);
+  while (more) {
+    zmq_recv(pModule->socket, topic, sizeof(topic), 0);
+    zmq_getsockopt(pModule->socket, ZMQ_RCVMORE, &more, &moreSize);
+    valid = false;
+  }
+  if (!valid) {
+    epicsMutexLock(lock_);
+    numErrors_++;
+    epicsMutexUnlock(lock_);
+    return false;
+  }
+
+  *number = 0;
+  for (int i = 7; i >= 0; i--) *number = *number << 8 | header[i];
+  return true;
+}
+
+/** Finds the pending frame of a frame number, or starts one. Returns NULL for
+ * late tiles and when no NDArray is available. If the oldest pending frame
+ * had to make room, it is returned in pEvicted with its arrived modules in
+ * evictedArrived, to be cleared and published once the lock is dropped.
+ * Called with the lock held. */
+pimegaModuleAssembler::pendingFrame *pimegaModuleAssembler::claim(uint64_t number,
+                                                                   NDArray **pEvicted,
+                                                                   uint32_t *evictedArrived) {
+  pendingFrame *pFree = NULL, *pOldest = NULL;
+  uint64_t start;
+
+  for (size_t i = 0; i < pending_.size(); i++) {
+    pendingFrame *pFrame = &pending_[i];
+    if (!pFrame->pArray) {
+      if (!pFree) pFree = pFrame;
+    } else if (pFrame->number == number) {
+      return pFrame;
+    } else if (pFrame->writers == 0 && (!pOldest || pFrame->order < pOldest->order)) {
+      pOldest = pFrame;
+    }
+  }
+
+  if (anyDone_ && number <= lastDone_) {
+    numLate_++;
+    return NULL;
+  }
+
+  if (!pFree) {
+    if (!pOldest) {
+      numErrors_++;
+      return NULL;
+    }
+    *pEvicted = pOldest->pArray;
+    *evictedArrived = pOldest->arrived;
+    if (!anyDone_ || pOldest->number > lastDone_) lastDone_ = pOldest->number;
+    anyDone_ = true;
+    numIncomplete_++;
+    pOldest->pArray = NULL;
+    pFree = pOldest;
+  }
+
+  start = pimegaTimeNs();
+  pFree->pArray = pool_->allocFrame(2, dims_, dataType_, dims_[0] * dims_[1] * elemSize_);
+  if (!pFree->pArray) {
+    numErrors_++;
+    return NULL;
+  }
+  if (timing_) timing_[PIMEGA_STAGE_ALLOC].add(pimegaTimeNs() - start);
+  pFree->pArray->timeStamp = pimegaArrivalTime();
+  pFree->number = number;
+  pFree->order = nextOrder_++;
+  pFree->arrived = 0;
+  pFree->writers = 0;
+  return pFree;
+}
+
+/** Zeroes the tiles of the modules that did not arrive */
+void pimegaModuleAssembler::clearMissing(NDArray *pArray, uint32_t arrived) {
+  size_t rowBytes = (size_t)tileSizeX_ * elemSize_;
+
+  for (size_t i = 0; i < modules_.size(); i++) {
+    if (arrived & (1u << i)) continue;
+    for (int row = 0; row < tileSizeY_; row++) {
+      char *pDst = (char *)pArray->pData +
+                   (((size_t)modules_[i].y + row) * dims_[0] + modules_[i].x) * elemSize_;
+      memset(pDst, 0, rowBytes);
+    }
+  }
+}
+
+void pimegaModuleAssembler::copyTile(const module *pModule, const char *tile, NDArray *pArray) {
+  size_t rowBytes = (size_t)tileSizeX_ * elemSize_;
+  char *pDst = (char *)pArray->pData + ((size_t)pModule->y * dims_[0] + pModule->x) * elemSize_;
+
+  for (int row = 0; row < tileSizeY_; row++) {
+    memcpy(pDst, tile + row * rowBytes, rowBytes);
+    pDst += dims_[0] * elemSize_;
+  }
+}
+
+void pimegaModuleAssembler::publish(NDArray *pArray) {
+  epicsMutexLock(publishLock_);
+  callback_(pArray);
+  epicsMutexUnlock(publishLock_);
+}
@@ -0,0 +1,120 @@
+/*
+ * pimegaModuleAssembler.h
+ *
+ * Assembles visualizer frames from per module streams. Each module is
+ * received by its own thread, which copies its tile straight into the
+ * destination NDArray, so assembly scales with the number of modules instead
+ * of being done serially by the backend.
+ */
+
+#ifndef PIMEGA_MODULE_ASSEMBLER_H
+#define PIMEGA_MODULE_ASSEMBLER_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+
+#include "ADDriver.h"
+#include "pimegaFrameTiming.h"
+#include "pimegaGeometry.h"
+#include "pimegaNDArrayPool.h"
+
+class pimegaModuleAssembler {
+ public:
+  /* Called for every assembled frame, from one module thread at a time. The
+   * callee owns the reference to the NDArray. */
+  typedef std::function<void(NDArray *)> FrameCallback;
+
+  /* Module n publishes on topic + "_m" + n, counting from 01, as three part
+   * messages: the topic, the frame number as a little endian uint64 and the
+   * tile. numPending frames can be assembled at the same time. */
+  pimegaModuleAssembler(const char *address, const std::string &topic,
+                        const pimegaGeometry &geometry, NDDataType_t dataType, size_t frameSize,
+                        int numPending, pimegaNDArrayPool *pool, FrameCallback callback);
+  ~pimegaModuleAssembler();
+
+  int getNumModules(void) { return (int)modules_.size(); }
+  /* Bit n set when module n is read out. Frames are published once all of
+   * those modules have arrived; the others are left at 0. */
+  void setModuleMask(uint32_t mask);
+  /* Drops the frames being assembled and restarts the frame numbering, at the
+   * start of an acquisition */
+  void reset(void);
+  void setTiming(pimegaStageTiming *timing) { timing_ = timing; }
+  int start(void);
+  void stop(void);
+
+  uint64_t getNumAssembled(void) { return numAssembled_; }
+  uint64_t getNumIncomplete(void) { return numIncomplete_; }
+  uint64_t getNumLate(void) { return numLate_; }
+  uint64_t getNumErrors(void) { return numErrors_; }
+
+  struct module {
+    pimegaModuleAssembler *assembler;
+    int index;
+    void *socket;
+    /* Top left pixel of the tile in the frame */
+    int x;
+    int y;
+    epicsEventId exitedEventId;
+  };
+
+  void moduleTask(module *pModule);
+
+ private:
+  struct pendingFrame {
+    uint64_t number;
+    /* Claim order, to find the oldest frame */
+    uint64_t order;
+    NDArray *pArray;
+    uint32_t arrived;
+    int writers;
+  };
+
+  bool receiveTile(module *pModule, uint64_t *number, void *msg);
+  pendingFrame *claim(uint64_t number, NDArray **pEvicted, uint32_t *evictedArrived);
+  void clearMissing(NDArray *pArray, uint32_t arrived);
+  void copyTile(const module *pModule, const char *tile, NDArray *pArray);
+  void publish(NDArray *pArray);
+
+  std::string address_;
+  std::string topic_;
+  pimegaGeometry geometry_;
+  size_t dims_[2];
+  NDDataType_t dataType_;
+  size_t elemSize_;
+  int tileSizeX_;
+  int tileSizeY_;
+  pimegaNDArrayPool *pool_;
+  FrameCallback callback_;
+  pimegaStageTiming *timing_;
+
+  void *context_;
+  std::vector<module> modules_;
+  volatile bool running_;
+
+  /* Protects the fields below */
+  epicsMutexId lock_;
+  std::vector<pendingFrame> pending_;
+  uint32_t moduleMask_;
+  uint64_t nextOrder_;
+  /* Highest frame number published since reset(); tiles of older frames are
+   * late */
+  uint64_t lastDone_;
+  bool anyDone_;
+  uint64_t numAssembled_;
+  uint64_t numIncomplete_;
+  uint64_t numLate_;
+  uint64_t numErrors_;
+
+  /* Held while calling callback_, which is a single producer */
+  epicsMutexId publishLock_;
+};
+
+#endif
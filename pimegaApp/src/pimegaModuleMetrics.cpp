@@ -0,0 +1,85 @@
+/* pimegaModuleMetrics.cpp
+ *
+ * The alarm task samples the cached backend status once a second. A window
+ * starts at the newest sample at least its length old, or at the oldest one
+ * while there is not that much history yet. The backend counters restart at
+ * every acquisition, so a counter lower than in the sample before it counts
+ * from 0.
+ */
+
+#include "pimegaModuleMetrics.h"
+
+#include <algorithm>
+
+static const double windowLengths[PIMEGA_NUM_WINDOWS] = {1, 10, 60};
+
+void pimegaModuleMetrics::sample(const acq_status_return_t &status, double time) {
+  counterSample s;
+
+  s.time = time;
+  for (int module = 0; module < PIMEGA_METRIC_MODULES; module++) {
+    s.received[module] = status.STATUS_NOOFFRAMES[module];
+    s.lost[module] = status.STATUS_LOSTFRAMECNT[module];
+    s.bufferUsed[module] = status.STATUS_BUFFERUSED[module] * 100;
+  }
+  s.processed = status.processedImageNum;
+  s.saved = status.STATUS_SAVEDFRAMENUM;
+  samples_.push_back(s);
+
+  /* The second oldest is enough to start the longest window */
+  while (samples_.size() > 2 &&
+         samples_[1].time <= time - windowLengths[PIMEGA_NUM_WINDOWS - 1])
+    samples_.pop_front();
+}
+
+size_t pimegaModuleMetrics::windowStart(int window) const {
+  double start = samples_.back().time - windowLengths[window];
+
+  for (size_t i = samples_.size() - 1; i > 0; i--)
+    if (samples_[i - 1].time <= start) return i - 1;
+  return 0;
+}
+
+template <typename Get>
+double pimegaModuleMetrics::counterRate(int window, Get get) const {
+  size_t first = windowStart(window);
+  double interval = samples_.back().time - samples_[first].time;
+  double total = 0;
+
+  for (size_t i = first + 1; i < samples_.size(); i++) {
+    uint64_t previous = get(samples_[i - 1]), current = get(samples_[i]);
+    total += current >= previous ? (double)(current - previous) : (double)current;
+  }
+  return interval > 0 ? total / interval : 0;
+}
+
+void pimegaModuleMetrics::moduleRates(int module, pimegaModuleRates *rates) const {
+  rates->timeToFull = -1;
+  for (int window = 0; window < PIMEGA_NUM_WINDOWS; window++)
+    rates->received[window] = rates->lost[window] = rates->bufferTrend[window] = 0;
+  if (samples_.empty()) return;
+
+  const counterSample &last = samples_.back();
+  for (int window = 0; window < PIMEGA_NUM_WINDOWS; window++) {
+    const counterSample &first = samples_[windowStart(window)];
+    rates->received[window] =
+        counterRate(window, [module](const counterSample &s) { return s.received[module]; });
+    rates->lost[window] =
+        counterRate(window, [module](const counterSample &s) { return s.lost[module]; });
+    if (last.time > first.time)
+      rates->bufferTrend[window] =
+          (last.bufferUsed[module] - first.bufferUsed[module]) / (last.time - first.time);
+  }
+  if (rates->bufferTrend[PIMEGA_WINDOW_10S] > 0)
+    rates->timeToFull = std::max(0.0, 100 - last.bufferUsed[module]) /
+                        rates->bufferTrend[PIMEGA_WINDOW_10S];
+}
+
+void pimegaModuleMetrics::backendRates(double *processed, double *saved) const {
+  for (int window = 0; window < PIMEGA_NUM_WINDOWS; window++) {
+    processed[window] = saved[window] = 0;
+    if (samples_.empty()) continue;
+    processed[window] = counterRate(window, [](const counterSample &s) { return s.processed; });
+    saved[window] = counterRate(window, [](const counterSample &s) { return s.saved; });
+  }
+}
@@ -0,0 +1,68 @@
+/*
+ * pimegaModuleMetrics.h
+ *
+ * Rates over the last 1, 10 and 60 seconds derived from the backend counters:
+ * frames received and lost per module, frames processed and saved by the
+ * backend, and how fast the RDMA buffer of each module fills, so a drop in
+ * throughput shows before frames are lost.
+ */
+
+#ifndef PIMEGA_MODULE_METRICS_H
+#define PIMEGA_MODULE_METRICS_H
+
+#include <stdint.h>
+
+#include <deque>
+
+#include <pimega.h>
+
+/* Modules with metrics PVs, M1 to M4 */
+#define PIMEGA_METRIC_MODULES 4
+
+typedef enum pimega_metric_window_t {
+  PIMEGA_WINDOW_1S = 0,
+  PIMEGA_WINDOW_10S = 1,
+  PIMEGA_WINDOW_60S = 2,
+  PIMEGA_NUM_WINDOWS = 3
+} pimega_metric_window_t;
+
+typedef struct pimegaModuleRates {
+  /* Frames per second, indexed by pimega_metric_window_t */
+  double received[PIMEGA_NUM_WINDOWS];
+  double lost[PIMEGA_NUM_WINDOWS];
+  /* Change of the RDMA buffer usage, in % per second */
+  double bufferTrend[PIMEGA_NUM_WINDOWS];
+  /* Seconds until the RDMA buffer is full at the 10 s trend, -1 when it is
+   * not filling */
+  double timeToFull;
+} pimegaModuleRates;
+
+class pimegaModuleMetrics {
+ public:
+  /* Adds the counters of status, taken at time in seconds */
+  void sample(const acq_status_return_t &status, double time);
+
+  void moduleRates(int module, pimegaModuleRates *rates) const;
+  /* Frames per second processed and saved by the backend, per window */
+  void backendRates(double *processed, double *saved) const;
+
+ private:
+  typedef struct counterSample {
+    double time;
+    uint64_t received[PIMEGA_METRIC_MODULES];
+    uint64_t lost[PIMEGA_METRIC_MODULES];
+    double bufferUsed[PIMEGA_METRIC_MODULES];
+    uint64_t processed;
+    uint64_t saved;
+  } counterSample;
+
+  size_t windowStart(int window) const;
+  /* Counts per second over the window of the counter get returns */
+  template <typename Get>
+  double counterRate(int window, Get get) const;
+
+  /* Oldest first, back to one sample before the longest window */
+  std::deque<counterSample> samples_;
+};
+
+#endif
@@ -0,0 +1,251 @@
+/* pimegaNDArrayPool.cpp
+ *
+ * NDArrayPool used to publish frames without copying them out of the
+ * receive buffer.
+ *
+ * With huge pages on, the frame buffers are mapped by the pool itself, 2 MB
+ * aligned, and handed out through wrap() so they come back to the pool
+ * instead of being freed. A 36 MB frame then spans 18 TLB entries instead of
+ * about 9000. The pages are touched when a buffer is mapped, so a run only
+ * faults while the number of frames in flight grows.
+ */
+
+#include "pimegaNDArrayPool.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "pimegaThreadPlacement.h"
+
+static const char *poolName = "pimegaNDArrayPool";
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+static bool transparentHugePages(void) {
+  char line[128] = "";
+  FILE *fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+
+  if (!fp) return false;
+  if (!fgets(line, sizeof(line), fp)) line[0] = '\0';
+  fclose(fp);
+  return strstr(line, "[never]") == NULL;
+}
+
+/* Whether the mapping holding p is all transparent huge pages, from
+ * AnonHugePages in /proc/self/smaps. The aligned buffers can merge with their
+ * neighbours into one mapping, so the whole of it has to be backed for p to
+ * count; a buffer is left out rather than counted on a guess. */
+static bool backedByHugePages(const void *p) {
+  char line[512];
+  unsigned long start = 0, end = 0, first, last, kB;
+  bool inside = false, backed = false;
+  FILE *fp = fopen("/proc/self/smaps", "r");
+
+  if (!fp) return false;
+  while (fgets(line, sizeof(line), fp)) {
+    /* Mappings start with their address range, their fields with a name */
+    if (sscanf(line, "%lx-%lx", &first, &last) == 2) {
+      if (inside) break;
+      start = first;
+      end = last;
+      inside = (uintptr_t)p >= start && (uintptr_t)p < end;
+    } else if (inside && sscanf(line, "AnonHugePages: %lu kB", &kB) == 1) {
+      backed = kB * 1024 >= end - start;
+    }
+  }
+  fclose(fp);
+  return backed;
+}
+
+static void releaseFrameC(void * /* pData */, void *releasePvt) {
+  pimegaNDArrayPool::frameBuffer *buffer = (pimegaNDArrayPool::frameBuffer *)releasePvt;
+  buffer->pool->releaseFrame(buffer);
+}
+
+/** The frames are bounded by the rings and queues in front of the pool, so
+ * it is created without a memory limit. */
+pimegaNDArrayPool::pimegaNDArrayPool(asynNDArrayDriver *pDriver)
+    : NDArrayPool(pDriver, 0),
+      numaNode_(-1),
+      hugePages_(PIMEGA_HUGE_PAGES_OFF),
+      numHugeBuffers_(0),
+      warnedHugetlb_(false) {
+  wrappedLock_ = epicsMutexMustCreate();
+}
+
+/* Buffers still held by plugins are left mapped, the pool lives as long as
+ * the driver */
+pimegaNDArrayPool::~pimegaNDArrayPool() {
+  for (size_t i = 0; i < freeFrames_.size(); i++) unmapFrame(freeFrames_[i]);
+  epicsMutexDestroy(wrappedLock_);
+}
+
+void pimegaNDArrayPool::setHugePages(int mode) {
+  hugePages_ = mode;
+  if (mode != PIMEGA_HUGE_PAGES_OFF && !transparentHugePages())
+    printf("%s: transparent huge pages are disabled%s\n", poolName,
+           mode == PIMEGA_HUGE_PAGES_EXPLICIT ? ", only hugetlbfs pages will be used"
+                                              : ", frame buffers use normal pages");
+}
+
+/** Maps a buffer for one frame: hugetlbfs pages first when they are asked
+ * for, then an aligned anonymous mapping advised for transparent huge pages,
+ * which ends up with normal pages when those are disabled. */
+pimegaNDArrayPool::frameBuffer *pimegaNDArrayPool::mapFrame(size_t dataSize) {
+  size_t mapSize = (dataSize + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  void *p = MAP_FAILED;
+  bool huge = false;
+
+  if (hugePages_ == PIMEGA_HUGE_PAGES_EXPLICIT) {
+    p = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+             -1, 0);
+    huge = p != MAP_FAILED;
+    if (!huge && !warnedHugetlb_) {
+      printf("%s: no hugetlbfs pages left, falling back to transparent huge pages\n",
+             poolName);
+      warnedHugetlb_ = true;
+    }
+  }
+  if (p == MAP_FAILED) {
+    /* Only whole aligned 2 MB ranges get transparent huge pages, so map one
+     * more than needed and trim the ends */
+    char *raw = (char *)mmap(NULL, mapSize + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+    char *aligned =
+        (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > raw) munmap(raw, aligned - raw);
+    munmap(aligned + mapSize, raw + HUGE_PAGE_SIZE - aligned);
+    p = aligned;
+    if (transparentHugePages()) madvise(p, mapSize, MADV_HUGEPAGE);
+  }
+
+  if (numaNode_ >= 0) pimegaBindToNode(p, mapSize, numaNode_);
+  memset(p, 0, mapSize);
+  /* madvise only asks for transparent huge pages, whether the kernel found
+   * them shows once the pages are touched */
+  if (!huge && hugePages_ != PIMEGA_HUGE_PAGES_OFF) huge = backedByHugePages(p);
+
+  frameBuffer *buffer = new frameBuffer;
+  buffer->pool = this;
+  buffer->pData = p;
+  buffer->dataSize = dataSize;
+  buffer->mapSize = mapSize;
+  buffer->huge = huge;
+  if (huge) {
+    epicsMutexLock(wrappedLock_);
+    numHugeBuffers_++;
+    epicsMutexUnlock(wrappedLock_);
+  }
+  return buffer;
+}
+
+void pimegaNDArrayPool::unmapFrame(frameBuffer *buffer) {
+  if (buffer->huge) {
+    epicsMutexLock(wrappedLock_);
+    numHugeBuffers_--;
+    epicsMutexUnlock(wrappedLock_);
+  }
+  munmap(buffer->pData, buffer->mapSize);
+  delete buffer;
+}
+
+NDArray *pimegaNDArrayPool::allocFrame(int ndims, size_t *dims, NDDataType_t dataType,
+                                       size_t dataSize) {
+  frameBuffer *buffer = NULL;
+  std::vector<frameBuffer *> stale;
+  NDArray *pArray;
+
+  if (hugePages_ == PIMEGA_HUGE_PAGES_OFF) return alloc(ndims, dims, dataType, dataSize, NULL);
+
+  epicsMutexLock(wrappedLock_);
+  for (size_t i = 0; i < freeFrames_.size(); i++) {
+    if (freeFrames_[i]->dataSize == dataSize) {
+      buffer = freeFrames_[i];
+      freeFrames_.erase(freeFrames_.begin() + i);
+      break;
+    }
+  }
+  /* The frame size changed, so the free buffers of the old size are not
+   * used again */
+  if (!buffer) stale.swap(freeFrames_);
+  epicsMutexUnlock(wrappedLock_);
+
+  for (size_t i = 0; i < stale.size(); i++) unmapFrame(stale[i]);
+  if (!buffer) buffer = mapFrame(dataSize);
+  if (!buffer) return alloc(ndims, dims, dataType, dataSize, NULL);
+  pArray = wrap(ndims, dims, dataType, buffer->pData, dataSize, releaseFrameC, buffer);
+  if (!pArray) releaseFrame(buffer);
+  return pArray;
+}
+
+void pimegaNDArrayPool::releaseFrame(frameBuffer *buffer) {
+  epicsMutexLock(wrappedLock_);
+  freeFrames_.push_back(buffer);
+  epicsMutexUnlock(wrappedLock_);
+}
+
+int pimegaNDArrayPool::getNumHugeBuffers(void) {
+  int numHugeBuffers;
+  epicsMutexLock(wrappedLock_);
+  numHugeBuffers = numHugeBuffers_;
+  epicsMutexUnlock(wrappedLock_);
+  return numHugeBuffers;
+}
+
+/** Returns an NDArray whose pData points to memory owned by the caller.
+ * \param[in] releaseFunc Called with (pData, releasePvt) once the last
+ * reference to the NDArray is released. The memory must stay valid until then.
+ */
+NDArray *pimegaNDArrayPool::wrap(int ndims, size_t *dims, NDDataType_t dataType, void *pData,
+                                 size_t dataSize, pimegaReleaseFunc releaseFunc,
+                                 void *releasePvt) {
+  NDArray *pArray = alloc(ndims, dims, dataType, dataSize, pData);
+  if (!pArray) return NULL;
+
+  wrappedBuffer buffer = {releaseFunc, releasePvt};
+  epicsMutexLock(wrappedLock_);
+  wrapped_[pArray] = buffer;
+  epicsMutexUnlock(wrappedLock_);
+  return pArray;
+}
+
+int pimegaNDArrayPool::getNumWrapped(void) {
+  int numWrapped;
+  epicsMutexLock(wrappedLock_);
+  numWrapped = (int)wrapped_.size();
+  epicsMutexUnlock(wrappedLock_);
+  return numWrapped;
+}
+
+/** Binds the buffers to the NUMA node before the pages the receive thread
+ * writes are first touched. The pages that are already there stay where they
+ * are, so this only costs a call per allocation. */
+void pimegaNDArrayPool::onAllocateArray(NDArray *pArray) {
+  if (numaNode_ >= 0 && pArray->pData)
+    pimegaBindToNode(pArray->pData, pArray->dataSize, numaNode_);
+}
+
+void pimegaNDArrayPool::onReleaseArray(NDArray *pArray) {
+  wrappedBuffer buffer;
+
+  if (pArray->getReferenceCount() != 0) return;
+
+  epicsMutexLock(wrappedLock_);
+  std::map<NDArray *, wrappedBuffer>::iterator it = wrapped_.find(pArray);
+  if (it == wrapped_.end()) {
+    epicsMutexUnlock(wrappedLock_);
+    return;
+  }
+  buffer = it->second;
+  wrapped_.erase(it);
+  epicsMutexUnlock(wrappedLock_);
+
+  /* Detach the external memory so the pool never frees it when the NDArray
+   * is reused */
+  void *pData = pArray->pData;
+  pArray->pData = NULL;
+  buffer.releaseFunc(pData, buffer.releasePvt);
+}
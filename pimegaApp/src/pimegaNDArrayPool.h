@@ -0,0 +1,90 @@
+/*
+ * pimegaNDArrayPool.h
+ *
+ * NDArrayPool that can hand out NDArrays wrapping memory owned by someone
+ * else (e.g. a ZMQ message). The owner is notified through a release hook
+ * once the last plugin releases the NDArray. The pool uses the same hook for
+ * its own frame buffers, which can be backed by huge pages.
+ */
+
+#ifndef PIMEGA_NDARRAY_POOL_H
+#define PIMEGA_NDARRAY_POOL_H
+
+#include <stddef.h>
+
+#include <map>
+#include <vector>
+
+#include <epicsMutex.h>
+
+#include "ADDriver.h"
+
+typedef void (*pimegaReleaseFunc)(void *pData, void *releasePvt);
+
+typedef enum pimega_huge_pages_t {
+  PIMEGA_HUGE_PAGES_OFF = 0,
+  /* Transparent huge pages, asked for with madvise */
+  PIMEGA_HUGE_PAGES_TRANSPARENT = 1,
+  /* hugetlbfs pages reserved with vm.nr_hugepages, or transparent ones once
+   * they run out */
+  PIMEGA_HUGE_PAGES_EXPLICIT = 2
+} pimega_huge_pages_t;
+
+class pimegaNDArrayPool : public NDArrayPool {
+ public:
+  pimegaNDArrayPool(asynNDArrayDriver *pDriver);
+  virtual ~pimegaNDArrayPool();
+
+  NDArray *wrap(int ndims, size_t *dims, NDDataType_t dataType, void *pData, size_t dataSize,
+                pimegaReleaseFunc releaseFunc, void *releasePvt);
+  int getNumWrapped(void);
+  /* NUMA node the frame buffers are bound to, -1 for the default */
+  void setNumaNode(int node) { numaNode_ = node; }
+
+  /* Set before the first allocFrame() */
+  void setHugePages(int mode);
+  int getHugePages(void) { return hugePages_; }
+  /* Same as alloc(), but with huge pages enabled the data is in a buffer of
+   * the pool that is reused for frames of the same size. The free buffers
+   * of another size are unmapped when a frame of a new size is asked for.
+   * Falls back to alloc() when no buffer can be mapped. */
+  NDArray *allocFrame(int ndims, size_t *dims, NDDataType_t dataType, size_t dataSize);
+  /* Frame buffers mapped that are backed by huge pages: hugetlbfs ones, and
+   * advised ones the kernel gave transparent huge pages to */
+  int getNumHugeBuffers(void);
+
+  struct frameBuffer {
+    pimegaNDArrayPool *pool;
+    void *pData;
+    size_t dataSize;
+    size_t mapSize;
+    bool huge;
+  };
+  void releaseFrame(frameBuffer *buffer);
+
+ protected:
+  virtual void onAllocateArray(NDArray *pArray);
+  virtual void onReleaseArray(NDArray *pArray);
+
+ private:
+  frameBuffer *mapFrame(size_t dataSize);
+  void unmapFrame(frameBuffer *buffer);
+
+  struct wrappedBuffer {
+    pimegaReleaseFunc releaseFunc;
+    void *releasePvt;
+  };
+
+  /* NDArrays currently pointing to external memory */
+  std::map<NDArray *, wrappedBuffer> wrapped_;
+  epicsMutexId wrappedLock_;
+  int numaNode_;
+
+  /* Frame buffers not in use, protected by wrappedLock_ */
+  std::vector<frameBuffer *> freeFrames_;
+  int hugePages_;
+  int numHugeBuffers_;
+  bool warnedHugetlb_;
+};
+
+#endif
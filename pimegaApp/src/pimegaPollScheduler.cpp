@@ -0,0 +1,61 @@
+/* pimegaPollScheduler.cpp
+ *
+ * Before the expected end the wait is half the time left, so the end is
+ * approached in a few polls and then polled at the shortest period. From
+ * POLL_END_GRACE after it, or from the start when there is no expected end,
+ * every poll that sees no change doubles the period up to the longest one.
+ */
+
+#include "pimegaPollScheduler.h"
+
+#include <algorithm>
+
+#include "pimegaFrameTiming.h"
+
+static double now(void) { return pimegaTimeNs() / 1e9; }
+
+pimegaPollScheduler::pimegaPollScheduler(double minPeriod, double maxPeriod)
+    : min_(minPeriod),
+      max_(maxPeriod),
+      period_(minPeriod),
+      end_(0),
+      numPolls_(0),
+      numWakeups_(0),
+      lastPolls_(0),
+      lastWakeups_(0),
+      lastCollect_(now()) {}
+
+void pimegaPollScheduler::start(double expected) {
+  period_ = min_;
+  end_ = expected > 0 ? now() + expected : 0;
+}
+
+void pimegaPollScheduler::progress(void) { period_ = min_; }
+
+double pimegaPollScheduler::next(void) {
+  double period;
+
+  if (end_ > 0) {
+    double remaining = end_ - now();
+    if (remaining > -POLL_END_GRACE) {
+      period_ = min_;
+      return std::max(min_, std::min(max_, remaining / 2));
+    }
+  }
+  period = period_;
+  period_ = std::min(max_, period_ * 2);
+  return period;
+}
+
+void pimegaPollScheduler::collect(double *pollRate, double *wakeupRate) {
+  uint64_t polls = numPolls_.load(std::memory_order_relaxed);
+  uint64_t wakeups = numWakeups_.load(std::memory_order_relaxed);
+  double time = now();
+  double interval = time - lastCollect_;
+
+  *pollRate = interval > 0 ? (polls - lastPolls_) / interval : 0;
+  *wakeupRate = interval > 0 ? (wakeups - lastWakeups_) / interval : 0;
+  lastPolls_ = polls;
+  lastWakeups_ = wakeups;
+  lastCollect_ = time;
+}
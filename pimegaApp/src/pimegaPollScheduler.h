@@ -0,0 +1,54 @@
+/*
+ * pimegaPollScheduler.h
+ *
+ * Wait times of the acquisition and capture state machines. They poll fast
+ * around the time a run is expected to end and whenever the status moves, and
+ * back off exponentially while nothing happens. The waits are on the stop
+ * events, so a stop is seen at once whatever the period.
+ */
+
+#ifndef PIMEGA_POLL_SCHEDULER_H
+#define PIMEGA_POLL_SCHEDULER_H
+
+#include <stdint.h>
+
+#include <atomic>
+
+/* Shortest and longest wait between two polls, in seconds */
+#define POLL_PERIOD_MIN 0.001
+#define POLL_PERIOD_MAX 0.1
+/* Seconds of fast polling after the expected end of a run */
+#define POLL_END_GRACE 0.5
+
+class pimegaPollScheduler {
+ public:
+  pimegaPollScheduler(double minPeriod = POLL_PERIOD_MIN, double maxPeriod = POLL_PERIOD_MAX);
+
+  /* A run that should end expected seconds from now, 0 when that cannot be
+   * told (external trigger, unbounded capture) */
+  void start(double expected);
+  /* The polled status changed: back to the shortest period */
+  void progress(void);
+  /* How long to wait before the next poll */
+  double next(void);
+
+  void countPoll(void) { numPolls_.fetch_add(1, std::memory_order_relaxed); }
+  void countWakeup(void) { numWakeups_.fetch_add(1, std::memory_order_relaxed); }
+  /* Polls and wakeups per second since the previous call */
+  void collect(double *pollRate, double *wakeupRate);
+
+ private:
+  double min_;
+  double max_;
+  double period_;
+  /* Monotonic time the run should end at, 0 when unknown */
+  double end_;
+
+  std::atomic<uint64_t> numPolls_;
+  std::atomic<uint64_t> numWakeups_;
+  uint64_t lastPolls_;
+  uint64_t lastWakeups_;
+  double lastCollect_;
+};
+
+#endif
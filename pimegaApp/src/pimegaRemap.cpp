@@ -0,0 +1,206 @@
+/* pimegaRemap.cpp
+ *
+ * Remap table. The blocks are first drawn into a per pixel map of raw pixel
+ * indices, which is then run length encoded row by row and thrown away. Runs
+ * of consecutive raw pixels are copied with memcpy; runs along a raw column
+ * (rotated blocks) are gathered in pieces of REMAP_TILE pixels, and each band
+ * is ordered by column piece so a REMAP_TILE x REMAP_TILE tile of the raw
+ * frame stays in cache while it is read.
+ *
+ * Geometry file: one entry per line, # starts a comment.
+ *   size <width> <height>
+ *   block <srcX> <srcY> <width> <height> <dstX> <dstY> <quarter turns>
+ * size is the corrected frame, and comes before the blocks.
+ */
+
+#pragma GCC optimize("O3")
+
+#include "pimegaRemap.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+/* Rows in a band and pixels in a piece of a gathered run */
+#define REMAP_TILE 64
+
+pimegaRemap::pimegaRemap() : srcX_(0), srcY_(0), dstX_(0), dstY_(0) {}
+
+void pimegaRemap::clear(void) {
+  spans_.clear();
+  bands_.clear();
+  srcX_ = srcY_ = dstX_ = dstY_ = 0;
+}
+
+int pimegaRemap::build(const std::vector<pimegaRemapBlock> &blocks, int srcX, int srcY,
+                       int dstX, int dstY, std::string &error) {
+  std::vector<int32_t> map;
+  char message[128];
+
+  clear();
+  if (srcX <= 0 || srcY <= 0 || dstX <= 0 || dstY <= 0) {
+    error = "Invalid frame size";
+    return -1;
+  }
+  map.assign((size_t)dstX * dstY, -1);
+
+  for (size_t i = 0; i < blocks.size(); i++) {
+    const pimegaRemapBlock &b = blocks[i];
+    int turns = ((b.turns % 4) + 4) % 4;
+    int outX = turns % 2 ? b.height : b.width;
+    int outY = turns % 2 ? b.width : b.height;
+
+    if (b.width <= 0 || b.height <= 0 || b.srcX < 0 || b.srcY < 0 || b.srcX + b.width > srcX ||
+        b.srcY + b.height > srcY || b.dstX < 0 || b.dstY < 0 || b.dstX + outX > dstX ||
+        b.dstY + outY > dstY) {
+      snprintf(message, sizeof(message), "Block %d is outside the frame", (int)i + 1);
+      error = message;
+      return -1;
+    }
+    for (int v = 0; v < outY; v++) {
+      for (int u = 0; u < outX; u++) {
+        int x, y;
+        switch (turns) {
+          case 0:
+            x = u, y = v;
+            break;
+          case 1:
+            x = v, y = b.height - 1 - u;
+            break;
+          case 2:
+            x = b.width - 1 - u, y = b.height - 1 - v;
+            break;
+          default:
+            x = b.width - 1 - v, y = u;
+            break;
+        }
+        map[(size_t)(b.dstY + v) * dstX + b.dstX + u] = (b.srcY + y) * srcX + b.srcX + x;
+      }
+    }
+  }
+
+  bands_.push_back(0);
+  for (int band = 0; band * REMAP_TILE < dstY; band++) {
+    size_t first = spans_.size();
+    int lastRow = std::min(dstY, (band + 1) * REMAP_TILE);
+
+    for (int row = band * REMAP_TILE; row < lastRow; row++) {
+      const int32_t *pRow = &map[(size_t)row * dstX];
+      int x = 0;
+      while (x < dstX) {
+        pimegaRemapSpan span;
+        int end = x + 1;
+        span.dst = (uint32_t)((size_t)row * dstX + x);
+        span.src = pRow[x];
+        span.step = 0;
+        if (span.src >= 0 && end < dstX && pRow[end] >= 0) span.step = pRow[end] - pRow[x];
+        while (end < dstX &&
+               (span.src < 0 ? pRow[end] < 0
+                             : pRow[end] >= 0 && pRow[end] - pRow[end - 1] == span.step))
+          end++;
+        /* Gathered runs are cut in tile pieces */
+        if (span.src >= 0 && span.step != 1) end = std::min(end, x + REMAP_TILE);
+        span.length = end - x;
+        spans_.push_back(span);
+        x = end;
+      }
+    }
+    std::stable_sort(spans_.begin() + first, spans_.end(),
+                     [dstX](const pimegaRemapSpan &a, const pimegaRemapSpan &b) {
+                       return a.dst % dstX / REMAP_TILE < b.dst % dstX / REMAP_TILE;
+                     });
+    bands_.push_back(spans_.size());
+  }
+
+  srcX_ = srcX;
+  srcY_ = srcY;
+  dstX_ = dstX;
+  dstY_ = dstY;
+  return 0;
+}
+
+int pimegaRemap::buildFromGeometry(const pimegaGeometry &geometry, int chipGap, int moduleGap,
+                                   std::string &error) {
+  std::vector<pimegaRemapBlock> blocks;
+  int numModules = geometry.modulesX * geometry.modulesY;
+  int numChips = geometry.chipsX * geometry.chipsY;
+  int moduleX = geometry.chipsX * PIMEGA_CHIP_SIZE + (geometry.chipsX - 1) * chipGap;
+  int moduleY = geometry.chipsY * PIMEGA_CHIP_SIZE + (geometry.chipsY - 1) * chipGap;
+
+  if (chipGap < 0 || moduleGap < 0) {
+    error = "Negative gap";
+    return -1;
+  }
+  for (int module = 0; module < numModules; module++) {
+    for (int chip = 0; chip < numChips; chip++) {
+      pimegaRemapBlock b;
+      pimegaChipOrigin(&geometry, module, chip, &b.srcX, &b.srcY);
+      b.width = b.height = PIMEGA_CHIP_SIZE;
+      b.dstX = module % geometry.modulesX * (moduleX + moduleGap) +
+               chip % geometry.chipsX * (PIMEGA_CHIP_SIZE + chipGap);
+      b.dstY = module / geometry.modulesX * (moduleY + moduleGap) +
+               chip / geometry.chipsX * (PIMEGA_CHIP_SIZE + chipGap);
+      b.turns = 0;
+      blocks.push_back(b);
+    }
+  }
+  return build(blocks, geometry.modulesX * geometry.chipsX * PIMEGA_CHIP_SIZE,
+               geometry.modulesY * geometry.chipsY * PIMEGA_CHIP_SIZE,
+               geometry.modulesX * (moduleX + moduleGap) - moduleGap,
+               geometry.modulesY * (moduleY + moduleGap) - moduleGap, error);
+}
+
+int pimegaRemap::buildFromFile(const char *file, int srcX, int srcY, std::string &error) {
+  std::ifstream in(file);
+  std::vector<pimegaRemapBlock> blocks;
+  std::string line, keyword;
+  int dstX = 0, dstY = 0, lineNumber = 0;
+  char message[128];
+
+  clear();
+  if (!in) {
+    error = std::string("Unable to open ") + file;
+    return -1;
+  }
+  while (std::getline(in, line)) {
+    lineNumber++;
+    line = line.substr(0, line.find('#'));
+    std::istringstream fields(line);
+    if (!(fields >> keyword)) continue;
+
+    if (keyword == "size" && fields >> dstX >> dstY) continue;
+    if (keyword == "block" && dstX > 0) {
+      pimegaRemapBlock b;
+      if (fields >> b.srcX >> b.srcY >> b.width >> b.height >> b.dstX >> b.dstY >> b.turns) {
+        blocks.push_back(b);
+        continue;
+      }
+    }
+    snprintf(message, sizeof(message), "%s:%d: invalid entry", file, lineNumber);
+    error = message;
+    return -1;
+  }
+  return build(blocks, srcX, srcY, dstX, dstY, error);
+}
+
+/** Remaps the bands [firstBand, lastBand). Every corrected pixel belongs to
+ * exactly one run, so dst needs no clearing. */
+void pimegaRemap::apply(const uint32_t *src, uint32_t *dst, int firstBand, int lastBand) const {
+  const pimegaRemapSpan *span = spans_.data() + bands_[firstBand];
+  const pimegaRemapSpan *end = spans_.data() + bands_[lastBand];
+
+  for (; span < end; span++) {
+    uint32_t *pDst = dst + span->dst;
+    if (span->src < 0) {
+      memset(pDst, 0, span->length * sizeof(uint32_t));
+    } else if (span->step == 1 || span->length == 1) {
+      memcpy(pDst, src + span->src, span->length * sizeof(uint32_t));
+    } else {
+      const uint32_t *pSrc = src + span->src;
+      for (uint32_t i = 0; i < span->length; i++) pDst[i] = pSrc[(ptrdiff_t)i * span->step];
+    }
+  }
+}
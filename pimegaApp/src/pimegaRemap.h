@@ -0,0 +1,81 @@
+/*
+ * pimegaRemap.h
+ *
+ * Geometry correction of visualizer frames. Rectangular blocks of the raw
+ * frame (chips or whole modules) are placed, rotated by quarter turns, in a
+ * corrected frame that has the gaps between them. The placement is compiled
+ * once into a table of runs of pixels, so each frame is remapped in a single
+ * pass.
+ */
+
+#ifndef PIMEGA_REMAP_H
+#define PIMEGA_REMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "pimegaGeometry.h"
+
+/* One block of the raw frame and where it goes. turns is the number of
+ * clockwise quarter turns. */
+typedef struct pimegaRemapBlock {
+  int srcX;
+  int srcY;
+  int width;
+  int height;
+  int dstX;
+  int dstY;
+  int turns;
+} pimegaRemapBlock;
+
+/* A run of length corrected pixels from dst on. Pixel i of the run is raw
+ * pixel src + i * step, or 0 when src is negative. */
+typedef struct pimegaRemapSpan {
+  uint32_t dst;
+  int32_t src;
+  int32_t step;
+  uint32_t length;
+} pimegaRemapSpan;
+
+class pimegaRemap {
+ public:
+  pimegaRemap();
+
+  /* Compile the blocks for a srcX x srcY raw frame. Returns 0, or -1 with a
+   * message in error. */
+  int build(const std::vector<pimegaRemapBlock> &blocks, int srcX, int srcY, int dstX, int dstY,
+            std::string &error);
+  /* Every chip of the model layout, chipGap pixels apart inside a module and
+   * moduleGap pixels apart between modules */
+  int buildFromGeometry(const pimegaGeometry &geometry, int chipGap, int moduleGap,
+                        std::string &error);
+  /* Blocks from a geometry file, see pimegaRemap.cpp */
+  int buildFromFile(const char *file, int srcX, int srcY, std::string &error);
+  void clear(void);
+
+  bool valid(void) const { return !spans_.empty(); }
+  int getSrcSizeX(void) const { return srcX_; }
+  int getSrcSizeY(void) const { return srcY_; }
+  int getSizeX(void) const { return dstX_; }
+  int getSizeY(void) const { return dstY_; }
+  size_t getNumSpans(void) const { return spans_.size(); }
+
+  /* The table is split in bands of corrected rows that can be remapped in
+   * parallel */
+  int getNumBands(void) const { return (int)bands_.size() - 1; }
+  void apply(const uint32_t *src, uint32_t *dst, int firstBand, int lastBand) const;
+
+ private:
+  int srcX_;
+  int srcY_;
+  int dstX_;
+  int dstY_;
+  std::vector<pimegaRemapSpan> spans_;
+  /* Index of the first span of each band, and the end of the table */
+  std::vector<size_t> bands_;
+};
+
+#endif
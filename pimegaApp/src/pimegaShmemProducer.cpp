@@ -0,0 +1,74 @@
+/* pimegaShmemProducer.cpp
+ *
+ * Stand-in for the backend side of the shared memory frame transport
+ * (frameTransport 3), to run the IOC without a detector or backend. It
+ * opens the ring the IOC created for its visualizer frame port and
+ * publishes synthetic frames into it at a fixed rate.
+ *
+ * Usage: pimegaShmemProducer vis_frame_port [frames per second] [frames]
+ * A rate of 0 publishes as fast as possible, and 0 frames runs until killed.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "pimegaFrameShmem.h"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* A few counts of noise with a bright diagonal that moves every frame */
+static void fillFrame(std::vector<uint32_t> &frame, uint64_t n) {
+  uint32_t state = (uint32_t)n * 2654435761u + 1;
+
+  for (size_t i = 0; i < frame.size(); i++) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    frame[i] = (i + n) % 1031 == 0 ? 1000 : state & 3;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  char name[64];
+  pimegaShmemRing ring;
+  std::vector<uint32_t> frame;
+  double rate, start, next;
+  uint64_t numFrames, n;
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s vis_frame_port [frames per second] [frames]\n", argv[0]);
+    return 1;
+  }
+  snprintf(name, sizeof(name), "%s%s", PIMEGA_SHMEM_PREFIX, argv[1]);
+  rate = argc > 2 ? atof(argv[2]) : 10;
+  numFrames = argc > 3 ? strtoull(argv[3], NULL, 0) : 0;
+
+  printf("Waiting for %s\n", name);
+  while (ring.open(name) != 0) usleep(100000);
+  printf("Publishing %lu byte frames to %d slots\n", (unsigned long)ring.getFrameSize(),
+         ring.getNumSlots());
+
+  frame.resize(ring.getFrameSize() / sizeof(uint32_t));
+  start = next = now();
+  for (n = 0; numFrames == 0 || n < numFrames; n++) {
+    fillFrame(frame, n);
+    if (rate > 0) {
+      next += 1 / rate;
+      while (now() < next) usleep(std::min(1e6 * (next - now()), 1e5));
+    }
+    ring.publish(frame.data());
+    if ((n + 1) % 1000 == 0)
+      printf("%lu frames, %.1f frames/s\n", (unsigned long)(n + 1), (n + 1) / (now() - start));
+  }
+  return 0;
+}
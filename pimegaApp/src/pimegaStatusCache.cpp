@@ -0,0 +1,42 @@
+/* pimegaStatusCache.cpp
+ *
+ * Seqlock around a single snapshot, the same scheme as the slots of the
+ * shared memory frame ring. Writers are rare (at most one per status update)
+ * and readers only copy a few hundred bytes, so one copy is enough.
+ */
+
+#include "pimegaStatusCache.h"
+
+#include <string.h>
+
+#include "pimegaFrameTiming.h"
+
+pimegaStatusCache::pimegaStatusCache() : seq_(0) {
+  memset(&snapshot_, 0, sizeof(snapshot_));
+  writeLock_ = epicsMutexMustCreate();
+}
+
+pimegaStatusCache::~pimegaStatusCache() { epicsMutexDestroy(writeLock_); }
+
+void pimegaStatusCache::publish(const acq_status_return_t &status) {
+  epicsMutexLock(writeLock_);
+  uint64_t seq = seq_.load(std::memory_order_relaxed);
+  seq_.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(&snapshot_.status, &status, sizeof(status));
+  snapshot_.version = seq / 2 + 1;
+  snapshot_.timestamp = pimegaWallTime();
+  seq_.store(seq + 2, std::memory_order_release);
+  epicsMutexUnlock(writeLock_);
+}
+
+void pimegaStatusCache::read(pimegaStatusSnapshot *snapshot) const {
+  uint64_t seq;
+
+  do {
+    seq = seq_.load(std::memory_order_acquire);
+    if (seq & 1) continue;
+    memcpy(snapshot, &snapshot_, sizeof(*snapshot));
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((seq & 1) || seq_.load(std::memory_order_relaxed) != seq);
+}
@@ -0,0 +1,46 @@
+/*
+ * pimegaStatusCache.h
+ *
+ * The latest backend acquisition status, shared by the driver threads. The
+ * capture task is the only one that gets the status from the backend; it
+ * publishes every one it gets here, and the other threads read a consistent
+ * copy without a lock.
+ */
+
+#ifndef PIMEGA_STATUS_CACHE_H
+#define PIMEGA_STATUS_CACHE_H
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include <epicsMutex.h>
+#include <pimega.h>
+
+typedef struct pimegaStatusSnapshot {
+  acq_status_return_t status;
+  /* Number of statuses published up to this one, 0 before the first */
+  uint64_t version;
+  /* Wall clock time it was published at */
+  double timestamp;
+} pimegaStatusSnapshot;
+
+class pimegaStatusCache {
+ public:
+  pimegaStatusCache();
+  ~pimegaStatusCache();
+
+  void publish(const acq_status_return_t &status);
+  /* Copies the newest snapshot. Retries while a publish is in progress, which
+   * only takes the time of a copy. */
+  void read(pimegaStatusSnapshot *snapshot) const;
+
+ private:
+  /* Seqlock: odd while a publish is writing the snapshot */
+  std::atomic<uint64_t> seq_;
+  pimegaStatusSnapshot snapshot_;
+  /* Serializes publishers, the fetcher and the reset at acquisition start */
+  epicsMutexId writeLock_;
+};
+
+#endif
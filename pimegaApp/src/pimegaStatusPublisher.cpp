@@ -0,0 +1,131 @@
+/* pimegaStatusPublisher.cpp
+ *
+ * The messages of a batch are kept per thread, so acqTask and captureTask
+ * can batch at the same time, and a message sent from any other thread, like
+ * the ones from writeInt32, goes out at once. Messages are compared up to
+ * their terminating NUL, since the driver passes the size of the buffer they
+ * are in.
+ */
+
+#include "pimegaStatusPublisher.h"
+
+#include <string.h>
+
+#include <utility>
+#include <vector>
+
+#include "pimegaFrameTiming.h"
+
+typedef struct pendingBatch {
+  pimegaStatusPublisher *owner;
+  std::vector<std::pair<int, std::string> > messages;
+} pendingBatch;
+
+static thread_local pendingBatch batch = {NULL, std::vector<std::pair<int, std::string> >()};
+
+pimegaStatusPublisher::pimegaStatusPublisher(asynPortDriver *driver)
+    : driver_(driver),
+      numMessagesEmitted_(0),
+      numMessagesSuppressed_(0),
+      numParamsEmitted_(0),
+      numParamsSuppressed_(0) {
+  lock_ = epicsMutexMustCreate();
+}
+
+pimegaStatusPublisher::~pimegaStatusPublisher() { epicsMutexDestroy(lock_); }
+
+void pimegaStatusPublisher::publish(int param, const std::string &message) {
+  std::map<int, std::string>::iterator it;
+
+  epicsMutexLock(lock_);
+  it = published_.find(param);
+  if (it != published_.end() && it->second == message) {
+    numMessagesSuppressed_++;
+  } else {
+    published_[param] = message;
+    numMessagesEmitted_++;
+    driver_->doCallbacksInt8Array((epicsInt8 *)message.c_str(), (int)message.size() + 1, param,
+                                  0);
+  }
+  epicsMutexUnlock(lock_);
+}
+
+void pimegaStatusPublisher::message(int param, const char *message, int size) {
+  std::string text(message, strnlen(message, size));
+
+  if (batch.owner != this) {
+    publish(param, text);
+    return;
+  }
+  for (size_t i = 0; i < batch.messages.size(); i++) {
+    if (batch.messages[i].first == param) {
+      /* Overridden within the iteration, never seen by a client */
+      batch.messages[i].second = text;
+      epicsMutexLock(lock_);
+      numMessagesSuppressed_++;
+      epicsMutexUnlock(lock_);
+      return;
+    }
+  }
+  batch.messages.push_back(std::make_pair(param, text));
+}
+
+void pimegaStatusPublisher::begin(void) {
+  batch.owner = this;
+  batch.messages.clear();
+}
+
+void pimegaStatusPublisher::end(void) {
+  batch.owner = NULL;
+  for (size_t i = 0; i < batch.messages.size(); i++)
+    publish(batch.messages[i].first, batch.messages[i].second);
+  batch.messages.clear();
+  flushParams(pimegaTimeNs() / 1e9);
+  driver_->callParamCallbacks();
+}
+
+/** Sets the held back values whose period has passed */
+void pimegaStatusPublisher::flushParams(double now) {
+  std::map<int, limitedParam>::iterator it;
+
+  epicsMutexLock(lock_);
+  for (it = limited_.begin(); it != limited_.end(); ++it) {
+    limitedParam &limited = it->second;
+    if (!limited.pending || now - limited.time < limited.period) continue;
+    limited.time = now;
+    limited.value = limited.pendingValue;
+    limited.pending = false;
+    numParamsEmitted_++;
+    driver_->setDoubleParam(it->first, limited.value);
+  }
+  epicsMutexUnlock(lock_);
+}
+
+void pimegaStatusPublisher::setDouble(int param, double value, double period) {
+  double now = pimegaTimeNs() / 1e9;
+  std::map<int, limitedParam>::iterator it;
+
+  epicsMutexLock(lock_);
+  it = limited_.find(param);
+  /* A value already held back is replaced by this one, so it is never set */
+  if (it != limited_.end() && it->second.pending) {
+    it->second.pending = false;
+    numParamsSuppressed_++;
+  }
+  if (it != limited_.end() && it->second.value == value) {
+    numParamsSuppressed_++;
+  } else if (it != limited_.end() && value != 0 && now - it->second.time < period) {
+    it->second.period = period;
+    it->second.pending = true;
+    it->second.pendingValue = value;
+  } else {
+    limitedParam &limited = limited_[param];
+    limited.time = now;
+    limited.value = value;
+    limited.period = period;
+    limited.pending = false;
+    numParamsEmitted_++;
+    driver_->setDoubleParam(param, value);
+  }
+  epicsMutexUnlock(lock_);
+}
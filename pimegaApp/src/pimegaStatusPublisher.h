@@ -0,0 +1,75 @@
+/*
+ * pimegaStatusPublisher.h
+ *
+ * Publishes the status message waveforms and the fast changing params of the
+ * state machine threads to Channel Access only when there is something new,
+ * so a thread that loops every millisecond does not flood the monitors.
+ */
+
+#ifndef PIMEGA_STATUS_PUBLISHER_H
+#define PIMEGA_STATUS_PUBLISHER_H
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+#include <epicsMutex.h>
+
+#include "asynPortDriver.h"
+
+/* Seconds between two updates of ADTimeRemaining */
+#define TIME_REMAINING_PERIOD 0.1
+
+class pimegaStatusPublisher {
+ public:
+  pimegaStatusPublisher(asynPortDriver *driver);
+  ~pimegaStatusPublisher();
+
+  /* Publishes message, size bytes at most, on the Int8 array param unless it
+   * is the message the PV already has. Between begin() and end() only the
+   * last message of each param is published, at end(). */
+  void message(int param, const char *message, int size);
+
+  /* Collects the messages of the calling thread until end(), which publishes
+   * them and the held back params whose period has passed, and then does the
+   * param callbacks of the loop iteration once */
+  void begin(void);
+  void end(void);
+
+  /* Sets param unless it has that value already. A value that comes less
+   * than period seconds after the last one set is held back and set by the
+   * first end() after the period, unless a newer value replaces it. A value
+   * of 0 is not held back, so a countdown ends on it. */
+  void setDouble(int param, double value, double period);
+
+  uint64_t getNumMessagesEmitted(void) { return numMessagesEmitted_; }
+  uint64_t getNumMessagesSuppressed(void) { return numMessagesSuppressed_; }
+  uint64_t getNumParamsEmitted(void) { return numParamsEmitted_; }
+  uint64_t getNumParamsSuppressed(void) { return numParamsSuppressed_; }
+
+ private:
+  void publish(int param, const std::string &message);
+  void flushParams(double now);
+
+  asynPortDriver *driver_;
+  /* Protects the fields below */
+  epicsMutexId lock_;
+  std::map<int, std::string> published_;
+  typedef struct limitedParam {
+    /* Time and value of the last set */
+    double time;
+    double value;
+    double period;
+    /* Newest value held back, not set yet */
+    bool pending;
+    double pendingValue;
+  } limitedParam;
+  std::map<int, limitedParam> limited_;
+  uint64_t numMessagesEmitted_;
+  uint64_t numMessagesSuppressed_;
+  uint64_t numParamsEmitted_;
+  uint64_t numParamsSuppressed_;
+};
+
+#endif
@@ -0,0 +1,137 @@
+/* pimegaStatusSubscriber.cpp
+ *
+ * Status push channel. The backend publishes a two part ZMQ message on
+ * PIMEGA_STATUS_TOPIC every time its acquisition status changes: the topic
+ * followed by the acq_status_return structure as it is in memory, the same
+ * way the frames are sent. Only the newest status is kept, so a burst of
+ * updates is seen as one by the capture task.
+ */
+
+#include "pimegaStatusSubscriber.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <zmq.h>
+
+#include "pimegaThreadPlacement.h"
+
+static const char *subscriberName = "pimegaStatusSubscriber";
+
+/* Receive timeout, so the thread notices stop() */
+#define RECEIVE_TIMEOUT_MS 100
+
+static void receiveTaskC(void *drvPvt) {
+  pimegaStatusSubscriber *pPvt = (pimegaStatusSubscriber *)drvPvt;
+  pPvt->receiveTask();
+}
+
+pimegaStatusSubscriber::pimegaStatusSubscriber(const char *address, const std::string &topic,
+                                               size_t statusSize, epicsEventId notifyEvent)
+    : address_(address),
+      topic_(topic),
+      statusSize_(statusSize),
+      notifyEvent_(notifyEvent),
+      context_(NULL),
+      socket_(NULL),
+      running_(false),
+      numErrors_(0),
+      latest_(statusSize),
+      numUpdates_(0) {
+  exitedEventId_ = epicsEventMustCreate(epicsEventEmpty);
+  lock_ = epicsMutexMustCreate();
+}
+
+pimegaStatusSubscriber::~pimegaStatusSubscriber() {
+  stop();
+  epicsMutexDestroy(lock_);
+  epicsEventDestroy(exitedEventId_);
+}
+
+int pimegaStatusSubscriber::start(void) {
+  int timeout = RECEIVE_TIMEOUT_MS;
+
+  context_ = zmq_ctx_new();
+  socket_ = zmq_socket(context_, ZMQ_SUB);
+  if (!socket_) {
+    printf("%s: zmq_socket failed: %s\n", subscriberName, zmq_strerror(zmq_errno()));
+    return -1;
+  }
+  zmq_setsockopt(socket_, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+  zmq_setsockopt(socket_, ZMQ_SUBSCRIBE, topic_.c_str(), topic_.size());
+  if (zmq_connect(socket_, address_.c_str()) != 0) {
+    printf("%s: unable to connect to %s: %s\n", subscriberName, address_.c_str(),
+           zmq_strerror(zmq_errno()));
+    return -1;
+  }
+
+  running_ = true;
+  if (epicsThreadCreate("pimegaStatusRx", epicsThreadPriorityHigh,
+                        epicsThreadGetStackSize(epicsThreadStackSmall),
+                        (EPICSTHREADFUNC)receiveTaskC, this) == NULL) {
+    running_ = false;
+    printf("%s: epicsThreadCreate failure for receive task\n", subscriberName);
+    return -1;
+  }
+  return 0;
+}
+
+void pimegaStatusSubscriber::stop(void) {
+  if (running_) {
+    running_ = false;
+    epicsEventWait(exitedEventId_);
+  }
+  if (socket_) zmq_close(socket_);
+  if (context_) zmq_ctx_term(context_);
+  socket_ = context_ = NULL;
+}
+
+bool pimegaStatusSubscriber::take(void *dst, uint64_t *seen) {
+  bool updated = false;
+
+  epicsMutexLock(lock_);
+  if (numUpdates_ != *seen) {
+    memcpy(dst, latest_.data(), statusSize_);
+    *seen = numUpdates_;
+    updated = true;
+  }
+  epicsMutexUnlock(lock_);
+  return updated;
+}
+
+/** Status messages of the wrong size come from a backend built against
+ * another version of the status structure; they are counted and dropped. */
+void pimegaStatusSubscriber::receiveTask(void) {
+  std::vector<char> status(statusSize_);
+  char topic[256];
+  int more, size;
+  size_t moreSize;
+
+  pimegaApplyPlacement(PIMEGA_THREAD_CAPTURE);
+  while (running_) {
+    if (zmq_recv(socket_, topic, sizeof(topic), 0) < 0) continue;
+    more = 0;
+    moreSize = sizeof(more);
+    zmq_getsockopt(socket_, ZMQ_RCVMORE, &more, &moreSize);
+    if (!more) {
+      numErrors_++;
+      continue;
+    }
+
+    size = zmq_recv(socket_, status.data(), status.size(), 0);
+    if (size < 0 || (size_t)size != statusSize_) {
+      if (size >= 0 && numErrors_ == 0)
+        printf("%s: unexpected status size %d, expected %lu\n", subscriberName, size,
+               (unsigned long)statusSize_);
+      numErrors_++;
+      continue;
+    }
+
+    epicsMutexLock(lock_);
+    memcpy(latest_.data(), status.data(), statusSize_);
+    numUpdates_++;
+    epicsMutexUnlock(lock_);
+    epicsEventSignal(notifyEvent_);
+  }
+  pimegaLeavePlacement();
+  epicsEventSignal(exitedEventId_);
+}
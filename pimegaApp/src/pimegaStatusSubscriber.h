@@ -0,0 +1,62 @@
+/*
+ * pimegaStatusSubscriber.h
+ *
+ * Receives the acquisition status the backend pushes whenever it changes, so
+ * the capture task does not have to ask for it in a tight loop.
+ */
+
+#ifndef PIMEGA_STATUS_SUBSCRIBER_H
+#define PIMEGA_STATUS_SUBSCRIBER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+
+/* Topic of the status messages, on the visualizer endpoint */
+#define PIMEGA_STATUS_TOPIC "pimega_acq_status"
+
+class pimegaStatusSubscriber {
+ public:
+  /* statusSize is the size of the status structure the backend sends.
+   * notifyEvent is signalled after every update. */
+  pimegaStatusSubscriber(const char *address, const std::string &topic, size_t statusSize,
+                         epicsEventId notifyEvent);
+  ~pimegaStatusSubscriber();
+
+  int start(void);
+  void stop(void);
+
+  /* Copies the newest status to dst if it is newer than the update number in
+   * *seen, and updates *seen. Returns false when there was nothing new. */
+  bool take(void *dst, uint64_t *seen);
+
+  uint64_t getNumUpdates(void) { return numUpdates_; }
+  uint64_t getNumErrors(void) { return numErrors_; }
+
+  void receiveTask(void);
+
+ private:
+  std::string address_;
+  std::string topic_;
+  size_t statusSize_;
+  epicsEventId notifyEvent_;
+
+  void *context_;
+  void *socket_;
+  volatile bool running_;
+  epicsEventId exitedEventId_;
+  uint64_t numErrors_;
+
+  /* Protects the fields below */
+  epicsMutexId lock_;
+  std::vector<char> latest_;
+  uint64_t numUpdates_;
+};
+
+#endif
@@ -0,0 +1,272 @@
+/* pimegaThreadPlacement.cpp
+ *
+ * Thread placement. A role is configured from iocsh with
+ *   pimegaThreadPlacement(role, cpus, priority, numaNode)
+ * where role is receive, dispatch, workers, acquire, capture, alarm or
+ * buffers. The affinity and memory policy calls go straight to the kernel,
+ * so the driver does not need libnuma. SCHED_FIFO needs CAP_SYS_NICE or an
+ * rtprio limit; without them the thread keeps the default scheduler and a
+ * warning is printed.
+ */
+
+#include "pimegaThreadPlacement.h"
+
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <epicsThread.h>
+
+static const char *placementName = "pimegaThreadPlacement";
+
+static const char *roleNames[PIMEGA_NUM_THREAD_ROLES] = {
+    "receive", "dispatch", "workers", "acquire", "capture", "alarm", "buffers"};
+
+/* Node masks are a single long */
+#define MAX_NUMA_NODES 63
+
+typedef struct placement {
+  std::string cpus;
+  int priority;
+  int numaNode;
+} placement;
+
+typedef struct placedThread {
+  std::string name;
+  int role;
+  pid_t tid;
+} placedThread;
+
+static std::mutex placementLock;
+static placement placements[PIMEGA_NUM_THREAD_ROLES] = {
+    {"", 0, -1}, {"", 0, -1}, {"", 0, -1}, {"", 0, -1}, {"", 0, -1}, {"", 0, -1}, {"", 0, -1}};
+static std::vector<placedThread> placedThreads;
+
+static pid_t threadId(void) { return (pid_t)syscall(SYS_gettid); }
+
+/* CPU lists are comma separated CPUs or first-last ranges */
+static int parseCpuList(const char *list, cpu_set_t *set) {
+  const char *p = list;
+  char *end;
+  long first, last;
+
+  CPU_ZERO(set);
+  while (*p) {
+    first = last = strtol(p, &end, 10);
+    if (end == p) return -1;
+    p = end;
+    if (*p == '-') {
+      last = strtol(++p, &end, 10);
+      if (end == p) return -1;
+      p = end;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE) return -1;
+    for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, set);
+    if (*p == ',')
+      p++;
+    else if (*p)
+      return -1;
+  }
+  return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+static std::string formatCpuList(const cpu_set_t *set) {
+  std::string list;
+  char range[32];
+
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, set)) continue;
+    int last = cpu;
+    while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) last++;
+    if (last == cpu)
+      snprintf(range, sizeof(range), "%s%d", list.empty() ? "" : ",", cpu);
+    else
+      snprintf(range, sizeof(range), "%s%d-%d", list.empty() ? "" : ",", cpu, last);
+    list += range;
+    cpu = last;
+  }
+  return list;
+}
+
+/* Contents of a one line sysfs or procfs file, without the newline */
+static std::string readLine(const char *path) {
+  char line[1024];
+  FILE *fp = fopen(path, "r");
+
+  if (!fp) return "";
+  if (!fgets(line, sizeof(line), fp)) line[0] = '\0';
+  fclose(fp);
+  line[strcspn(line, "\n")] = '\0';
+  return line;
+}
+
+static std::string nodeCpus(int node) {
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  return readLine(path);
+}
+
+/* The CPU the thread last ran on, field 39 of its stat file */
+static int lastCpu(pid_t tid) {
+  char path[64];
+  std::string stat;
+  size_t pos;
+
+  snprintf(path, sizeof(path), "/proc/self/task/%d/stat", (int)tid);
+  stat = readLine(path);
+  /* The name in field 2 may have spaces, count from the parenthesis after it */
+  pos = stat.rfind(')');
+  for (int field = 2; field < 39 && pos != std::string::npos; field++)
+    pos = stat.find(' ', pos + 1);
+  return pos == std::string::npos ? -1 : atoi(stat.c_str() + pos + 1);
+}
+
+int pimegaSetPlacement(const char *role, const char *cpus, int priority, int numaNode) {
+  cpu_set_t set;
+  int index;
+
+  for (index = 0; index < PIMEGA_NUM_THREAD_ROLES; index++)
+    if (role && strcmp(role, roleNames[index]) == 0) break;
+  if (index == PIMEGA_NUM_THREAD_ROLES) {
+    printf("%s: unknown thread role %s\n", placementName, role ? role : "");
+    return -1;
+  }
+  if (!cpus) cpus = "";
+  if (*cpus && parseCpuList(cpus, &set) != 0) {
+    printf("%s: invalid CPU list %s\n", placementName, cpus);
+    return -1;
+  }
+  if (priority < 0 || priority > sched_get_priority_max(SCHED_FIFO)) {
+    printf("%s: priority %d is outside 0..%d\n", placementName, priority,
+           sched_get_priority_max(SCHED_FIFO));
+    return -1;
+  }
+  if (numaNode < -1 || numaNode >= MAX_NUMA_NODES ||
+      (numaNode >= 0 && nodeCpus(numaNode).empty())) {
+    printf("%s: there is no NUMA node %d\n", placementName, numaNode);
+    return -1;
+  }
+  if (index == PIMEGA_THREAD_BUFFERS && (*cpus || priority)) {
+    printf("%s: only the NUMA node applies to the buffers\n", placementName);
+    return -1;
+  }
+
+  std::lock_guard<std::mutex> guard(placementLock);
+  placements[index].cpus = cpus;
+  placements[index].priority = priority;
+  placements[index].numaNode = numaNode;
+  return 0;
+}
+
+void pimegaApplyPlacement(int role) {
+  placement p;
+  placedThread thread;
+  cpu_set_t set;
+  std::string cpus;
+
+  {
+    std::lock_guard<std::mutex> guard(placementLock);
+    p = placements[role];
+  }
+  thread.name = epicsThreadGetNameSelf();
+  thread.role = role;
+  thread.tid = threadId();
+
+  /* A node without a CPU list runs the thread on the CPUs of the node */
+  cpus = p.cpus.empty() && p.numaNode >= 0 ? nodeCpus(p.numaNode) : p.cpus;
+  if (!cpus.empty() &&
+      (parseCpuList(cpus.c_str(), &set) != 0 || sched_setaffinity(0, sizeof(set), &set) != 0))
+    printf("%s: unable to run %s on CPUs %s: %s\n", placementName, thread.name.c_str(),
+           cpus.c_str(), strerror(errno));
+
+  if (p.priority > 0) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = p.priority;
+    int rc = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (rc != 0)
+      printf("%s: unable to give %s SCHED_FIFO priority %d: %s\n", placementName,
+             thread.name.c_str(), p.priority, strerror(rc));
+  }
+
+  if (p.numaNode >= 0) {
+    unsigned long mask = 1ul << p.numaNode;
+    /* The kernel reads one bit less than maxnode */
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, 8 * sizeof(mask) + 1) != 0)
+      printf("%s: unable to prefer NUMA node %d for %s: %s\n", placementName, p.numaNode,
+             thread.name.c_str(), strerror(errno));
+  }
+
+  std::lock_guard<std::mutex> guard(placementLock);
+  placedThreads.push_back(thread);
+}
+
+void pimegaLeavePlacement(void) {
+  pid_t tid = threadId();
+
+  std::lock_guard<std::mutex> guard(placementLock);
+  for (size_t i = 0; i < placedThreads.size(); i++) {
+    if (placedThreads[i].tid == tid) {
+      placedThreads.erase(placedThreads.begin() + i);
+      return;
+    }
+  }
+}
+
+/** The buffers go on the node of the receive threads unless they have one of
+ * their own */
+int pimegaGetNumaNode(int role) {
+  std::lock_guard<std::mutex> guard(placementLock);
+  if (role == PIMEGA_THREAD_BUFFERS && placements[role].numaNode < 0)
+    return placements[PIMEGA_THREAD_RECEIVE].numaNode;
+  return placements[role].numaNode;
+}
+
+int pimegaBindToNode(void *addr, size_t size, int node) {
+  uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  uintptr_t first = ((uintptr_t)addr + page - 1) & ~(page - 1);
+  uintptr_t last = ((uintptr_t)addr + size) & ~(page - 1);
+  unsigned long mask;
+
+  if (node < 0 || node >= MAX_NUMA_NODES || last <= first) return 0;
+  mask = 1ul << node;
+  if (syscall(SYS_mbind, first, last - first, MPOL_PREFERRED, &mask, 8 * sizeof(mask) + 1, 0) !=
+      0)
+    return -1;
+  return 0;
+}
+
+void pimegaReportPlacement(FILE *fp) {
+  std::lock_guard<std::mutex> guard(placementLock);
+
+  for (int i = 0; i < PIMEGA_NUM_THREAD_ROLES; i++) {
+    const placement &p = placements[i];
+    if (p.cpus.empty() && p.priority == 0 && p.numaNode < 0) continue;
+    fprintf(fp, "  Placement %-9s CPUs %s, priority %d, NUMA node %d\n", roleNames[i],
+            p.cpus.empty() ? "-" : p.cpus.c_str(), p.priority, p.numaNode);
+  }
+
+  for (size_t i = 0; i < placedThreads.size(); i++) {
+    const placedThread &t = placedThreads[i];
+    struct sched_param param;
+    cpu_set_t set;
+    int policy = sched_getscheduler(t.tid);
+    std::string cpus = sched_getaffinity(t.tid, sizeof(set), &set) == 0 ? formatCpuList(&set) : "?";
+
+    if (policy < 0 || sched_getparam(t.tid, &param) != 0) param.sched_priority = 0;
+    fprintf(fp, "  Thread %-20s %-8s tid %d, CPUs %s, %s %d, last on CPU %d\n", t.name.c_str(),
+            roleNames[t.role], (int)t.tid, cpus.c_str(),
+            policy == SCHED_FIFO ? "fifo" : policy == SCHED_RR ? "rr" : "other",
+            param.sched_priority, lastCpu(t.tid));
+  }
+}
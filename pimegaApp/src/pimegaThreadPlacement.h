@@ -0,0 +1,54 @@
+/*
+ * pimegaThreadPlacement.h
+ *
+ * CPU affinity, real time priority and NUMA node of the driver threads. The
+ * placement of each kind of thread is set from iocsh before
+ * pimegaDetectorConfig, and every thread applies its own when it starts.
+ */
+
+#ifndef PIMEGA_THREAD_PLACEMENT_H
+#define PIMEGA_THREAD_PLACEMENT_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+typedef enum pimega_thread_role_t {
+  /* Frame receive threads: pimegaFrameRx and the per module receivers */
+  PIMEGA_THREAD_RECEIVE = 0,
+  /* pimegaDispatchTask */
+  PIMEGA_THREAD_DISPATCH = 1,
+  /* The frame kernel worker pool */
+  PIMEGA_THREAD_WORKERS = 2,
+  /* pimegaDetTask */
+  PIMEGA_THREAD_ACQUIRE = 3,
+  /* pimegacaptureTask and the status subscriber it waits on */
+  PIMEGA_THREAD_CAPTURE = 4,
+  /* pimegaAlarmTask */
+  PIMEGA_THREAD_ALARM = 5,
+  /* Not a thread: the NUMA node the frame buffers are allocated on */
+  PIMEGA_THREAD_BUFFERS = 6,
+  PIMEGA_NUM_THREAD_ROLES = 7
+} pimega_thread_role_t;
+
+/* Sets the placement of a role, by its name in pimegaThreadPlacement.cpp.
+ * cpus is a CPU list like "2-5,8", empty or NULL to keep the affinity, or to
+ * use the CPUs of numaNode when there is one. priority is a SCHED_FIFO
+ * priority, 0 to keep the default scheduler. numaNode is where the memory of
+ * the threads comes from, -1 for the default. Returns 0, or -1 after printing
+ * why. */
+int pimegaSetPlacement(const char *role, const char *cpus, int priority, int numaNode);
+
+/* Called by a thread of the role when it starts, and by the threads that
+ * exit before the IOC does when they stop */
+void pimegaApplyPlacement(int role);
+void pimegaLeavePlacement(void);
+
+int pimegaGetNumaNode(int role);
+/* Prefers node for the pages in [addr, addr + size) that are not mapped yet.
+ * Only the whole pages in the range are bound. */
+int pimegaBindToNode(void *addr, size_t size, int node);
+
+/* The configured placements and where every started thread is now */
+void pimegaReportPlacement(FILE *fp);
+
+#endif
@@ -0,0 +1,92 @@
+/* pimegaWorkerPool.cpp
+ *
+ * Worker threads for the frame kernels. Each run() splits a frame in a few
+ * tiles; the calling thread works on them too, so a pool with no threads
+ * just runs everything inline.
+ */
+
+#include "pimegaWorkerPool.h"
+
+#include <stdio.h>
+
+#include "pimegaThreadPlacement.h"
+
+static void workerTaskC(void *drvPvt) {
+  pimegaWorkerPool::worker *w = (pimegaWorkerPool::worker *)drvPvt;
+  w->pool->workerTask(w->wakeEvent);
+}
+
+pimegaWorkerPool::pimegaWorkerPool(const char *name, int numThreads, int role)
+    : role_(role), task_(NULL), numTasks_(0), next_(0), pending_(0) {
+  char threadName[32];
+
+  lock_ = epicsMutexMustCreate();
+  doneEvent_ = epicsEventMustCreate(epicsEventEmpty);
+
+  for (int i = 0; i < numThreads; i++) {
+    worker *w = new worker;
+    w->pool = this;
+    w->wakeEvent = epicsEventMustCreate(epicsEventEmpty);
+    workers_.push_back(w);
+
+    snprintf(threadName, sizeof(threadName), "%s%d", name, i);
+    if (epicsThreadCreate(threadName, epicsThreadPriorityMedium,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+                          (EPICSTHREADFUNC)workerTaskC, w) == NULL) {
+      printf("pimegaWorkerPool: epicsThreadCreate failure for %s\n", threadName);
+      workers_.pop_back();
+      epicsEventDestroy(w->wakeEvent);
+      delete w;
+      break;
+    }
+  }
+}
+
+/* The pool lives as long as the driver, the threads are not joined */
+pimegaWorkerPool::~pimegaWorkerPool() {}
+
+void pimegaWorkerPool::workerTask(epicsEventId wakeEvent) {
+  pimegaApplyPlacement(role_);
+  while (true) {
+    epicsEventWait(wakeEvent);
+    runTasks();
+  }
+}
+
+void pimegaWorkerPool::runTasks(void) {
+  const Task *task;
+  int index;
+
+  while (true) {
+    epicsMutexLock(lock_);
+    if (next_ >= numTasks_) {
+      epicsMutexUnlock(lock_);
+      return;
+    }
+    index = next_++;
+    task = task_;
+    epicsMutexUnlock(lock_);
+
+    (*task)(index);
+
+    epicsMutexLock(lock_);
+    if (--pending_ == 0) epicsEventSignal(doneEvent_);
+    epicsMutexUnlock(lock_);
+  }
+}
+
+void pimegaWorkerPool::run(int numTasks, const Task &task) {
+  if (numTasks <= 0) return;
+
+  epicsMutexLock(lock_);
+  task_ = &task;
+  numTasks_ = numTasks;
+  next_ = 0;
+  pending_ = numTasks;
+  epicsMutexUnlock(lock_);
+
+  for (size_t i = 0; i < workers_.size() && (int)i < numTasks - 1; i++)
+    epicsEventSignal(workers_[i]->wakeEvent);
+  runTasks();
+  epicsEventWait(doneEvent_);
+}
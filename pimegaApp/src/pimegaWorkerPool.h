@@ -0,0 +1,57 @@
+/*
+ * pimegaWorkerPool.h
+ *
+ * Small pool of threads used to split the work on a frame into tiles.
+ */
+
+#ifndef PIMEGA_WORKER_POOL_H
+#define PIMEGA_WORKER_POOL_H
+
+#include <functional>
+#include <vector>
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+
+class pimegaWorkerPool {
+ public:
+  /* Called once for every task index */
+  typedef std::function<void(int)> Task;
+
+  /* The threads take the placement of role, see pimegaThreadPlacement.h */
+  pimegaWorkerPool(const char *name, int numThreads, int role);
+  ~pimegaWorkerPool();
+
+  /* Number of tasks that run at the same time, the calling thread included */
+  int getConcurrency(void) { return (int)workers_.size() + 1; }
+
+  /* Runs task(0) .. task(numTasks - 1) on the pool threads and the calling
+   * thread. Returns once all of them are done. Only one thread may call run()
+   * at a time. */
+  void run(int numTasks, const Task &task);
+
+  void workerTask(epicsEventId wakeEvent);
+
+  struct worker {
+    pimegaWorkerPool *pool;
+    epicsEventId wakeEvent;
+  };
+
+ private:
+  void runTasks(void);
+
+  std::vector<worker *> workers_;
+  int role_;
+
+  /* Protects the fields below. Tasks are claimed under the lock so a worker
+   * that wakes up late never runs a task of a run that already finished. */
+  epicsMutexId lock_;
+  const Task *task_;
+  int numTasks_;
+  int next_;
+  int pending_;
+  epicsEventId doneEvent_;
+};
+
+#endif
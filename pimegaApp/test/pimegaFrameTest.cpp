@@ -0,0 +1,457 @@
+/* pimegaFrameTest.cpp
+ *
+ * Tests of the parts of the driver that run without an IOC or a detector,
+ * each checked against a scalar reference or the library it has to agree
+ * with. Run with make runtests.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "pimegaEdgeCorrection.h"
+#include "pimegaFrameCodec.h"
+#include "pimegaFrameOps.h"
+#include "pimegaGeometry.h"
+#include "pimegaModuleMetrics.h"
+#include "pimegaPollScheduler.h"
+#include "pimegaRemap.h"
+#include "pimegaThreadPlacement.h"
+#include "pimegaWorkerPool.h"
+
+#ifdef HAVE_BITSHUFFLE
+#include <bitshuffle.h>
+#endif
+
+#ifdef HAVE_BLOSC
+#include <blosc.h>
+#endif
+
+/* pimega_detector_model_t values */
+#define MODEL_PIMEGA135D 3
+#define MODEL_PIMEGA540D 4
+
+static uint32_t nextRandom(void) {
+  static uint32_t state = 12345;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+/* Mostly small counts, with zeros and counts close to saturation */
+static std::vector<uint32_t> randomFrame(size_t n) {
+  std::vector<uint32_t> frame(n);
+
+  for (size_t i = 0; i < n; i++) {
+    uint32_t r = nextRandom();
+    if (r % 5 == 0)
+      frame[i] = 0;
+    else if (r % 17 == 0)
+      frame[i] = UINT32_MAX - r % 64;
+    else
+      frame[i] = r % 100;
+  }
+  return frame;
+}
+
+static uint32_t satAddReference(uint64_t sum) {
+  return sum < UINT32_MAX ? (uint32_t)sum : UINT32_MAX;
+}
+
+/* Widths that are not multiples of the vector sizes exercise the tails */
+static void testBinning(void) {
+  const int bins[] = {1, 2, 3, 4, 8};
+  const size_t widths[] = {37, 64, 131};
+  bool ok = true;
+
+  for (int bx = 0; bx < 5; bx++) {
+    for (int by = 0; by < 5; by++) {
+      for (int w = 0; w < 3; w++) {
+        int binX = bins[bx], binY = bins[by];
+        size_t width = widths[w], height = 25, stride = width + 3;
+        size_t outWidth = width / binX, outHeight = height / binY;
+        std::vector<uint32_t> src = randomFrame(stride * height);
+        std::vector<uint32_t> out(outWidth * outHeight), ref(outWidth * outHeight);
+
+        for (size_t y = 0; y < outHeight; y++) {
+          for (size_t x = 0; x < outWidth; x++) {
+            uint64_t sum = 0;
+            for (int j = 0; j < binY; j++)
+              for (int i = 0; i < binX; i++) sum += src[(y * binY + j) * stride + x * binX + i];
+            ref[y * outWidth + x] = satAddReference(sum);
+          }
+        }
+        pimegaBinFrame(src.data(), stride, width, height, binX, binY, out.data());
+        if (out != ref) {
+          testDiag("binning %dx%d of width %lu differs", binX, binY, (unsigned long)width);
+          ok = false;
+        }
+      }
+    }
+  }
+  testOk(ok, "binning matches the scalar reference");
+}
+
+static void testNarrowing(void) {
+  std::vector<uint32_t> src = randomFrame(1003);
+  std::vector<uint16_t> out16(src.size());
+  std::vector<uint8_t> out8(src.size());
+  bool ok16 = true, ok8 = true;
+
+  pimegaNarrowFrame16(src.data(), src.size(), out16.data());
+  pimegaNarrowFrame8(src.data(), src.size(), out8.data());
+  for (size_t i = 0; i < src.size(); i++) {
+    ok16 &= out16[i] == (src[i] < UINT16_MAX ? src[i] : UINT16_MAX);
+    ok8 &= out8[i] == (src[i] < UINT8_MAX ? src[i] : UINT8_MAX);
+  }
+  testOk(ok16, "narrowing to 16 bits clamps");
+  testOk(ok8, "narrowing to 8 bits clamps");
+}
+
+static void testPacking(void) {
+  size_t n = 1003;
+  std::vector<uint32_t> src = randomFrame(n);
+  std::vector<uint8_t> packed1(pimegaPackedSize(1, n)), packed6(pimegaPackedSize(6, n));
+  std::vector<uint8_t> ref1(packed1.size()), ref6(packed6.size()), out(n);
+  bool ok1 = true, ok6 = true;
+
+  for (size_t i = 0; i < n; i++) {
+    uint32_t pixel = src[i] < 63 ? src[i] : 63;
+    if (src[i]) ref1[i / 8] |= 1 << (i % 8);
+    for (int b = 0; b < 6; b++)
+      if (pixel & (1 << b)) ref6[(6 * i + b) / 8] |= 1 << ((6 * i + b) % 8);
+  }
+  pimegaPackFrame1(src.data(), n, packed1.data());
+  pimegaPackFrame6(src.data(), n, packed6.data());
+  testOk(packed1 == ref1, "1 bit packing matches the documented layout");
+  testOk(packed6 == ref6, "6 bit packing matches the documented layout");
+
+  pimegaUnpackFrame1(packed1.data(), n, out.data());
+  for (size_t i = 0; i < n; i++) ok1 &= out[i] == (src[i] != 0);
+  pimegaUnpackFrame6(packed6.data(), n, out.data());
+  for (size_t i = 0; i < n; i++) ok6 &= out[i] == (src[i] < 63 ? src[i] : 63);
+  testOk(ok1, "1 bit unpacking restores the frame");
+  testOk(ok6, "6 bit unpacking restores the clamped frame");
+}
+
+static void testStats(void) {
+  size_t width = 45, height = 9, stride = 50;
+  std::vector<uint32_t> frame = randomFrame(stride * height);
+  uint32_t saturation = 90;
+  pimegaFrameStats stats, ref;
+
+  pimegaFrameStatsInit(&ref);
+  for (size_t y = 0; y < height; y++) {
+    for (size_t x = 0; x < width; x++) {
+      uint32_t v = frame[y * stride + x];
+      ref.total += v;
+      if (v < ref.min) ref.min = v;
+      if (v > ref.max) ref.max = v;
+      ref.numZeros += v == 0;
+      ref.numSaturated += v >= saturation;
+      ref.numPixels++;
+    }
+  }
+  pimegaFrameStatsInit(&stats);
+  pimegaFrameStatsAdd(frame.data(), stride, width, height, saturation, &stats);
+  testOk(stats.total == ref.total && stats.min == ref.min && stats.max == ref.max &&
+             stats.numZeros == ref.numZeros && stats.numSaturated == ref.numSaturated &&
+             stats.numPixels == ref.numPixels,
+         "statistics match the scalar reference");
+}
+
+static void testMask(void) {
+  size_t width = 61, height = 7, stride = 64, n = stride * height;
+  std::vector<uint32_t> frame = randomFrame(n), masked = frame;
+  std::vector<uint8_t> bad(n);
+  bool ok = true;
+
+  for (size_t i = 0; i < n; i++) bad[i] = nextRandom() % 7 == 0;
+  pimegaMaskFrame(masked.data(), stride, bad.data(), width, height);
+  for (size_t y = 0; y < height; y++) {
+    for (size_t x = 0; x < stride; x++) {
+      size_t i = y * stride + x;
+      ok &= masked[i] == (x < width && bad[i] ? 0 : frame[i]);
+    }
+  }
+  testOk(ok, "mask zeros the bad pixels of the image only");
+}
+
+/* Gains up to 2 take the counts close to saturation past it */
+static void testGain(void) {
+  size_t width = 61, height = 7, stride = 64, n = stride * height;
+  std::vector<uint32_t> frame = randomFrame(n), gained = frame;
+  std::vector<float> gain(n);
+  bool ok = true;
+
+  for (size_t i = 0; i < n; i++) gain[i] = (float)(nextRandom() % 2000) / 1000.0f;
+  pimegaGainFrame(gained.data(), stride, gain.data(), width, height);
+  for (size_t y = 0; y < height; y++) {
+    for (size_t x = 0; x < stride; x++) {
+      size_t i = y * stride + x;
+      float value = (float)frame[i] * gain[i] + 0.5f;
+      uint32_t expected = value <= 0                ? 0
+                          : value >= 4294967040.0f ? UINT32_MAX
+                                                   : (uint32_t)value;
+      ok &= gained[i] == (x < width ? expected : frame[i]);
+    }
+  }
+  testOk(ok, "gain matches the scalar reference");
+}
+
+static uint32_t readUint32BE(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint64_t readUint64BE(const uint8_t *p) {
+  return (uint64_t)readUint32BE(p) << 32 | readUint32BE(p + 4);
+}
+
+/* Sizes with partial blocks and elements left over from the groups of 8 */
+static void testBSLZ4(pimegaWorkerPool *workers) {
+  const size_t sizes[] = {2048, 100003, 1536 * 1536};
+
+  if (!pimegaBSLZ4Available()) {
+    testSkip(3 * 3, "built without bitshuffle");
+    return;
+  }
+#ifdef HAVE_BITSHUFFLE
+  for (int s = 0; s < 3; s++) {
+    size_t n = sizes[s];
+    std::vector<uint32_t> src = randomFrame(n), out(n);
+    std::vector<uint8_t> compressed(pimegaBSLZ4Bound(n, sizeof(uint32_t)));
+    size_t size = pimegaCompressBSLZ4(src.data(), n, sizeof(uint32_t), compressed.data(), workers);
+    int64_t read;
+
+    testOk(size > 12 && readUint64BE(compressed.data()) == n * sizeof(uint32_t) &&
+               readUint32BE(compressed.data() + 8) ==
+                   8192,
+           "bslz4 header of %lu pixels", (unsigned long)n);
+    read = bshuf_decompress_lz4(compressed.data() + 12, out.data(), n, sizeof(uint32_t), 0);
+    testOk(read == (int64_t)(size - 12), "bshuf_decompress_lz4 reads the whole %lu pixel chunk",
+           (unsigned long)n);
+    testOk(out == src, "bslz4 round trip of %lu pixels", (unsigned long)n);
+  }
+#endif
+}
+
+static void testBlosc(void) {
+  const size_t n = 100003;
+
+  if (!pimegaBloscAvailable()) {
+    testSkip(3 * 2, "built without Blosc");
+    return;
+  }
+#ifdef HAVE_BLOSC
+  for (int shuffle = 0; shuffle <= 2; shuffle++) {
+    for (int compressor = PIMEGA_BLOSC_BLOSCLZ; compressor <= PIMEGA_BLOSC_LZ4; compressor++) {
+      std::vector<uint32_t> src = randomFrame(n), out(n);
+      std::vector<uint8_t> compressed(pimegaBloscBound(n, sizeof(uint32_t)));
+      size_t size = pimegaCompressBlosc(src.data(), n, sizeof(uint32_t), compressed.data(), 5,
+                                        shuffle, compressor, 2);
+      int read = size ? blosc_decompress_ctx(compressed.data(), out.data(),
+                                             n * sizeof(uint32_t), 2)
+                      : 0;
+      testOk(read == (int)(n * sizeof(uint32_t)) && out == src,
+             "Blosc round trip, shuffle %d, compressor %d", shuffle, compressor);
+    }
+  }
+#endif
+}
+
+static void testSparse(void) {
+  std::vector<uint32_t> src = randomFrame(1001);
+  std::vector<uint32_t> pairs(2 * src.size());
+  size_t count, expected = 0;
+  bool ok = true;
+
+  for (size_t i = 0; i < src.size(); i++) expected += src[i] != 0;
+  count = pimegaSparseFrame(src.data(), src.size(), 100, pairs.data());
+  for (size_t i = 0, k = 0; i < src.size(); i++) {
+    if (!src[i]) continue;
+    ok &= k < count && pairs[2 * k] == 100 + i && pairs[2 * k + 1] == src[i];
+    k++;
+  }
+  testOk(pimegaCountNonZero(src.data(), src.size()) == expected, "non zero pixels counted");
+  testOk(count == expected && ok, "sparse pairs list every pixel with counts in order");
+}
+
+static void testAccumulation(void) {
+  size_t n = 517;
+  std::vector<uint64_t> acc(n), sums(n);
+  std::vector<uint32_t> out(n);
+  bool ok = true;
+
+  for (int frame = 0; frame < 3; frame++) {
+    std::vector<uint32_t> src = randomFrame(n);
+    pimegaAccumulateFrame(acc.data(), src.data(), n);
+    for (size_t i = 0; i < n; i++) sums[i] += src[i];
+  }
+  pimegaFinishAccumulation(acc.data(), n, 3, out.data());
+  for (size_t i = 0; i < n; i++) ok &= out[i] == satAddReference((sums[i] + 1) / 3) && !acc[i];
+  testOk(ok, "accumulation averages with rounding and clears the sums");
+}
+
+/* Raw pixel i holds i + 1, so every corrected pixel tells where it came from */
+static bool remapsOnce(const pimegaRemap &remap, std::string &why) {
+  size_t srcSize = (size_t)remap.getSrcSizeX() * remap.getSrcSizeY();
+  size_t dstSize = (size_t)remap.getSizeX() * remap.getSizeY();
+  std::vector<uint32_t> src(srcSize), dst(dstSize, UINT32_MAX);
+  std::vector<uint8_t> seen(srcSize);
+  size_t gaps = 0;
+
+  for (size_t i = 0; i < srcSize; i++) src[i] = (uint32_t)i + 1;
+  remap.apply(src.data(), dst.data(), 0, remap.getNumBands());
+  for (size_t i = 0; i < dstSize; i++) {
+    if (dst[i] == 0) {
+      gaps++;
+      continue;
+    }
+    if (dst[i] > srcSize || seen[dst[i] - 1]++) {
+      why = "a corrected pixel is not a raw pixel, or a raw pixel is placed twice";
+      return false;
+    }
+  }
+  if (gaps + srcSize != dstSize) {
+    why = "raw pixels are missing or gaps are not zeroed";
+    return false;
+  }
+  return true;
+}
+
+static void testRemap(void) {
+  pimegaGeometry geometry;
+  pimegaRemap remap;
+  std::string error, why;
+  std::vector<pimegaRemapBlock> blocks;
+
+  pimegaGetGeometry(MODEL_PIMEGA135D, &geometry);
+  testOk(remap.buildFromGeometry(geometry, 3, 0, error) == 0, "135D remap builds");
+  testOk(remapsOnce(remap, why), "135D remap places every raw pixel once %s", why.c_str());
+
+  pimegaGetGeometry(MODEL_PIMEGA540D, &geometry);
+  testOk(remap.buildFromGeometry(geometry, 3, 20, error) == 0, "540D remap builds");
+  testOk(remapsOnce(remap, why), "540D remap places every raw pixel once %s", why.c_str());
+
+  /* Blocks turned by every number of quarter turns */
+  for (int turns = 0; turns < 4; turns++) {
+    pimegaRemapBlock block = {0, 0, 64, 32, 4, 4, turns};
+    blocks.push_back(block);
+    blocks.back().srcY = 32 * turns;
+    blocks.back().dstX = 4 + 70 * turns;
+  }
+  testOk(remap.build(blocks, 64, 128, 300, 80, error) == 0, "rotated blocks build %s",
+         error.c_str());
+  testOk(remapsOnce(remap, why), "rotated blocks place every raw pixel once %s", why.c_str());
+}
+
+static void testEdgeCorrection(void) {
+  pimegaGeometry geometry;
+  pimegaRemap remap;
+  pimegaEdgeCorrection edges;
+  std::string error;
+  uint64_t before = 0, after = 0;
+  size_t gapCounts = 0;
+
+  pimegaGetGeometry(MODEL_PIMEGA540D, &geometry);
+  remap.buildFromGeometry(geometry, 3, 20, error);
+  testOk(edges.build(geometry, 3, 20, error) == 0, "540D edge correction builds");
+
+  std::vector<uint32_t> src((size_t)remap.getSrcSizeX() * remap.getSrcSizeY());
+  std::vector<uint32_t> dst((size_t)remap.getSizeX() * remap.getSizeY());
+  for (size_t i = 0; i < src.size(); i++) src[i] = nextRandom() % 1000;
+  remap.apply(src.data(), dst.data(), 0, remap.getNumBands());
+  for (size_t i = 0; i < dst.size(); i++) before += dst[i];
+  for (int row = 0; row < edges.getNumChipRows(); row++) edges.apply(dst.data(), row);
+  for (size_t i = 0; i < dst.size(); i++) {
+    after += dst[i];
+    gapCounts += dst[i] != 0;
+  }
+  testOk(after == before, "edge correction conserves the counts");
+  testOk(gapCounts > src.size() - src.size() / 5, "edge correction fills the gaps");
+}
+
+static void testPollScheduler(void) {
+  pimegaPollScheduler unknown, ending;
+  double period = 0;
+  bool doubling = true;
+
+  unknown.start(0);
+  for (int i = 0; i < 12; i++) {
+    double next = unknown.next();
+    if (i > 0) doubling &= next == (period * 2 < POLL_PERIOD_MAX ? period * 2 : POLL_PERIOD_MAX);
+    period = next;
+  }
+  testOk(doubling && period == POLL_PERIOD_MAX, "polls back off to the longest period");
+  unknown.progress();
+  testOk(unknown.next() == POLL_PERIOD_MIN, "progress polls fast again");
+
+  ending.start(0.001);
+  testOk(ending.next() == POLL_PERIOD_MIN, "polls fast at the expected end");
+  ending.start(100);
+  testOk(ending.next() == POLL_PERIOD_MAX, "polls slowly long before the expected end");
+}
+
+static void testModuleMetrics(void) {
+  pimegaModuleMetrics metrics;
+  pimegaModuleRates rates;
+  acq_status_return_t status;
+  double processed[PIMEGA_NUM_WINDOWS], saved[PIMEGA_NUM_WINDOWS];
+
+  /* 1000 fps that restart at 70 s and go on at 500 fps, frames lost and the
+   * RDMA buffer filling at 2 %/s from 80 s */
+  memset(&status, 0, sizeof(status));
+  for (int t = 0; t <= 90; t++) {
+    status.STATUS_NOOFFRAMES[0] = t < 70 ? t * 1000 : (t - 70) * 500;
+    status.STATUS_LOSTFRAMECNT[0] = t > 80 ? (t - 80) * 10 : 0;
+    status.STATUS_BUFFERUSED[0] = t > 80 ? 0.2f + 0.02f * (t - 80) : 0.2f;
+    status.processedImageNum = t * 900;
+    status.STATUS_SAVEDFRAMENUM = t * 800;
+    metrics.sample(status, 100 + t);
+  }
+  metrics.moduleRates(0, &rates);
+  testOk(rates.received[PIMEGA_WINDOW_1S] == 500 && rates.received[PIMEGA_WINDOW_10S] == 500,
+         "received rate after a counter restart");
+  testOk(rates.received[PIMEGA_WINDOW_60S] > 816 && rates.received[PIMEGA_WINDOW_60S] < 817,
+         "60 s received rate spans the restart");
+  testOk(rates.lost[PIMEGA_WINDOW_10S] == 10, "lost frame rate");
+  testOk(rates.timeToFull > 29.9 && rates.timeToFull < 30.1, "time to a full RDMA buffer");
+  metrics.backendRates(processed, saved);
+  testOk(processed[PIMEGA_WINDOW_60S] == 900 && saved[PIMEGA_WINDOW_1S] == 800,
+         "processed and saved rates");
+  metrics.moduleRates(1, &rates);
+  testOk(rates.timeToFull == -1 && rates.received[PIMEGA_WINDOW_60S] == 0, "idle module");
+}
+
+MAIN(pimegaFrameTest) {
+  pimegaWorkerPool *workers;
+
+  testPlan(0);
+  testDiag("Frame kernels use %s", pimegaFrameOpsISA());
+  workers = new pimegaWorkerPool("pimegaTestWorker", 3, PIMEGA_THREAD_WORKERS);
+
+  testBinning();
+  testNarrowing();
+  testPacking();
+  testStats();
+  testMask();
+  testGain();
+  testBSLZ4(workers);
+  testBlosc();
+  testSparse();
+  testAccumulation();
+  testRemap();
+  testEdgeCorrection();
+  testPollScheduler();
+  testModuleMetrics();
+
+  delete workers;
+  return testDone();
+}